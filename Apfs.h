@@ -25,26 +25,32 @@
 class Apfs : public FileSystem
 {
 public:
-	Apfs(Device &src, uint64_t offset);
+	Apfs(Device &src, uint64_t offset, uint64_t size);
 	~Apfs();
 
-	uint64_t GetOccupiedSize() const override;
-	int CopyData(Device & dst) override;
+	static bool Probe(Device &src, uint64_t offset);
+
+	int GetExtents(ExtentList &extents) override;
+
+	// Checks the Fletcher-64 checksum of an object
+	static bool VerifyBlock(const void *data, size_t size);
 
 private:
-	int CopyViaSM(Device &dst, uint64_t sm_paddr, uint32_t sm_size);
-	int CopyCAB(Device &dst, uint64_t cab_paddr);
-	int CopyCIB(Device &dst, uint64_t cib_paddr);
+	int FindLatestCheckpoint(const uint8_t *xp_desc, uint32_t desc_blocks, uint32_t &sb_idx);
+	int ListViaSM(ExtentList &extents, uint64_t sm_paddr, uint32_t sm_size);
+	int ListCAB(ExtentList &extents, uint64_t cab_paddr);
+	int ListCIB(ExtentList &extents, uint64_t cib_paddr);
 
-	int ReadBlock(uint64_t paddr, void *data, size_t size = 0x1000);
-	int ReadVerifiedBlock(uint64_t paddr, void *data, size_t size = 0x1000);
-	int WriteBlock(Device &dev, uint64_t paddr, void *data, size_t size = 0x1000);
-	int CopyRange(Device &dst, uint64_t paddr, uint64_t blocks);
+	bool SetBlockSize(uint32_t block_size);
+
+	// size 0 means one block
+	int ReadBlock(uint64_t paddr, void *data, size_t size = 0);
+	int ReadVerifiedBlock(uint64_t paddr, void *data, size_t size = 0);
+	void AddRange(ExtentList &extents, uint64_t paddr, uint64_t blocks);
 
-	static bool VerifyBlock(const void *data, size_t size);
 	static uint64_t Fletcher64(const uint32_t *data, size_t cnt, uint64_t init);
 
-	Device &m_srcdev;
-	const uint64_t m_offset;
-	uint8_t *m_buf;
+	uint32_t m_block_size;
+	int m_block_shift;
+	uint8_t *m_meta_buf;
 };
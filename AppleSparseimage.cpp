@@ -25,6 +25,7 @@
 #include <endian.h>
 
 #include "AppleSparseimage.h"
+#include "ExtentList.h"
 
 static constexpr int SECTOR_SIZE = 0x200;
 static constexpr size_t NODE_SIZE = 0x1000;
@@ -55,6 +56,7 @@ AppleSparseimage::AppleSparseimage()
 	m_next_free_band = 0;
 	m_next_index_node_nr = 0;
 	m_band_size = 0;
+	m_create_band_size = BAND_SIZE;
 	m_band_size_shift = 0;
 	m_fd = -1;
 	m_writable = false;
@@ -65,6 +67,15 @@ AppleSparseimage::~AppleSparseimage()
 	Close();
 }
 
+bool AppleSparseimage::SetBandSize(uint32_t size)
+{
+	if (size < MIN_BAND_SIZE || size > MAX_BAND_SIZE || (size & (size - 1)) != 0)
+		return false;
+
+	m_create_band_size = size;
+	return true;
+}
+
 int AppleSparseimage::Create(const char* name, uint64_t size)
 {
 	Close();
@@ -77,7 +88,7 @@ int AppleSparseimage::Create(const char* name, uint64_t size)
 
 	m_hdr.signature = SPRS_SIGNATURE;
 	m_hdr.version = 3;
-	m_hdr.sectors_per_band = BAND_SIZE / SECTOR_SIZE;
+	m_hdr.sectors_per_band = m_create_band_size / SECTOR_SIZE;
 	m_hdr.flags = 1; // ?
 	m_hdr.next_index_node_offset = 0;
 	m_hdr.total_sectors = size / SECTOR_SIZE;
@@ -90,11 +101,10 @@ int AppleSparseimage::Create(const char* name, uint64_t size)
 	m_file_size = NODE_SIZE;
 	m_next_free_band = 0;
 	m_next_index_node_nr = 0;
-	m_band_size = BAND_SIZE;
+	m_band_size = m_create_band_size;
 	m_band_size_shift = ilog2(m_band_size); // TODO: ILog2
 
-	m_band_offset.clear();
-	m_band_offset.resize((m_drive_size + m_band_size - 1) / m_band_size, 0);
+	m_band_offset.Reset((m_drive_size + m_band_size - 1) / m_band_size);
 
 	return 0;
 }
@@ -122,6 +132,13 @@ int AppleSparseimage::Open(const char* name, bool writable)
 		return EINVAL;
 	}
 
+	// Read() maps offsets to bands with a shift and a mask. Checked before multiplying, so it can't wrap.
+	if (m_hdr.sectors_per_band < MIN_BAND_SIZE / SECTOR_SIZE || m_hdr.sectors_per_band > MAX_BAND_SIZE / SECTOR_SIZE ||
+		(m_hdr.sectors_per_band & (m_hdr.sectors_per_band - 1)) != 0) {
+		Close();
+		return EINVAL;
+	}
+
 	m_drive_size = m_hdr.total_sectors * SECTOR_SIZE;
 	m_band_size = m_hdr.sectors_per_band * SECTOR_SIZE;
 	m_band_size_shift = ilog2(m_band_size); // TODO: ILog2
@@ -131,13 +148,17 @@ int AppleSparseimage::Open(const char* name, bool writable)
 	m_next_free_band = 0;
 	m_next_index_node_nr = 0;
 
-	m_band_offset.resize((m_drive_size + m_band_size - 1) / m_band_size, 0);
+	m_band_offset.Reset((m_drive_size + m_band_size - 1) / m_band_size);
 
 	offset = NODE_SIZE;
 	for (n = 0; n < 0x3F0; n++) {
 		if (m_hdr.band_id[n] == 0)
 			break;
-		m_band_offset[m_hdr.band_id[n] - 1] = offset;
+		if (m_hdr.band_id[n] > m_band_offset.Count()) {
+			Close();
+			return EINVAL;
+		}
+		m_band_offset.Set(m_hdr.band_id[n] - 1, offset);
 		offset += m_band_size;
 	}
 	m_next_free_band = n;
@@ -146,11 +167,19 @@ int AppleSparseimage::Open(const char* name, bool writable)
 	while (node_offset) {
 		m_current_node_offset = node_offset;
 		ReadIndex(m_idx, node_offset);
+		if (m_idx.signature != SPRS_SIGNATURE) {
+			Close();
+			return EINVAL;
+		}
 		offset += NODE_SIZE;
 		for (n = 0; n < 0x3F2; n++) {
 			if (m_idx.band_id[n] == 0)
 				break;
-			m_band_offset[m_hdr.band_id[n] - 1] = offset;
+			if (m_idx.band_id[n] > m_band_offset.Count()) {
+				Close();
+				return EINVAL;
+			}
+			m_band_offset.Set(m_idx.band_id[n] - 1, offset);
 			offset += m_band_size;
 		}
 		m_next_free_band = n;
@@ -174,6 +203,70 @@ void AppleSparseimage::Close()
 
 	close(m_fd);
 	m_fd = -1;
+	m_writable = false;
+}
+
+int AppleSparseimage::Flush()
+{
+	if (!m_writable)
+		return 0;
+
+	if (m_current_node_offset)
+		WriteIndex(m_idx, m_current_node_offset);
+	else
+		WriteHeader(m_hdr);
+
+	if (fdatasync(m_fd))
+		return errno;
+
+	return 0;
+}
+
+int AppleSparseimage::GetAllocatedExtents(ExtentList& extents)
+{
+	uint64_t offset;
+	uint64_t size;
+
+	for (size_t band = m_band_offset.Next(0); band < m_band_offset.Count(); band = m_band_offset.Next(band + 1)) {
+		offset = static_cast<uint64_t>(band) << m_band_size_shift;
+		size = m_band_size;
+		if (offset + size > m_drive_size)
+			size = m_drive_size - offset;
+		extents.Add(offset, size);
+	}
+
+	return 0;
+}
+
+int AppleSparseimage::Reserve(const ExtentList& extents)
+{
+	size_t band;
+	size_t last;
+	bool grown = false;
+
+	if (!m_writable)
+		return EACCES;
+
+	for (const Extent &ext : extents) {
+		if (ext.size == 0)
+			continue;
+		if (ext.offset + ext.size > m_drive_size)
+			return EINVAL;
+
+		last = (ext.offset + ext.size - 1) >> m_band_size_shift;
+		for (band = ext.offset >> m_band_size_shift; band <= last; band++) {
+			if (m_band_offset.Get(band) == 0) {
+				AllocBand(band, false);
+				grown = true;
+			}
+		}
+	}
+
+	// Until the data arrives, the reserved bands are holes in the file.
+	if (grown && ftruncate64(m_fd, m_file_size))
+		return errno;
+
+	return 0;
 }
 
 int AppleSparseimage::Read(void* data, size_t size, uint64_t offset)
@@ -195,12 +288,19 @@ int AppleSparseimage::Read(void* data, size_t size, uint64_t offset)
 			read_size = m_band_size - offset_in_band;
 		else
 			read_size = size;
-		band_offset = m_band_offset[band_id];
+		band_offset = m_band_offset.Get(band_id);
 		if (band_offset == 0) {
 			memset(out_data, 0, read_size);
+			nread = read_size;
 		} else {
+			// Bands written in order are usually consecutive in the file as well, read those in one go.
+			while (read_size < size && m_band_offset.Get(band_id + 1) == m_band_offset.Get(band_id) + m_band_size) {
+				band_id++;
+				read_size += (size - read_size > m_band_size) ? m_band_size : size - read_size;
+			}
 			nread = pread64(m_fd, out_data, read_size, band_offset + offset_in_band);
 			if (nread < 0) return errno;
+			if (nread == 0) return EIO;
 		}
 
 		size -= nread;
@@ -233,7 +333,7 @@ int AppleSparseimage::Write(const void* data, size_t size, uint64_t offset)
 			write_size = m_band_size - offset_in_band;
 		else
 			write_size = size;
-		band_offset = m_band_offset[band_id];
+		band_offset = m_band_offset.Get(band_id);
 		if (band_offset == 0)
 			band_offset = AllocBand(band_id);
 		nwritten = pwrite64(m_fd, in_data, write_size, band_offset + offset_in_band);
@@ -247,6 +347,61 @@ int AppleSparseimage::Write(const void* data, size_t size, uint64_t offset)
 	return 0;
 }
 
+int AppleSparseimage::CopyFrom(int src_fd, uint64_t offset, uint64_t size)
+{
+	uint64_t band_offset;
+	uint64_t next_offset;
+	uint32_t band_id;
+	uint32_t offset_in_band;
+	size_t copy_size;
+	off64_t in_offset;
+	off64_t out_offset;
+	ssize_t ncopied;
+
+	if ((offset + size) > m_drive_size)
+		return EINVAL;
+
+	if (!m_writable)
+		return EACCES;
+
+	while (size > 0) {
+		band_id = offset >> m_band_size_shift;
+		offset_in_band = offset & (m_band_size - 1);
+		if ((offset_in_band + size) > m_band_size)
+			copy_size = m_band_size - offset_in_band;
+		else
+			copy_size = size;
+		band_offset = m_band_offset.Get(band_id);
+		if (band_offset == 0)
+			band_offset = AllocBand(band_id);
+
+		// Bands allocated in a row are contiguous in the file, those are copied with a single call.
+		while (copy_size < size) {
+			band_id++;
+			next_offset = m_band_offset.Get(band_id);
+			if (next_offset == 0)
+				next_offset = AllocBand(band_id);
+			if (next_offset != band_offset + offset_in_band + copy_size)
+				break;
+			copy_size += size - copy_size > m_band_size ? m_band_size : size - copy_size;
+		}
+
+		in_offset = offset;
+		out_offset = band_offset + offset_in_band;
+		while (copy_size > 0) {
+			ncopied = copy_file_range(src_fd, &in_offset, m_fd, &out_offset, copy_size, 0);
+			if (ncopied < 0) return errno;
+			if (ncopied == 0) return EIO;
+
+			copy_size -= ncopied;
+			size -= ncopied;
+			offset += ncopied;
+		}
+	}
+
+	return 0;
+}
+
 void AppleSparseimage::ReadHeader(AppleSparseimage::HeaderNode& hdr)
 {
 	int k;
@@ -321,7 +476,7 @@ void AppleSparseimage::WriteIndex(const AppleSparseimage::IndexNode& idx, uint64
 	pwrite64(m_fd, &idx_be, NODE_SIZE, offset);
 }
 
-uint64_t AppleSparseimage::AllocBand(size_t band_id)
+uint64_t AppleSparseimage::AllocBand(size_t band_id, bool extend)
 {
 	uint64_t off;
 
@@ -343,15 +498,18 @@ uint64_t AppleSparseimage::AllocBand(size_t band_id)
 			m_idx.band_id[n] = 0;
 		m_next_free_band = 0;
 		m_file_size += NODE_SIZE;
+		// Write the new node right away, so that the chain on disk is valid at any time.
+		WriteIndex(m_idx, m_current_node_offset);
 	}
 
 	off = m_file_size;
 	m_file_size += m_band_size;
-	ftruncate(m_fd, m_file_size);
+	if (extend)
+		ftruncate(m_fd, m_file_size);
 	if (m_current_node_offset == 0)
 		m_hdr.band_id[m_next_free_band++] = band_id + 1;
 	else
 		m_idx.band_id[m_next_free_band++] = band_id + 1;
-	m_band_offset[band_id] = off;
+	m_band_offset.Set(band_id, off);
 	return off;
 }
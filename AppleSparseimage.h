@@ -21,11 +21,10 @@
 #include <cstddef>
 #include <cstdint>
 
-#include <vector>
+#include "BandTable.h"
+#include "ImageFile.h"
 
-#include "Device.h"
-
-class AppleSparseimage : public Device
+class AppleSparseimage : public ImageFile
 {
 	struct HeaderNode {
 		uint32_t signature;
@@ -49,15 +48,27 @@ class AppleSparseimage : public Device
 	} __attribute__((packed, aligned(4)));
 
 public:
+	static constexpr uint32_t MIN_BAND_SIZE = 0x1000;
+	static constexpr uint32_t MAX_BAND_SIZE = 0x40000000;
+
 	AppleSparseimage();
 	~AppleSparseimage();
 
-	int Create(const char *name, uint64_t size);
-	int Open(const char *name, bool writable);
-	void Close();
+	// Band size for images created afterwards, a power of two between MIN_BAND_SIZE and MAX_BAND_SIZE.
+	bool SetBandSize(uint32_t size);
+
+	int Create(const char *name, uint64_t size) override;
+	int Open(const char *name, bool writable) override;
+	void Close() override;
+	int Flush() override;
+	int GetAllocatedExtents(ExtentList &extents) override;
+	// Allocates the bands of all extents in ascending order, with a single resize of the file.
+	int Reserve(const ExtentList &extents) override;
+	uint64_t GetAllocationUnit() const override { return m_band_size; }
 
 	int Read(void *data, size_t size, uint64_t offset) override;
 	int Write(const void *data, size_t size, uint64_t offset) override;
+	int CopyFrom(int src_fd, uint64_t offset, uint64_t size) override;
 
 	uint64_t GetSize() const override { return m_drive_size; }
 
@@ -66,15 +77,16 @@ private:
 	void WriteHeader(const HeaderNode &hdr);
 	void ReadIndex(IndexNode &idx, uint64_t offset);
 	void WriteIndex(const IndexNode &idx, uint64_t offset);
-	uint64_t AllocBand(size_t band_id);
+	uint64_t AllocBand(size_t band_id, bool extend = true);
 
-	std::vector<uint64_t> m_band_offset;
+	BandTable m_band_offset;
 	uint64_t m_drive_size;
 	uint64_t m_current_node_offset;
 	uint64_t m_file_size;
 	uint32_t m_next_free_band;
 	uint32_t m_next_index_node_nr;
 	uint32_t m_band_size;
+	uint32_t m_create_band_size;
 	int m_band_size_shift;
 	int m_fd;
 	bool m_writable;
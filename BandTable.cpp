@@ -0,0 +1,69 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "BandTable.h"
+
+BandTable::BandTable()
+{
+	m_count = 0;
+}
+
+BandTable::~BandTable()
+{
+}
+
+void BandTable::Reset(size_t count)
+{
+	m_leaves.clear();
+	m_leaves.resize((count + LEAF_SIZE - 1) >> LEAF_BITS);
+	m_count = count;
+}
+
+void BandTable::Set(size_t band, uint64_t offset)
+{
+	std::unique_ptr<uint64_t[]> &leaf = m_leaves[band >> LEAF_BITS];
+
+	if (!leaf) {
+		if (offset == 0)
+			return;
+		leaf.reset(new uint64_t[LEAF_SIZE]());
+	}
+
+	leaf[band & LEAF_MASK] = offset;
+}
+
+size_t BandTable::Next(size_t band) const
+{
+	const uint64_t *leaf;
+
+	while (band < m_count) {
+		leaf = m_leaves[band >> LEAF_BITS].get();
+		if (!leaf) {
+			// Skip the whole leaf.
+			band = ((band >> LEAF_BITS) + 1) << LEAF_BITS;
+			continue;
+		}
+		if (leaf[band & LEAF_MASK])
+			return band;
+		band++;
+	}
+
+	return m_count;
+}
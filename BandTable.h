@@ -0,0 +1,57 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <memory>
+#include <vector>
+
+// Maps band numbers to file offsets, 0 meaning unallocated. Two-level radix table whose leaves are
+// allocated on first use, so memory grows with the allocated bands instead of the size of the drive.
+class BandTable
+{
+public:
+	BandTable();
+	~BandTable();
+
+	// Drops all entries and makes room for count bands.
+	void Reset(size_t count);
+
+	uint64_t Get(size_t band) const
+	{
+		const uint64_t *leaf = m_leaves[band >> LEAF_BITS].get();
+		return leaf ? leaf[band & LEAF_MASK] : 0;
+	}
+	void Set(size_t band, uint64_t offset);
+
+	size_t Count() const { return m_count; }
+	// First allocated band at or after band, Count() if there is none.
+	size_t Next(size_t band) const;
+
+private:
+	static constexpr unsigned int LEAF_BITS = 12;
+	static constexpr size_t LEAF_SIZE = size_t(1) << LEAF_BITS;
+	static constexpr size_t LEAF_MASK = LEAF_SIZE - 1;
+
+	std::vector<std::unique_ptr<uint64_t[]>> m_leaves;
+	size_t m_count;
+};
@@ -0,0 +1,301 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <thread>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "BatchScheduler.h"
+#include "Sysfs.h"
+#include "ThrottledDevice.h"
+
+#define dbg_printf(...) // printf(__VA_ARGS__)
+
+static uint64_t GetFileSystemId(const std::string &path)
+{
+	size_t slash = path.rfind('/');
+	std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	struct stat st;
+
+	if (stat(dir.c_str(), &st))
+		return 0;
+
+	return st.st_dev;
+}
+
+static uint64_t GetSourceSize(const char *path)
+{
+	off_t size;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	size = lseek(fd, 0, SEEK_END);
+	close(fd);
+
+	return size > 0 ? size : 0;
+}
+
+BatchScheduler::ThrottleScope::ThrottleScope(BatchScheduler* scheduler, BatchScheduler::Job* job, ThrottledDevice& throttle)
+	: m_scheduler(scheduler), m_job(job)
+{
+	if (!m_scheduler)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_scheduler->m_mutex);
+	m_job->throttle = &throttle;
+	m_scheduler->Rebalance(m_job->dst_fs);
+}
+
+BatchScheduler::ThrottleScope::~ThrottleScope()
+{
+	if (!m_scheduler)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_scheduler->m_mutex);
+	m_job->throttle = nullptr;
+}
+
+BatchScheduler::BatchScheduler()
+{
+	m_max_jobs = 0;
+	m_max_per_target = 0;
+	m_target_rate = 0;
+	m_running_count = 0;
+}
+
+BatchScheduler::~BatchScheduler()
+{
+}
+
+int BatchScheduler::Load(const char* name)
+{
+	FILE *f;
+	char line[2 * PATH_MAX + 16];
+	char src[PATH_MAX];
+	char dst[PATH_MAX];
+	unsigned int lineno = 0;
+	int err = 0;
+
+	f = fopen(name, "r");
+	if (!f)
+		return errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (line[strspn(line, " \t\r\n")] == 0 || line[strspn(line, " \t")] == '#')
+			continue;
+
+		if (sscanf(line, "%4095s %4095s", src, dst) != 2) {
+			fprintf(stderr, "%s:%u: expected <source> <destination>\n", name, lineno);
+			err = EINVAL;
+			break;
+		}
+
+		err = AddJob(src, dst);
+		if (err) break;
+	}
+
+	fclose(f);
+	return err;
+}
+
+int BatchScheduler::AddJob(const char* src, const char* dst)
+{
+	Job job;
+
+	job.src = src;
+	job.dst = dst;
+	job.src_disk = GetPhysicalDevice(src);
+	job.dst_fs = GetFileSystemId(job.dst);
+	job.size = GetSourceSize(src);
+	job.result = 0;
+	job.elapsed = 0;
+	job.throttle = nullptr;
+
+	// Two jobs writing the same image would destroy each other's work.
+	for (const Job &other : m_jobs) {
+		if (other.dst == job.dst) {
+			fprintf(stderr, "%s is the destination of more than one job.\n", dst);
+			return EINVAL;
+		}
+	}
+
+	dbg_printf("Job %s (%s) -> %s (fs %lX)\n", src, job.src_disk.c_str(), dst, job.dst_fs);
+
+	m_jobs.push_back(job);
+	return 0;
+}
+
+unsigned int BatchScheduler::GetConcurrency() const
+{
+	std::set<std::string> disks;
+
+	for (const Job &job : m_jobs)
+		disks.insert(job.src_disk);
+
+	if (m_max_jobs && m_max_jobs < disks.size())
+		return m_max_jobs;
+
+	return disks.size();
+}
+
+int BatchScheduler::Run(RunFunc func)
+{
+	std::vector<std::thread> threads;
+	std::vector<size_t> pending;
+	unsigned int max_jobs = GetConcurrency();
+	bool started;
+
+	m_running.assign(m_jobs.size(), false);
+	m_running_count = 0;
+
+	for (size_t k = 0; k < m_jobs.size(); k++)
+		pending.push_back(k);
+	std::stable_sort(pending.begin(), pending.end(), [this](size_t a, size_t b) { return m_jobs[a].size > m_jobs[b].size; });
+
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		while (!pending.empty()) {
+			started = false;
+			if (m_running_count < max_jobs) {
+				for (auto it = pending.begin(); it != pending.end(); ++it) {
+					if (!CanStart(m_jobs[*it]))
+						continue;
+					m_running[*it] = true;
+					m_running_count++;
+					Rebalance(m_jobs[*it].dst_fs);
+					threads.emplace_back(&BatchScheduler::RunJob, this, *it, func);
+					pending.erase(it);
+					started = true;
+					break;
+				}
+			}
+			// Nothing can start before a running job ends.
+			if (!started)
+				m_cond.wait(lock);
+		}
+	}
+
+	for (std::thread &t : threads)
+		t.join();
+
+	for (const Job &job : m_jobs) {
+		if (job.result)
+			return job.result;
+	}
+
+	return 0;
+}
+
+std::string BatchScheduler::GetPhysicalDevice(const char* path)
+{
+	struct stat st;
+	char link[64];
+	std::string dev;
+
+	if (stat(path, &st))
+		return path;
+
+	if (!S_ISBLK(st.st_mode)) {
+		// Image files share the disk of their filesystem.
+		snprintf(link, sizeof(link), "fs:%u:%u", major(st.st_dev), minor(st.st_dev));
+		return link;
+	}
+
+	dev = SysfsDiskDir(path);
+	if (dev.empty())
+		return path;
+
+	return dev.substr(dev.rfind('/') + 1);
+}
+
+// Called with m_mutex held.
+bool BatchScheduler::CanStart(const BatchScheduler::Job& job) const
+{
+	unsigned int on_target = 0;
+
+	for (size_t k = 0; k < m_jobs.size(); k++) {
+		if (!m_running[k])
+			continue;
+		if (m_jobs[k].src_disk == job.src_disk)
+			return false;
+		if (m_jobs[k].dst_fs == job.dst_fs)
+			on_target++;
+	}
+
+	return m_max_per_target == 0 || on_target < m_max_per_target;
+}
+
+// Called with m_mutex held.
+void BatchScheduler::Rebalance(uint64_t fs)
+{
+	ThrottledDevice::Limits limits = { 0, 0, 0 };
+	unsigned int count = 0;
+
+	if (m_target_rate == 0)
+		return;
+
+	for (size_t k = 0; k < m_jobs.size(); k++) {
+		if (m_running[k] && m_jobs[k].dst_fs == fs)
+			count++;
+	}
+	if (count == 0)
+		return;
+
+	limits.bytes_per_sec = m_target_rate / count;
+	dbg_printf("Filesystem %lX: %u jobs, %lu bytes/s each\n", fs, count, limits.bytes_per_sec);
+
+	for (size_t k = 0; k < m_jobs.size(); k++) {
+		if (m_running[k] && m_jobs[k].dst_fs == fs && m_jobs[k].throttle)
+			m_jobs[k].throttle->SetLimits(limits);
+	}
+}
+
+void BatchScheduler::RunJob(size_t idx, BatchScheduler::RunFunc func)
+{
+	Job &job = m_jobs[idx];
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	job.result = func(job);
+	job.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_running[idx] = false;
+		m_running_count--;
+		Rebalance(job.dst_fs);
+	}
+	m_cond.notify_all();
+}
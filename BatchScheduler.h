@@ -0,0 +1,109 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class ThrottledDevice;
+
+// Runs the dumps of several disks at once. Jobs reading from the same physical disk run one after
+// the other, so a disk is never read at two places at once. Jobs writing to the same filesystem
+// can be limited in number, and share a bandwidth limit that is redistributed whenever one of
+// them starts or ends. Larger disks are started first, so that the batch finishes early.
+class BatchScheduler
+{
+public:
+	struct Job
+	{
+		std::string src;
+		std::string dst;
+		// Physical disk behind the source, and the filesystem holding the destination
+		std::string src_disk;
+		uint64_t dst_fs;
+		uint64_t size;
+
+		int result;
+		double elapsed;
+
+		// Destination throttle while the job is copying, see ThrottleScope
+		ThrottledDevice *throttle;
+	};
+
+	// Called on a separate thread for each job.
+	typedef std::function<int(Job &job)> RunFunc;
+
+	// Puts the destination of a job under its share of the filesystem bandwidth while in scope.
+	class ThrottleScope
+	{
+	public:
+		ThrottleScope(BatchScheduler *scheduler, Job *job, ThrottledDevice &throttle);
+		~ThrottleScope();
+
+	private:
+		BatchScheduler *m_scheduler;
+		Job *m_job;
+	};
+
+	BatchScheduler();
+	~BatchScheduler();
+
+	// Reads "<source> <destination>" lines, empty lines and lines starting with # are skipped.
+	int Load(const char *name);
+	int AddJob(const char *src, const char *dst);
+
+	// Concurrent jobs overall (0 = one per source disk) and per destination filesystem (0 = unlimited)
+	void SetMaxJobs(unsigned int jobs) { m_max_jobs = jobs; }
+	void SetMaxPerTarget(unsigned int jobs) { m_max_per_target = jobs; }
+	// Bandwidth in bytes/s shared by the jobs writing to one filesystem, 0 = unlimited
+	void SetTargetRate(uint64_t rate) { m_target_rate = rate; }
+
+	// Number of jobs that will run at the same time, for splitting other budgets between them.
+	unsigned int GetConcurrency() const;
+
+	// Returns the first error of any job. The results of all jobs are in GetJobs().
+	int Run(RunFunc func);
+
+	const std::vector<Job> &GetJobs() const { return m_jobs; }
+
+	// Whole disk behind a block device or partition, or the filesystem holding a regular file.
+	static std::string GetPhysicalDevice(const char *path);
+
+private:
+	bool CanStart(const Job &job) const;
+	void Rebalance(uint64_t fs);
+	void RunJob(size_t idx, RunFunc func);
+
+	std::vector<Job> m_jobs;
+	unsigned int m_max_jobs;
+	unsigned int m_max_per_target;
+	uint64_t m_target_rate;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::vector<bool> m_running;
+	unsigned int m_running_count;
+};
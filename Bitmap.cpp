@@ -0,0 +1,92 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstring>
+#include <endian.h>
+
+#include "Bitmap.h"
+
+static inline uint64_t LoadWord(const uint8_t *bm, size_t widx, size_t nbytes, bool msb_first)
+{
+	uint64_t w = 0;
+	size_t off = widx << 3;
+
+	if (off + 8 <= nbytes)
+		memcpy(&w, bm + off, 8);
+	else
+		memcpy(&w, bm + off, nbytes - off);
+
+	return msb_first ? be64toh(w) : le64toh(w);
+}
+
+static size_t FindBit(const uint8_t *bm, size_t start, size_t end, bool msb_first, bool value)
+{
+	const size_t nbytes = (end + 7) >> 3;
+	size_t widx;
+	unsigned int bit;
+	uint64_t w;
+	size_t pos;
+
+	if (start >= end)
+		return end;
+
+	widx = start >> 6;
+	bit = start & 63;
+
+	for (;;) {
+		w = LoadWord(bm, widx, nbytes, msb_first);
+		if (!value) w = ~w;
+
+		if (msb_first) {
+			w &= ~0ULL >> bit;
+			if (w) {
+				pos = (widx << 6) + __builtin_clzll(w);
+				break;
+			}
+		} else {
+			w &= ~0ULL << bit;
+			if (w) {
+				pos = (widx << 6) + __builtin_ctzll(w);
+				break;
+			}
+		}
+
+		bit = 0;
+		widx++;
+		if ((widx << 6) >= end)
+			return end;
+	}
+
+	return (pos < end) ? pos : end;
+}
+
+size_t BitmapFindSet(const uint8_t *bm, size_t start, size_t end, bool msb_first)
+{
+	return FindBit(bm, start, end, msb_first, true);
+}
+
+size_t BitmapFindClear(const uint8_t *bm, size_t start, size_t end, bool msb_first)
+{
+	return FindBit(bm, start, end, msb_first, false);
+}
+
+bool BufferIsZero(const uint8_t *data, size_t size)
+{
+	return size > 0 && data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+}
@@ -0,0 +1,33 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Word-at-a-time search in allocation bitmaps. Bits are numbered from the LSB
+// of each byte (APFS, FAT, ext4, NTFS) or, if msb_first is set, from the MSB (HFS+).
+// Both return end if no matching bit is found in [start, end).
+
+size_t BitmapFindSet(const uint8_t *bm, size_t start, size_t end, bool msb_first);
+size_t BitmapFindClear(const uint8_t *bm, size_t start, size_t end, bool msb_first);
+
+// True if size > 0 and all bytes of data are zero. Used to leave zero ranges out of images.
+bool BufferIsZero(const uint8_t *data, size_t size);
@@ -0,0 +1,183 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <sys/mman.h>
+
+#include "BufferPool.h"
+#include "Numa.h"
+
+#define dbg_printf(...) // printf(__VA_ARGS__)
+
+// Slabs are multiples of the huge page size, so that the kernel can back them with huge pages.
+static constexpr size_t HUGE_PAGE_SIZE = 0x200000;
+static constexpr size_t SLAB_BUFFERS = 4;
+
+BufferPool& BufferPool::Instance()
+{
+	static BufferPool pool;
+	return pool;
+}
+
+BufferPool::BufferPool()
+{
+	m_numa_aware = false;
+	m_budget = 0;
+	m_allocated = 0;
+	m_in_use = 0;
+	m_peak_in_use = 0;
+}
+
+BufferPool::~BufferPool()
+{
+	for (const Slab &slab : m_slabs)
+		munmap(slab.mem, slab.size);
+}
+
+void BufferPool::SetBudget(uint64_t bytes)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_budget = bytes;
+}
+
+uint64_t BufferPool::GetBudget() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_budget;
+}
+
+void BufferPool::SetNumaAware(bool aware)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_numa_aware = aware;
+}
+
+uint8_t* BufferPool::Acquire(int node)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	uint8_t *buf;
+	size_t k;
+
+	if (node < 0 && m_numa_aware)
+		node = NumaCurrentNode();
+
+	// A buffer of the right node, a new slab on that node, or any buffer if the budget is used up.
+	for (k = m_free.size(); k > 0; k--) {
+		if (node < 0 || m_free[k - 1].node == node)
+			break;
+	}
+	if (k == 0) {
+		if (Grow(node))
+			k = m_free.size();
+		else if (!m_free.empty())
+			k = m_free.size();
+		else
+			return nullptr;
+	}
+
+	buf = m_free[k - 1].buf;
+	m_free.erase(m_free.begin() + (k - 1));
+
+	m_in_use++;
+	if (m_in_use > m_peak_in_use)
+		m_peak_in_use = m_in_use;
+
+	return buf;
+}
+
+void BufferPool::Release(uint8_t* buf)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!buf)
+		return;
+
+	for (const Slab &slab : m_slabs) {
+		if (buf >= reinterpret_cast<uint8_t *>(slab.mem) && buf < reinterpret_cast<uint8_t *>(slab.mem) + slab.size) {
+			m_free.push_back({ buf, slab.node });
+			break;
+		}
+	}
+	m_in_use--;
+}
+
+uint64_t BufferPool::GetAllocated() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_allocated;
+}
+
+size_t BufferPool::GetPeakInUse() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_peak_in_use;
+}
+
+// Called with m_mutex held.
+bool BufferPool::Grow(int node)
+{
+	size_t count = SLAB_BUFFERS;
+	size_t size;
+	void *mem;
+
+	if (m_budget) {
+		if (m_allocated + BUFFER_SIZE > m_budget)
+			return false;
+		if (m_allocated + count * BUFFER_SIZE > m_budget)
+			count = (m_budget - m_allocated) / BUFFER_SIZE;
+	}
+
+	size = count * BUFFER_SIZE;
+
+	// Reserved huge pages first, then transparent huge pages, which only apply to ranges aligned to
+	// the huge page size. mmap only guarantees page alignment, so the mapping is trimmed to the
+	// first aligned address.
+	mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (mem == MAP_FAILED) {
+		uint8_t *raw;
+		uintptr_t head;
+
+		raw = reinterpret_cast<uint8_t *>(mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+		if (raw == MAP_FAILED)
+			return false;
+
+		head = (HUGE_PAGE_SIZE - reinterpret_cast<uintptr_t>(raw) % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+		if (head)
+			munmap(raw, head);
+		munmap(raw + head + size, HUGE_PAGE_SIZE - head);
+		mem = raw + head;
+
+#ifdef MADV_HUGEPAGE
+		madvise(mem, size, MADV_HUGEPAGE);
+#endif
+		dbg_printf("BufferPool: slab of %zu bytes at %p\n", size, mem);
+	}
+
+	// Nothing has touched the slab yet, so all of it ends up on the node.
+	if (node >= 0 && NumaBindMemory(mem, size, node))
+		node = -1;
+
+	m_slabs.push_back({ mem, size, node });
+	m_allocated += size;
+
+	for (size_t k = count; k > 0; k--)
+		m_free.push_back({ reinterpret_cast<uint8_t *>(mem) + (k - 1) * BUFFER_SIZE, node });
+
+	return true;
+}
@@ -0,0 +1,87 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <mutex>
+#include <vector>
+
+// Process-wide pool of the large I/O buffers used by the copy, verify, compact and restore paths.
+// Buffers are carved out of slabs that are backed by huge pages where the system allows it,
+// and the total size of all slabs is capped by a budget. Each slab can be placed on a NUMA node.
+class BufferPool
+{
+public:
+	// Size of every buffer, aligned to BUFFER_ALIGN so that it can be used with O_DIRECT
+	static constexpr size_t BUFFER_SIZE = 0x400000;
+	static constexpr size_t BUFFER_ALIGN = 0x1000;
+
+	static BufferPool &Instance();
+
+	// Upper limit for the memory of all slabs, 0 = unlimited. Slabs already allocated are kept.
+	void SetBudget(uint64_t bytes);
+	uint64_t GetBudget() const;
+
+	// Once set, buffers are taken from the NUMA node the calling thread runs on.
+	void SetNumaAware(bool aware);
+
+	// Returns nullptr if the budget doesn't allow another buffer. Never blocks, so callers
+	// holding buffers can't deadlock each other; they make do with fewer buffers instead.
+	// node selects the NUMA node of the buffer, -1 = any (or the current one if NUMA aware).
+	uint8_t *Acquire(int node = -1);
+	void Release(uint8_t *buf);
+
+	// Memory of all slabs, and the most buffers that were in use at once
+	uint64_t GetAllocated() const;
+	size_t GetPeakInUse() const;
+
+private:
+	BufferPool();
+	~BufferPool();
+	BufferPool(const BufferPool &) = delete;
+	BufferPool &operator=(const BufferPool &) = delete;
+
+	bool Grow(int node);
+
+	struct Slab
+	{
+		void *mem;
+		size_t size;
+		// NUMA node the slab was placed on, -1 = wherever the pages were first touched
+		int node;
+	};
+
+	struct FreeBuffer
+	{
+		uint8_t *buf;
+		int node;
+	};
+
+	mutable std::mutex m_mutex;
+	std::vector<Slab> m_slabs;
+	std::vector<FreeBuffer> m_free;
+	bool m_numa_aware;
+	uint64_t m_budget;
+	uint64_t m_allocated;
+	size_t m_in_use;
+	size_t m_peak_in_use;
+};
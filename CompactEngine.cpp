@@ -0,0 +1,139 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+
+#include "CompactEngine.h"
+#include "Bitmap.h"
+#include "BufferPool.h"
+#include "Device.h"
+#include "Progress.h"
+
+#define dbg_printf(...) // printf(__VA_ARGS__)
+
+static constexpr size_t BUF_SIZE = BufferPool::BUFFER_SIZE;
+// Number of chunks the reader can run ahead of the writer
+static constexpr size_t DEPTH = 4;
+static constexpr uint64_t DEFAULT_GRANULARITY = 0x1000;
+
+CompactEngine::CompactEngine(Device &src, Device &dst) : m_src(src), m_dst(dst), m_reader({ &src }, DEPTH)
+{
+	m_granularity = DEFAULT_GRANULARITY;
+	m_progress = nullptr;
+	m_written = 0;
+	m_dropped = 0;
+}
+
+CompactEngine::~CompactEngine()
+{
+}
+
+int CompactEngine::Compact(const ExtentList& extents)
+{
+	uint64_t offset;
+	uint64_t size;
+	uint64_t done = 0;
+	size_t idx;
+	int err = 0;
+
+	if (m_reader.GetDepth() == 0)
+		return ENOMEM;
+
+	m_chunks.clear();
+	m_written = 0;
+	m_dropped = 0;
+
+	// Chunks end at multiples of BUF_SIZE, so that granules never straddle two chunks.
+	for (const Extent &ext : extents) {
+		for (offset = ext.offset; offset < ext.offset + ext.size; offset += size) {
+			size = BUF_SIZE - offset % BUF_SIZE;
+			if (size > ext.offset + ext.size - offset) size = ext.offset + ext.size - offset;
+			m_chunks.push_back({ offset, size });
+		}
+	}
+
+	m_reader.Start(m_chunks);
+
+	for (idx = 0; idx < m_chunks.size(); idx++) {
+		const ReadAhead::Slot &slot = m_reader.Wait(idx);
+		const Extent &chunk = m_chunks[idx];
+
+		err = slot.err[0];
+		if (err) {
+			fprintf(stderr, "Error %d reading the image at %" PRIX64 "\n", err, chunk.offset);
+			break;
+		}
+
+		err = WriteChunk(slot.buf[0], chunk.size, chunk.offset);
+		if (err) {
+			fprintf(stderr, "Error %d writing the image at %" PRIX64 "\n", err, chunk.offset);
+			break;
+		}
+
+		done += chunk.size;
+		if (m_progress)
+			m_progress->Update(done);
+
+		m_reader.Release(idx);
+	}
+
+	m_reader.Stop();
+
+	return err;
+}
+
+int CompactEngine::WriteChunk(const uint8_t* data, size_t size, uint64_t offset)
+{
+	size_t pos = 0;
+	size_t run;
+	size_t len;
+	int err;
+
+	while (pos < size) {
+		// Skip zero granules, then collect the following non-zero ones into a single write.
+		for (;;) {
+			len = m_granularity - (offset + pos) % m_granularity;
+			if (len > size - pos) len = size - pos;
+			if (len == 0 || !BufferIsZero(data + pos, len))
+				break;
+			m_dropped += len;
+			pos += len;
+		}
+
+		for (run = 0; pos + run < size; run += len) {
+			len = m_granularity - (offset + pos + run) % m_granularity;
+			if (len > size - pos - run) len = size - pos - run;
+			if (BufferIsZero(data + pos + run, len))
+				break;
+		}
+
+		if (run > 0) {
+			dbg_printf("Compact %" PRIX64 " L %zX\n", offset + pos, run);
+			err = m_dst.Write(data + pos, run, offset + pos);
+			if (err) return err;
+			m_written += run;
+			pos += run;
+		}
+	}
+
+	return 0;
+}
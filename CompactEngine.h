@@ -0,0 +1,65 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+#include "ExtentList.h"
+#include "ReadAhead.h"
+
+class Device;
+class Progress;
+
+// Rewrites the allocated ranges of an image into a new image, in logical order.
+// Ranges that are all zeros are left out, so they take no space in the new image.
+// One thread reads ahead while the calling thread writes.
+class CompactEngine
+{
+public:
+	CompactEngine(Device &src, Device &dst);
+	~CompactEngine();
+
+	// Zero ranges are dropped in units of this size, aligned to it. Usually the allocation unit of the new image.
+	void SetZeroGranularity(uint64_t size) { m_granularity = size; }
+	void SetProgress(Progress *progress) { m_progress = progress; }
+
+	// extents must be sorted. The destination must be freshly created, so that skipped ranges read as zeros.
+	int Compact(const ExtentList &extents);
+
+	uint64_t GetWritten() const { return m_written; }
+	uint64_t GetDropped() const { return m_dropped; }
+
+private:
+	int WriteChunk(const uint8_t *data, size_t size, uint64_t offset);
+
+	Device &m_src;
+	Device &m_dst;
+	uint64_t m_granularity;
+	Progress *m_progress;
+
+	std::vector<Extent> m_chunks;
+	ReadAhead m_reader;
+
+	uint64_t m_written;
+	uint64_t m_dropped;
+};
@@ -0,0 +1,316 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "BufferPool.h"
+#include "CopyEngine.h"
+#include "Device.h"
+#include "ExtentList.h"
+#include "Manifest.h"
+#include "Progress.h"
+#include "RescueMap.h"
+
+#define dbg_printf(...) // printf(__VA_ARGS__)
+
+static constexpr size_t BUF_SIZE = BufferPool::BUFFER_SIZE;
+// Delay before the first retry of a bad sector, doubled for each further retry
+static constexpr unsigned int RETRY_DELAY_US = 10000;
+
+// Errors of the medium, which recovery can read around. Anything else (a device that went away,
+// for example) stops the copy, so that it can be resumed.
+static bool IsMediaError(int err)
+{
+	return err == EIO || err == ENODATA || err == EILSEQ;
+}
+
+CopyEngine::CopyEngine(Device &src, Device &dst) : m_src(src), m_dst(dst)
+{
+	m_buf = BufferPool::Instance().Acquire();
+	m_request_size = BUF_SIZE;
+	m_bridge_gap = 0;
+	m_reads_saved = 0;
+	m_gap_bytes = 0;
+	m_checkpoint_interval = 0;
+	m_since_checkpoint = 0;
+	m_progress = nullptr;
+	m_copied = 0;
+	m_done_offset = 0;
+	m_manifest = nullptr;
+	m_zero_copy = true;
+	m_rescue_map = nullptr;
+	m_retries = 0;
+	m_last_bad_end = UINT64_MAX;
+}
+
+CopyEngine::~CopyEngine()
+{
+	BufferPool::Instance().Release(m_buf);
+}
+
+void CopyEngine::SetCheckpoint(uint64_t interval, CheckpointFunc func)
+{
+	m_checkpoint_interval = interval;
+	m_checkpoint = func;
+	m_since_checkpoint = 0;
+}
+
+void CopyEngine::SetRequestSize(size_t size)
+{
+	m_request_size = (size > 0 && size < BUF_SIZE) ? size : BUF_SIZE;
+}
+
+void CopyEngine::SetRecovery(RescueMap* map, unsigned int retries)
+{
+	m_rescue_map = map;
+	m_retries = retries;
+}
+
+int CopyEngine::Copy(const ExtentList& extents, uint64_t start_offset)
+{
+	uint64_t offset;
+	size_t count;
+	bool bridge;
+	int err;
+
+	if (!m_buf)
+		return ENOMEM;
+
+	m_done_offset = start_offset;
+
+	// Copies inside the kernel cost no read requests that could be saved.
+	bridge = m_bridge_gap > 0 && !(m_zero_copy && !m_manifest && m_src.GetFileDescriptor() >= 0);
+
+	for (size_t k = 0; k < extents.Count(); k++) {
+		const Extent &ext = extents[k];
+
+		if (ext.offset + ext.size <= start_offset)
+			continue;
+
+		offset = ext.offset < start_offset ? start_offset : ext.offset;
+		count = bridge ? BridgeCount(extents, k, offset) : 1;
+		if (count > 1) {
+			err = CopyBridged(extents, k, count, offset);
+			k += count - 1;
+		} else {
+			err = CopyExtent(offset, ext.offset + ext.size - offset);
+		}
+		if (err) return err;
+	}
+
+	if (m_checkpoint && extents.Count() > 0)
+		return m_checkpoint(extents[extents.Count() - 1].offset + extents[extents.Count() - 1].size);
+
+	return 0;
+}
+
+int CopyEngine::CopyExtent(uint64_t offset, uint64_t size)
+{
+	size_t bsize;
+	int src_fd;
+	int err;
+
+	dbg_printf("CopyExtent %" PRIX64 " L %" PRIX64 "\n", offset, size);
+
+	// The manifest needs to see the data, so it always goes through the buffer.
+	src_fd = (m_zero_copy && !m_manifest) ? m_src.GetFileDescriptor() : -1;
+
+	while (size > 0) {
+		bsize = size;
+		if (bsize > m_request_size) bsize = m_request_size;
+		err = src_fd >= 0 ? CopyInKernel(src_fd, offset, bsize) : ENOTSUP;
+		if (err == ENOTSUP) {
+			src_fd = -1;
+			err = m_src.Read(m_buf, bsize, offset);
+			if (m_rescue_map && IsMediaError(err))
+				err = RecoverRange(m_buf, bsize, offset);
+			if (err) return err;
+			if (m_manifest)
+				m_manifest->Add(m_buf, bsize, offset);
+			err = m_dst.Write(m_buf, bsize, offset);
+		}
+		if (err) return err;
+		offset += bsize;
+		size -= bsize;
+
+		err = Advance(bsize, offset);
+		if (err) return err;
+	}
+
+	return 0;
+}
+
+// Number of extents from first on that fit into one request together, with all gaps
+// between them below m_bridge_gap. offset is where copying starts in the first one.
+size_t CopyEngine::BridgeCount(const ExtentList& extents, size_t first, uint64_t offset) const
+{
+	uint64_t end = extents[first].offset + extents[first].size;
+	size_t k;
+
+	// Only whole extents that would be a single chunk anyway, so the manifest sees the same chunks.
+	for (k = first + 1; k < extents.Count(); k++) {
+		const Extent &ext = extents[k];
+
+		if (ext.offset - end >= m_bridge_gap || ext.offset + ext.size - offset > m_request_size)
+			break;
+		end = ext.offset + ext.size;
+	}
+
+	return end - offset <= m_request_size ? k - first : 1;
+}
+
+int CopyEngine::CopyBridged(const ExtentList& extents, size_t first, size_t count, uint64_t offset)
+{
+	const Extent &last = extents[first + count - 1];
+	const uint64_t span = last.offset + last.size - offset;
+	uint64_t data = 0;
+	uint64_t pos;
+	uint64_t size;
+	int err;
+
+	dbg_printf("CopyBridged %" PRIX64 " L %" PRIX64 ", %zu extents\n", offset, span, count);
+
+	err = m_src.Read(m_buf, span, offset);
+	if (err) {
+		// Maybe a bad sector, in the data or in a gap. One by one, recovery only has to deal with the data.
+		for (size_t k = first; k < first + count && !err; k++) {
+			pos = extents[k].offset < offset ? offset : extents[k].offset;
+			err = CopyExtent(pos, extents[k].offset + extents[k].size - pos);
+		}
+		return err;
+	}
+
+	for (size_t k = first; k < first + count; k++) {
+		pos = extents[k].offset < offset ? offset : extents[k].offset;
+		size = extents[k].offset + extents[k].size - pos;
+
+		if (m_manifest)
+			m_manifest->Add(m_buf + (pos - offset), size, pos);
+		err = m_dst.Write(m_buf + (pos - offset), size, pos);
+		if (err) return err;
+		data += size;
+
+		err = Advance(size, pos + size);
+		if (err) return err;
+	}
+
+	m_reads_saved += count - 1;
+	m_gap_bytes += span - data;
+
+	return 0;
+}
+
+// Accounts for size bytes copied, everything below offset is done.
+int CopyEngine::Advance(uint64_t size, uint64_t offset)
+{
+	m_copied += size;
+	m_done_offset = offset;
+	if (m_progress)
+		m_progress->Update(m_copied);
+
+	m_since_checkpoint += size;
+	if (m_checkpoint && m_since_checkpoint >= m_checkpoint_interval) {
+		m_since_checkpoint = 0;
+		return m_checkpoint(offset);
+	}
+
+	return 0;
+}
+
+// Returns ENOTSUP when the chunk has to be copied through the buffer instead.
+int CopyEngine::CopyInKernel(int src_fd, uint64_t offset, size_t size)
+{
+	int err;
+
+	err = m_dst.CopyFrom(src_fd, offset, size);
+	switch (err) {
+	case 0:
+		return 0;
+	case ENOTSUP:
+	case EXDEV:
+	case EINVAL:
+	case ENOSYS:
+		// Not possible between these files at all, don't try again.
+		dbg_printf("Zero copy not supported (%d)\n", err);
+		m_zero_copy = false;
+		return ENOTSUP;
+	case EIO:
+		// Possibly bad sectors in the source, the buffered copy can read around them.
+		return ENOTSUP;
+	default:
+		return err;
+	}
+}
+
+int CopyEngine::RecoverRange(uint8_t* buf, size_t size, uint64_t offset)
+{
+	const unsigned int sector_size = m_src.GetSectorSize();
+	uint64_t split;
+	size_t part;
+	int err;
+
+	// Split at a sector boundary near the middle. Only the half that fails gets split further,
+	// so healthy parts of the range are read with few large requests.
+	split = (offset + size / 2) / sector_size * sector_size;
+	if (split <= offset || split >= offset + size)
+		return RecoverSector(buf, size, offset);
+
+	part = split - offset;
+	err = m_src.Read(buf, part, offset);
+	if (IsMediaError(err))
+		err = RecoverRange(buf, part, offset);
+	if (err) return err;
+
+	err = m_src.Read(buf + part, size - part, split);
+	if (IsMediaError(err))
+		err = RecoverRange(buf + part, size - part, split);
+	return err;
+}
+
+int CopyEngine::RecoverSector(uint8_t* buf, size_t size, uint64_t offset)
+{
+	unsigned int retries = m_retries;
+	unsigned int delay = RETRY_DELAY_US;
+	unsigned int k;
+	int err;
+
+	// Inside a run of bad sectors, retrying every single one would take forever.
+	if (offset == m_last_bad_end)
+		retries = 0;
+
+	for (k = 0; k < retries; k++) {
+		usleep(delay);
+		delay <<= 1;
+		err = m_src.Read(buf, size, offset);
+		if (!IsMediaError(err))
+			return err;
+	}
+
+	fprintf(stderr, "Unreadable sector at %" PRIX64 "\n", offset);
+
+	memset(buf, 0, size);
+	m_rescue_map->AddBad(offset, size);
+	m_last_bad_end = offset + size;
+	return 0;
+}
@@ -0,0 +1,100 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <functional>
+
+class Device;
+class ExtentList;
+class Manifest;
+class Progress;
+class RescueMap;
+
+// Copies planned extents from the source to the same offsets on the destination.
+class CopyEngine
+{
+public:
+	// Called with the offset below which all extents have been copied. A non-zero result aborts the copy.
+	typedef std::function<int(uint64_t done_offset)> CheckpointFunc;
+
+	CopyEngine(Device &src, Device &dst);
+	~CopyEngine();
+
+	// Calls func whenever at least interval bytes have been copied since the last checkpoint.
+	void SetCheckpoint(uint64_t interval, CheckpointFunc func);
+
+	// Instead of failing on read errors, salvage what can be read and record the rest in map.
+	void SetRecovery(RescueMap *map, unsigned int retries);
+
+	void SetProgress(Progress *progress) { m_progress = progress; }
+	// Hands every chunk to manifest for hashing, after it has been read.
+	void SetManifest(Manifest *manifest) { m_manifest = manifest; }
+	// Largest read and write, at most the size of a pool buffer
+	void SetRequestSize(size_t size);
+	// Extents less than max_gap bytes apart are read together, gap included, as long as they fit
+	// into one request. Only the extents are written. 0 disables this.
+	void SetGapBridging(uint64_t max_gap) { m_bridge_gap = max_gap; }
+
+	// extents must be sorted. Everything below start_offset is skipped, for resuming an interrupted copy.
+	int Copy(const ExtentList &extents, uint64_t start_offset = 0);
+	int CopyExtent(uint64_t offset, uint64_t size);
+
+	// Reads avoided and gap bytes read instead by gap bridging
+	uint64_t GetReadsSaved() const { return m_reads_saved; }
+	uint64_t GetGapBytes() const { return m_gap_bytes; }
+	// Everything planned below this offset has been copied.
+	uint64_t GetDoneOffset() const { return m_done_offset; }
+
+private:
+	size_t BridgeCount(const ExtentList &extents, size_t first, uint64_t offset) const;
+	int CopyBridged(const ExtentList &extents, size_t first, size_t count, uint64_t offset);
+	int Advance(uint64_t size, uint64_t offset);
+	int CopyInKernel(int src_fd, uint64_t offset, size_t size);
+	int RecoverRange(uint8_t *buf, size_t size, uint64_t offset);
+	int RecoverSector(uint8_t *buf, size_t size, uint64_t offset);
+
+	Device &m_src;
+	Device &m_dst;
+	uint8_t *m_buf;
+	size_t m_request_size;
+	uint64_t m_bridge_gap;
+	uint64_t m_reads_saved;
+	uint64_t m_gap_bytes;
+
+	CheckpointFunc m_checkpoint;
+	uint64_t m_checkpoint_interval;
+	uint64_t m_since_checkpoint;
+
+	Progress *m_progress;
+	uint64_t m_copied;
+	uint64_t m_done_offset;
+
+	Manifest *m_manifest;
+
+	// Cleared once the destination turned out not to support copies inside the kernel
+	bool m_zero_copy;
+
+	RescueMap *m_rescue_map;
+	unsigned int m_retries;
+	uint64_t m_last_bad_end;
+};
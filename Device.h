@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <cerrno>
+#include <cstddef>
 #include <cstdint>
 
 class Device
@@ -32,6 +34,13 @@ public:
 	virtual int Write(const void *data, size_t size, uint64_t offset) = 0;
 	virtual uint64_t GetSize() const = 0;
 
+	// Regular file holding the device data at the same offsets, so that copies can stay inside the kernel.
+	// -1 if there is none, or if every access has to go through Read().
+	virtual int GetFileDescriptor() const { return -1; }
+	// Copies size bytes at offset from the regular file src_fd to the same offset, without a user space buffer.
+	// ENOTSUP if the device can't do that, the caller then has to fall back to Read() and Write().
+	virtual int CopyFrom(int src_fd, uint64_t offset, uint64_t size) { (void)src_fd; (void)offset; (void)size; return ENOTSUP; }
+
 	unsigned int GetSectorSize() const { return m_sector_size; }
 	void SetSectorSize(unsigned int size) { m_sector_size = size; }
 
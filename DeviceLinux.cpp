@@ -19,20 +19,31 @@
 #ifdef __linux__
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <linux/fs.h>
 #include <errno.h>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #include "DeviceLinux.h"
 
+// O_DIRECT needs the buffer, the offset and the size aligned to the logical block size, at most 4K.
+static constexpr size_t DIRECT_ALIGN = 0x1000;
+// Buffer for writing zeros where nothing else can zero a range
+static constexpr size_t ZERO_BUF_SIZE = 0x100000;
+
 DeviceLinux::DeviceLinux()
 {
 	m_device = -1;
+	m_buffered = -1;
 	m_size = 0;
+	m_physical_sector_size = 0x200;
+	m_direct = false;
+	m_blkdev = false;
 }
 
 DeviceLinux::~DeviceLinux()
@@ -40,15 +51,36 @@ DeviceLinux::~DeviceLinux()
 	Close();
 }
 
-bool DeviceLinux::Open(const char* name)
+bool DeviceLinux::Open(const char* name, bool writable)
 {
-	m_device = open(name, O_RDONLY | O_LARGEFILE);
+	if (writable) {
+		// O_EXCL makes opening a block device fail with EBUSY while it's mounted.
+		m_device = open(name, O_RDWR | O_LARGEFILE | O_DIRECT | O_EXCL);
+		// Some file systems (tmpfs for example) don't support O_DIRECT.
+		if (m_device < 0 && errno == EINVAL)
+			m_device = open(name, O_RDWR | O_LARGEFILE | O_EXCL);
+		else if (m_device >= 0)
+			m_direct = true;
+	} else {
+		m_device = open(name, O_RDONLY | O_LARGEFILE);
+	}
 
 	if (m_device < 0) {
 		perror("Error opening device: ");
 		return false;
 	}
 
+	if (m_direct) {
+		m_buffered = open(name, O_RDWR | O_LARGEFILE);
+		if (m_buffered < 0) {
+			perror("Error opening device: ");
+			Close();
+			return false;
+		}
+	} else {
+		m_buffered = m_device;
+	}
+
 	struct stat64 st;
 
 	fstat64(m_device, &st);
@@ -56,8 +88,20 @@ bool DeviceLinux::Open(const char* name)
 	if (S_ISREG(st.st_mode)) {
 		m_size = st.st_size;
 	} else if (S_ISBLK(st.st_mode)) {
+		m_blkdev = true;
 		// Hmmm ...
 		ioctl(m_device, BLKGETSIZE64, &m_size);
+
+		int sector_size;
+		unsigned int physical_size;
+
+		// 4Kn disks address everything, the partition tables included, in 4K sectors.
+		if (ioctl(m_device, BLKSSZGET, &sector_size) == 0 && sector_size >= 0x200)
+			SetSectorSize(sector_size);
+		if (ioctl(m_device, BLKPBSZGET, &physical_size) == 0 && physical_size >= GetSectorSize())
+			m_physical_sector_size = physical_size;
+		else
+			m_physical_sector_size = GetSectorSize();
 	} else {
 		fprintf(stderr, "I don't know what to do with this kind of file ...\n");
 	}
@@ -67,10 +111,17 @@ bool DeviceLinux::Open(const char* name)
 
 void DeviceLinux::Close()
 {
+	if (m_buffered >= 0 && m_buffered != m_device)
+		close(m_buffered);
 	if (m_device >= 0)
 		close(m_device);
 	m_device = -1;
+	m_buffered = -1;
 	m_size = 0;
+	m_physical_sector_size = 0x200;
+	SetSectorSize(0x200);
+	m_direct = false;
+	m_blkdev = false;
 }
 
 int DeviceLinux::Read(void* data, size_t size, uint64_t offset)
@@ -79,8 +130,9 @@ int DeviceLinux::Read(void* data, size_t size, uint64_t offset)
 	uint8_t *pdata = reinterpret_cast<uint8_t *>(data);
 
 	while (size > 0) {
-		nread = pread64(m_device, pdata, size, offset);
+		nread = pread64(m_buffered, pdata, size, offset);
 		if (nread < 0) return errno;
+		if (nread == 0) return EIO;
 		size -= nread;
 		offset += nread;
 		pdata += nread;
@@ -91,7 +143,98 @@ int DeviceLinux::Read(void* data, size_t size, uint64_t offset)
 
 int DeviceLinux::Write(const void *data, size_t size, uint64_t offset)
 {
-	return ENOTSUP;
+	const uint8_t *pdata = reinterpret_cast<const uint8_t *>(data);
+	void *bounce = nullptr;
+	int fd = m_device;
+	ssize_t nwritten;
+	int err = 0;
+
+	if (m_direct) {
+		if ((offset | size) & (DIRECT_ALIGN - 1)) {
+			fd = m_buffered;
+		} else if (reinterpret_cast<uintptr_t>(data) & (DIRECT_ALIGN - 1)) {
+			if (posix_memalign(&bounce, DIRECT_ALIGN, size))
+				return ENOMEM;
+			memcpy(bounce, data, size);
+			pdata = reinterpret_cast<const uint8_t *>(bounce);
+		}
+	}
+
+	while (size > 0) {
+		nwritten = pwrite64(fd, pdata, size, offset);
+		if (nwritten < 0) {
+			err = errno;
+			break;
+		}
+		if (nwritten == 0) {
+			err = EIO;
+			break;
+		}
+		size -= nwritten;
+		offset += nwritten;
+		pdata += nwritten;
+	}
+
+	free(bounce);
+	return err;
+}
+
+int DeviceLinux::Discard(uint64_t offset, uint64_t size)
+{
+	if (m_blkdev) {
+		uint64_t range[2] = { offset, size };
+
+		if (ioctl(m_device, BLKDISCARD, range))
+			return errno;
+	} else {
+		if (fallocate64(m_device, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size))
+			return errno;
+	}
+
+	return 0;
+}
+
+int DeviceLinux::Zero(uint64_t offset, uint64_t size)
+{
+	void *zeros;
+	size_t bsize;
+	int err = 0;
+
+	if (m_blkdev) {
+		uint64_t range[2] = { offset, size };
+
+		if (ioctl(m_device, BLKZEROOUT, range) == 0)
+			return 0;
+	} else {
+		if (fallocate64(m_device, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, size) == 0)
+			return 0;
+		if (fallocate64(m_device, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0)
+			return 0;
+	}
+
+	if (posix_memalign(&zeros, DIRECT_ALIGN, ZERO_BUF_SIZE))
+		return ENOMEM;
+	memset(zeros, 0, ZERO_BUF_SIZE);
+
+	while (size > 0 && !err) {
+		bsize = size > ZERO_BUF_SIZE ? ZERO_BUF_SIZE : size;
+		err = Write(zeros, bsize, offset);
+		offset += bsize;
+		size -= bsize;
+	}
+
+	free(zeros);
+	return err;
+}
+
+int DeviceLinux::Sync()
+{
+	if (fdatasync(m_device))
+		return errno;
+	if (m_buffered != m_device && fdatasync(m_buffered))
+		return errno;
+
+	return 0;
 }
 
 #endif
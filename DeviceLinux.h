@@ -29,17 +29,34 @@ public:
 	DeviceLinux();
 	~DeviceLinux();
 
-	bool Open(const char *name);
+	// A writable device is opened with O_DIRECT where possible, so large writes bypass the page cache.
+	bool Open(const char *name, bool writable = false);
 	void Close();
 
+	// Tells the device that the range is unused (BLKDISCARD), for image files the range is deallocated.
+	int Discard(uint64_t offset, uint64_t size);
+	// Makes the range read as zeros, offloaded to the device (BLKZEROOUT) or the file system where possible.
+	int Zero(uint64_t offset, uint64_t size);
+	int Sync();
+
 	int Read(void *data, size_t size, uint64_t offset) override;
 	int Write(const void *data, size_t size, uint64_t offset) override;
 
 	uint64_t GetSize() const override { return m_size; }
+	int GetFileDescriptor() const override { return m_blkdev ? -1 : m_buffered; }
+
+	bool IsBlockDevice() const { return m_blkdev; }
+	// Unit the device writes internally, the sector size can be smaller on 512e disks.
+	unsigned int GetPhysicalSectorSize() const { return m_physical_sector_size; }
 
 private:
 	int m_device;
+	// Without O_DIRECT, for reads and unaligned writes
+	int m_buffered;
 	uint64_t m_size;
+	unsigned int m_physical_sector_size;
+	bool m_direct;
+	bool m_blkdev;
 };
 
 #endif
@@ -0,0 +1,313 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+#include <endian.h>
+
+#include "Bitmap.h"
+#include "Device.h"
+#include "Ext4.h"
+#include "ExtentList.h"
+#include "ext4_layout.h"
+
+#define dbg_printf(...) // printf(__VA_ARGS__)
+
+static constexpr size_t BM_BUF_SIZE = 0x100000;
+
+Ext4::Ext4(Device &src, uint64_t offset, uint64_t size) : FileSystem(src, offset, size)
+{
+	m_block_size = 0;
+	m_cluster_size = 0;
+	m_first_data_block = 0;
+	m_cluster_count = 0;
+	m_clusters_per_group = 0;
+	m_inode_table_blocks = 0;
+	m_reserved_gdt_blocks = 0;
+	m_desc_size = 0;
+	m_group_count = 0;
+	m_gdt_blocks = 0;
+	m_feature_compat = 0;
+	m_feature_incompat = 0;
+	m_feature_ro_compat = 0;
+	m_backup_bgs[0] = 0;
+	m_backup_bgs[1] = 0;
+	m_bm_buf = new uint8_t[BM_BUF_SIZE];
+}
+
+Ext4::~Ext4()
+{
+	delete[] m_bm_buf;
+}
+
+bool Ext4::Probe(Device& src, uint64_t offset)
+{
+	ext4_super_block sb;
+
+	if (src.Read(&sb, sizeof(sb), offset + EXT4_SUPERBLOCK_OFFSET)) return false;
+
+	return le16toh(sb.s_magic) == EXT4_SUPER_MAGIC;
+}
+
+int Ext4::GetExtents(ExtentList& extents)
+{
+	ext4_super_block sb;
+	ext4_group_desc gd;
+	uint64_t blocks_count;
+	uint64_t group;
+	uint64_t clusters;
+	uint64_t free_count;
+	uint64_t bitmap;
+	uint64_t batch_group = 0;
+	uint64_t batch_bitmap = 0;
+	uint64_t batch_count = 0;
+	unsigned int cluster_shift;
+	bool gdt_csum;
+	int err;
+
+	err = m_srcdev.Read(&sb, sizeof(sb), m_offset + EXT4_SUPERBLOCK_OFFSET);
+	if (err) return err;
+
+	if (le16toh(sb.s_magic) != EXT4_SUPER_MAGIC)
+		return ENOTSUP;
+	if (le32toh(sb.s_log_block_size) > 6)
+		return EINVAL;
+
+	m_feature_compat = le32toh(sb.s_feature_compat);
+	m_feature_incompat = le32toh(sb.s_feature_incompat);
+	m_feature_ro_compat = le32toh(sb.s_feature_ro_compat);
+
+	// With meta_bg (set by resize2fs, for example) the group descriptors are spread over the disk,
+	// which isn't supported. The dump copies the whole partition instead.
+	if (m_feature_incompat & EXT4_FEATURE_INCOMPAT_META_BG)
+		return ENOTSUP;
+
+	m_block_size = 1024U << le32toh(sb.s_log_block_size);
+	cluster_shift = 0;
+	if (m_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_BIGALLOC) {
+		if (le32toh(sb.s_log_cluster_size) < le32toh(sb.s_log_block_size) || le32toh(sb.s_log_cluster_size) - le32toh(sb.s_log_block_size) > 16)
+			return EINVAL;
+		cluster_shift = le32toh(sb.s_log_cluster_size) - le32toh(sb.s_log_block_size);
+		m_clusters_per_group = le32toh(sb.s_clusters_per_group);
+	} else {
+		m_clusters_per_group = le32toh(sb.s_blocks_per_group);
+	}
+	m_cluster_size = m_block_size << cluster_shift;
+
+	if (m_clusters_per_group == 0 || m_clusters_per_group > m_block_size * 8)
+		return EINVAL;
+
+	m_desc_size = EXT4_MIN_DESC_SIZE;
+	if (m_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+		m_desc_size = le16toh(sb.s_desc_size);
+		if (m_desc_size < EXT4_MIN_DESC_SIZE || m_desc_size > m_block_size || (m_desc_size & (m_desc_size - 1)))
+			return EINVAL;
+	}
+
+	blocks_count = le32toh(sb.s_blocks_count_lo);
+	if (m_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+		blocks_count |= static_cast<uint64_t>(le32toh(sb.s_blocks_count_hi)) << 32;
+
+	m_first_data_block = le32toh(sb.s_first_data_block);
+	if (m_first_data_block >= blocks_count)
+		return EINVAL;
+
+	m_cluster_count = ((blocks_count - m_first_data_block) + (1ULL << cluster_shift) - 1) >> cluster_shift;
+	m_group_count = (m_cluster_count + m_clusters_per_group - 1) / m_clusters_per_group;
+	m_gdt_blocks = (m_group_count * m_desc_size + m_block_size - 1) / m_block_size;
+	m_inode_table_blocks = (static_cast<uint64_t>(le32toh(sb.s_inodes_per_group)) * le16toh(sb.s_inode_size) + m_block_size - 1) / m_block_size;
+	m_reserved_gdt_blocks = le16toh(sb.s_reserved_gdt_blocks);
+	m_backup_bgs[0] = le32toh(sb.s_backup_bgs[0]);
+	m_backup_bgs[1] = le32toh(sb.s_backup_bgs[1]);
+
+	dbg_printf("ext4: %" PRIu64 " groups of %u clusters, cluster size %u\n", m_group_count, m_clusters_per_group, m_cluster_size);
+
+	m_gdt.resize(m_gdt_blocks * m_block_size);
+	// The descriptors follow the block holding the superblock. That is block 1 with 1K blocks, even if bigalloc sets s_first_data_block to 0.
+	err = m_srcdev.Read(m_gdt.data(), m_gdt.size(), m_offset + (EXT4_SUPERBLOCK_OFFSET / m_block_size + 1) * m_block_size);
+	if (err) return err;
+
+	gdt_csum = (m_feature_ro_compat & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM | EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)) != 0;
+
+	// Boot sector and primary superblock. With 1K blocks, the boot sector isn't part of any group.
+	AddExtent(extents, 0, EXT4_SUPERBLOCK_OFFSET + sizeof(ext4_super_block));
+
+	for (group = 0; group < m_group_count; group++) {
+		GetGroupDesc(group, gd);
+
+		clusters = GroupClusters(group);
+		free_count = le16toh(gd.bg_free_blocks_count_lo);
+		bitmap = le32toh(gd.bg_block_bitmap_lo);
+		if (m_desc_size >= sizeof(ext4_group_desc)) {
+			free_count |= static_cast<uint32_t>(le16toh(gd.bg_free_blocks_count_hi)) << 16;
+			bitmap |= static_cast<uint64_t>(le32toh(gd.bg_block_bitmap_hi)) << 32;
+		}
+
+		// With flex_bg, the bitmaps of consecutive groups are usually contiguous, so they can be read in one go.
+		if (free_count < clusters && free_count > 0 && !(gdt_csum && (le16toh(gd.bg_flags) & EXT4_BG_BLOCK_UNINIT))) {
+			if (batch_count > 0 && bitmap == batch_bitmap + batch_count && (batch_count + 1) * m_block_size <= BM_BUF_SIZE) {
+				batch_count++;
+				continue;
+			}
+			err = ScanGroupBitmaps(extents, batch_group, batch_bitmap, batch_count);
+			if (err) return err;
+			batch_group = group;
+			batch_bitmap = bitmap;
+			batch_count = 1;
+			continue;
+		}
+
+		err = ScanGroupBitmaps(extents, batch_group, batch_bitmap, batch_count);
+		if (err) return err;
+		batch_count = 0;
+
+		if (free_count >= clusters) {
+			// Completely free, nothing to copy
+			continue;
+		} else if (free_count == 0) {
+			AddExtent(extents, GroupOffset(group), clusters * m_cluster_size);
+		} else {
+			ListUninitGroup(extents, group, gd);
+		}
+	}
+
+	return ScanGroupBitmaps(extents, batch_group, batch_bitmap, batch_count);
+}
+
+void Ext4::GetGroupDesc(uint64_t group, ext4_group_desc& gd) const
+{
+	memset(&gd, 0, sizeof(gd));
+	memcpy(&gd, m_gdt.data() + group * m_desc_size, std::min<size_t>(m_desc_size, sizeof(gd)));
+}
+
+bool Ext4::GroupHasSuper(uint64_t group) const
+{
+	uint64_t n;
+
+	if (group == 0)
+		return true;
+	if (m_feature_compat & EXT4_FEATURE_COMPAT_SPARSE_SUPER2)
+		return group == m_backup_bgs[0] || group == m_backup_bgs[1];
+	if (group == 1 || !(m_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER))
+		return true;
+
+	for (n = 3; n < group; n *= 3) ;
+	if (n == group) return true;
+	for (n = 5; n < group; n *= 5) ;
+	if (n == group) return true;
+	for (n = 7; n < group; n *= 7) ;
+	return n == group;
+}
+
+uint64_t Ext4::GroupClusters(uint64_t group) const
+{
+	uint64_t first = group * m_clusters_per_group;
+
+	return std::min<uint64_t>(m_clusters_per_group, m_cluster_count - first);
+}
+
+uint64_t Ext4::GroupOffset(uint64_t group) const
+{
+	return m_first_data_block * m_block_size + group * m_clusters_per_group * m_cluster_size;
+}
+
+void Ext4::ListUninitGroup(ExtentList& extents, uint64_t group, const ext4_group_desc& gd)
+{
+	// The block bitmap was never written. Like the kernel, assume that only the superblock backup,
+	// the group descriptors and whichever of the group's own bitmaps and inode table are inside the group are used.
+	struct Range {
+		uint64_t start;
+		uint64_t count;
+	} ranges[4];
+	const uint64_t first = GroupOffset(group) / m_block_size;
+	const uint64_t end = first + GroupClusters(group) * (m_cluster_size / m_block_size);
+	uint64_t block;
+	int n = 0;
+	int k;
+
+	if (GroupHasSuper(group)) {
+		ranges[n].start = first;
+		ranges[n].count = 1 + m_gdt_blocks + m_reserved_gdt_blocks;
+		if (group == 0)
+			ranges[n].count += EXT4_SUPERBLOCK_OFFSET / m_block_size - first;
+		n++;
+	}
+
+	block = le32toh(gd.bg_block_bitmap_lo) | (m_desc_size >= sizeof(ext4_group_desc) ? static_cast<uint64_t>(le32toh(gd.bg_block_bitmap_hi)) << 32 : 0);
+	if (block >= first && block < end) {
+		ranges[n].start = block;
+		ranges[n].count = 1;
+		n++;
+	}
+	block = le32toh(gd.bg_inode_bitmap_lo) | (m_desc_size >= sizeof(ext4_group_desc) ? static_cast<uint64_t>(le32toh(gd.bg_inode_bitmap_hi)) << 32 : 0);
+	if (block >= first && block < end) {
+		ranges[n].start = block;
+		ranges[n].count = 1;
+		n++;
+	}
+	block = le32toh(gd.bg_inode_table_lo) | (m_desc_size >= sizeof(ext4_group_desc) ? static_cast<uint64_t>(le32toh(gd.bg_inode_table_hi)) << 32 : 0);
+	if (block >= first && block < end) {
+		ranges[n].start = block;
+		ranges[n].count = m_inode_table_blocks;
+		n++;
+	}
+
+	std::sort(ranges, ranges + n, [](const Range &a, const Range &b) { return a.start < b.start; });
+
+	for (k = 0; k < n; k++) {
+		if (ranges[k].start + ranges[k].count > end)
+			ranges[k].count = end - ranges[k].start;
+		AddExtent(extents, ranges[k].start * m_block_size, ranges[k].count * m_block_size);
+	}
+}
+
+int Ext4::ScanGroupBitmaps(ExtentList& extents, uint64_t first_group, uint64_t bitmap_block, uint64_t count)
+{
+	const uint8_t *bm;
+	uint64_t k;
+	size_t clusters;
+	size_t start;
+	size_t end;
+	int err;
+
+	if (count == 0)
+		return 0;
+
+	err = m_srcdev.Read(m_bm_buf, count * m_block_size, m_offset + bitmap_block * m_block_size);
+	if (err) return err;
+
+	for (k = 0; k < count; k++) {
+		bm = m_bm_buf + k * m_block_size;
+		clusters = GroupClusters(first_group + k);
+
+		end = 0;
+		for (;;) {
+			start = BitmapFindSet(bm, end, clusters, false);
+			if (start >= clusters)
+				break;
+			end = BitmapFindClear(bm, start, clusters, false);
+			AddExtent(extents, GroupOffset(first_group + k) + start * m_cluster_size, (end - start) * m_cluster_size);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "FileSystem.h"
+
+struct ext4_group_desc;
+
+class Ext4 : public FileSystem
+{
+public:
+	Ext4(Device &src, uint64_t offset, uint64_t size);
+	~Ext4();
+
+	static bool Probe(Device &src, uint64_t offset);
+
+	int GetExtents(ExtentList &extents) override;
+
+private:
+	void GetGroupDesc(uint64_t group, ext4_group_desc &gd) const;
+	bool GroupHasSuper(uint64_t group) const;
+	uint64_t GroupClusters(uint64_t group) const;
+	uint64_t GroupOffset(uint64_t group) const;
+
+	void ListUninitGroup(ExtentList &extents, uint64_t group, const ext4_group_desc &gd);
+	int ScanGroupBitmaps(ExtentList &extents, uint64_t first_group, uint64_t bitmap_block, uint64_t count);
+
+	uint32_t m_block_size;
+	uint32_t m_cluster_size;
+	uint64_t m_first_data_block;
+	uint64_t m_cluster_count;
+	uint32_t m_clusters_per_group;
+	uint32_t m_inode_table_blocks;
+	uint32_t m_reserved_gdt_blocks;
+	uint32_t m_desc_size;
+	uint64_t m_group_count;
+	uint64_t m_gdt_blocks;
+	uint32_t m_feature_compat;
+	uint32_t m_feature_incompat;
+	uint32_t m_feature_ro_compat;
+	uint32_t m_backup_bgs[2];
+
+	std::vector<uint8_t> m_gdt;
+	uint8_t *m_bm_buf;
+};
@@ -0,0 +1,95 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+
+#include "ExtentList.h"
+
+void ExtentList::Add(uint64_t offset, uint64_t size)
+{
+	Extent ext;
+
+	if (size == 0)
+		return;
+
+	if (!m_extents.empty() && m_extents.back().offset + m_extents.back().size == offset) {
+		m_extents.back().size += size;
+		return;
+	}
+
+	ext.offset = offset;
+	ext.size = size;
+	m_extents.push_back(ext);
+}
+
+void ExtentList::Append(const ExtentList& other)
+{
+	for (const Extent &ext : other.m_extents)
+		Add(ext.offset, ext.size);
+}
+
+void ExtentList::Sort()
+{
+	size_t n;
+	size_t k;
+	uint64_t end;
+
+	std::sort(m_extents.begin(), m_extents.end(), [](const Extent &a, const Extent &b) { return a.offset < b.offset; });
+
+	n = 0;
+	for (k = 1; k < m_extents.size(); k++) {
+		end = m_extents[n].offset + m_extents[n].size;
+		if (m_extents[k].offset <= end) {
+			if (m_extents[k].offset + m_extents[k].size > end)
+				m_extents[n].size = m_extents[k].offset + m_extents[k].size - m_extents[n].offset;
+		} else {
+			m_extents[++n] = m_extents[k];
+		}
+	}
+	if (!m_extents.empty())
+		m_extents.resize(n + 1);
+}
+
+void ExtentList::Clear()
+{
+	m_extents.clear();
+}
+
+uint64_t ExtentList::TotalSize() const
+{
+	uint64_t total = 0;
+
+	for (const Extent &ext : m_extents)
+		total += ext.size;
+
+	return total;
+}
+
+uint64_t ExtentList::SizeBelow(uint64_t offset) const
+{
+	uint64_t total = 0;
+
+	for (const Extent &ext : m_extents) {
+		if (ext.offset >= offset)
+			break;
+		total += (ext.offset + ext.size <= offset) ? ext.size : offset - ext.offset;
+	}
+
+	return total;
+}
@@ -0,0 +1,57 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+struct Extent
+{
+	uint64_t offset;
+	uint64_t size;
+};
+
+// Byte ranges on a device, used to plan which parts of the source get copied.
+class ExtentList
+{
+public:
+	typedef std::vector<Extent>::const_iterator const_iterator;
+
+	// Appends an extent. If it directly follows the last one, the last one is extended instead.
+	void Add(uint64_t offset, uint64_t size);
+	void Append(const ExtentList &other);
+	// Sorts by offset and merges overlapping and adjacent extents.
+	void Sort();
+	void Clear();
+
+	size_t Count() const { return m_extents.size(); }
+	uint64_t TotalSize() const;
+	// Bytes covered below offset, the list must be sorted.
+	uint64_t SizeBelow(uint64_t offset) const;
+
+	const Extent &operator[](size_t idx) const { return m_extents[idx]; }
+	const_iterator begin() const { return m_extents.begin(); }
+	const_iterator end() const { return m_extents.end(); }
+
+private:
+	std::vector<Extent> m_extents;
+};
@@ -0,0 +1,352 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+#include <endian.h>
+
+#include "Bitmap.h"
+#include "Device.h"
+#include "ExtentList.h"
+#include "Fat.h"
+#include "fat_layout.h"
+
+#define dbg_printf(...) // printf(__VA_ARGS__)
+
+static constexpr size_t FAT_BUF_SIZE = 0x100000;
+static constexpr size_t FAT_CACHE_SIZE = 0x1000;
+
+Fat::Fat(Device &src, uint64_t offset, uint64_t size) : FileSystem(src, offset, size)
+{
+	m_fat_offset = 0;
+	m_heap_offset = 0;
+	m_cluster_size = 0;
+	m_cluster_count = 0;
+	m_fat_cache_offset = UINT64_MAX;
+	m_fat_cache = new uint8_t[FAT_CACHE_SIZE];
+	m_fat_buf = new uint8_t[FAT_BUF_SIZE];
+}
+
+Fat::~Fat()
+{
+	delete[] m_fat_buf;
+	delete[] m_fat_cache;
+}
+
+bool Fat::Probe(Device& src, uint64_t offset)
+{
+	uint8_t sector[512];
+
+	if (src.Read(sector, sizeof(sector), offset)) return false;
+
+	const fat_boot_sector_t *fbs = reinterpret_cast<const fat_boot_sector_t *>(sector);
+	const exfat_boot_sector_t *xbs = reinterpret_cast<const exfat_boot_sector_t *>(sector);
+
+	if (le16toh(fbs->BS_Signature) != FAT_SIGNATURE)
+		return false;
+	if (!memcmp(xbs->FileSystemName, "EXFAT   ", 8))
+		return true;
+
+	// FAT has no magic number, so check that the BPB looks sane.
+	if (fbs->BS_jmpBoot[0] != 0xE9 && fbs->BS_jmpBoot[0] != 0xEB)
+		return false;
+	if (le16toh(fbs->BPB_BytsPerSec) < 512 || le16toh(fbs->BPB_RsvdSecCnt) == 0 || fbs->BPB_NumFATs == 0)
+		return false;
+
+	return le16toh(fbs->BPB_FATSz16) != 0 || le32toh(fbs->BPB_FATSz32) != 0;
+}
+
+int Fat::GetExtents(ExtentList& extents)
+{
+	uint8_t sector[512];
+	int err;
+
+	static_assert(sizeof(fat_boot_sector_t) == sizeof(sector), "Boot sector buffer too small");
+
+	err = m_srcdev.Read(sector, sizeof(sector), m_offset);
+	if (err) return err;
+
+	const fat_boot_sector_t *fbs = reinterpret_cast<const fat_boot_sector_t *>(sector);
+	const exfat_boot_sector_t *xbs = reinterpret_cast<const exfat_boot_sector_t *>(sector);
+
+	if (le16toh(fbs->BS_Signature) != FAT_SIGNATURE)
+		return ENOTSUP;
+
+	if (!memcmp(xbs->FileSystemName, "EXFAT   ", 8))
+		return ListExFat(extents, *xbs);
+	else
+		return ListFat(extents, *fbs);
+}
+
+int Fat::ListFat(ExtentList& extents, const fat_boot_sector_t& bs)
+{
+	const uint32_t bytes_per_sec = le16toh(bs.BPB_BytsPerSec);
+	const uint32_t sec_per_clus = bs.BPB_SecPerClus;
+	uint64_t fat_size;
+	uint64_t tot_sec;
+	uint64_t root_dir_sectors;
+	uint64_t first_data;
+	uint64_t entries;
+	uint64_t first;
+	uint64_t n;
+	uint64_t k;
+	uint32_t entry;
+	uint32_t bad;
+	unsigned int active;
+	int fat_bits;
+	int err;
+
+	if (bytes_per_sec < 512 || bytes_per_sec > 4096 || (bytes_per_sec & (bytes_per_sec - 1)))
+		return ENOTSUP;
+	if (sec_per_clus == 0 || (sec_per_clus & (sec_per_clus - 1)))
+		return ENOTSUP;
+	if (le16toh(bs.BPB_RsvdSecCnt) == 0 || bs.BPB_NumFATs == 0)
+		return ENOTSUP;
+
+	fat_size = le16toh(bs.BPB_FATSz16) ? le16toh(bs.BPB_FATSz16) : le32toh(bs.BPB_FATSz32);
+	tot_sec = le16toh(bs.BPB_TotSec16) ? le16toh(bs.BPB_TotSec16) : le32toh(bs.BPB_TotSec32);
+	root_dir_sectors = (le16toh(bs.BPB_RootEntCnt) * 32 + bytes_per_sec - 1) / bytes_per_sec;
+	first_data = le16toh(bs.BPB_RsvdSecCnt) + bs.BPB_NumFATs * fat_size + root_dir_sectors;
+
+	if (fat_size == 0 || first_data >= tot_sec)
+		return ENOTSUP;
+
+	m_cluster_count = (tot_sec - first_data) / sec_per_clus;
+	m_cluster_size = bytes_per_sec * sec_per_clus;
+
+	// The FAT type is determined by the cluster count alone.
+	if (m_cluster_count <= FAT12_MAX_CLUSTERS) {
+		fat_bits = 12;
+		bad = FAT12_BAD_CLUSTER;
+	} else if (m_cluster_count <= FAT16_MAX_CLUSTERS) {
+		fat_bits = 16;
+		bad = FAT16_BAD_CLUSTER;
+	} else {
+		fat_bits = 32;
+		bad = FAT32_BAD_CLUSTER;
+	}
+
+	entries = static_cast<uint64_t>(m_cluster_count) + 2;
+	if (fat_size * bytes_per_sec * 8 < entries * fat_bits)
+		return EINVAL;
+
+	active = 0;
+	if (fat_bits == 32 && (le16toh(bs.BPB_ExtFlags) & FAT32_EXTFLAG_MIRRORING_OFF))
+		active = le16toh(bs.BPB_ExtFlags) & FAT32_EXTFLAG_ACTIVE_MASK;
+	if (active >= bs.BPB_NumFATs)
+		return EINVAL;
+
+	m_fat_offset = (le16toh(bs.BPB_RsvdSecCnt) + active * fat_size) * bytes_per_sec;
+	m_heap_offset = first_data * bytes_per_sec;
+
+	dbg_printf("FAT%d: %u clusters of %u bytes, data at %" PRIX64 "\n", fat_bits, m_cluster_count, m_cluster_size, m_heap_offset);
+
+	// Reserved sectors, all FATs, and the FAT12/16 root directory
+	AddExtent(extents, 0, m_heap_offset);
+
+	if (fat_bits == 12) {
+		// At most 6 KiB, read it in one go.
+		n = (entries * 3 + 1) / 2 + 1;
+		if (n > fat_size * bytes_per_sec) n = fat_size * bytes_per_sec;
+		err = m_srcdev.Read(m_fat_buf, n, m_offset + m_fat_offset);
+		if (err) return err;
+
+		for (k = 2; k < entries; k++) {
+			entry = m_fat_buf[k + (k >> 1)] | (m_fat_buf[k + (k >> 1) + 1] << 8);
+			entry = (k & 1) ? (entry >> 4) : (entry & 0xFFF);
+			if (entry != 0 && entry != bad)
+				AddExtent(extents, m_heap_offset + (k - 2) * m_cluster_size, m_cluster_size);
+		}
+
+		return 0;
+	}
+
+	for (first = 0; first < entries; first += n) {
+		n = entries - first;
+		if (n > FAT_BUF_SIZE / (fat_bits >> 3)) n = FAT_BUF_SIZE / (fat_bits >> 3);
+
+		err = m_srcdev.Read(m_fat_buf, n * (fat_bits >> 3), m_offset + m_fat_offset + first * (fat_bits >> 3));
+		if (err) return err;
+
+		for (k = (first < 2) ? 2 - first : 0; k < n; k++) {
+			if (fat_bits == 16)
+				entry = le16toh(reinterpret_cast<const uint16_t *>(m_fat_buf)[k]);
+			else
+				entry = le32toh(reinterpret_cast<const uint32_t *>(m_fat_buf)[k]) & FAT32_ENTRY_MASK;
+
+			if (entry != 0 && entry != bad)
+				AddExtent(extents, m_heap_offset + (first + k - 2) * m_cluster_size, m_cluster_size);
+		}
+	}
+
+	return 0;
+}
+
+int Fat::ListExFat(ExtentList& extents, const exfat_boot_sector_t& bs)
+{
+	const unsigned int bps_shift = bs.BytesPerSectorShift;
+	const unsigned int spc_shift = bs.SectorsPerClusterShift;
+	uint32_t cluster;
+	uint64_t bm_length;
+	uint64_t bm_bits;
+	uint64_t bit;
+	uint64_t chunk;
+	uint64_t cluster_off;
+	size_t bits;
+	size_t start;
+	size_t end;
+	int bitmap_nr;
+	int err;
+
+	if (bps_shift < 9 || bps_shift > 12 || bps_shift + spc_shift > 25)
+		return ENOTSUP;
+	if (bs.NumberOfFats == 0 || bs.NumberOfFats > 2)
+		return ENOTSUP;
+
+	m_cluster_size = 1U << (bps_shift + spc_shift);
+	m_cluster_count = le32toh(bs.ClusterCount);
+	m_fat_offset = static_cast<uint64_t>(le32toh(bs.FatOffset)) << bps_shift;
+	m_heap_offset = static_cast<uint64_t>(le32toh(bs.ClusterHeapOffset)) << bps_shift;
+	m_fat_cache_offset = UINT64_MAX;
+
+	bitmap_nr = 0;
+	if (bs.NumberOfFats == 2 && (le16toh(bs.VolumeFlags) & EXFAT_VOLUME_FLAG_ACTIVE_FAT)) {
+		m_fat_offset += static_cast<uint64_t>(le32toh(bs.FatLength)) << bps_shift;
+		bitmap_nr = 1;
+	}
+
+	dbg_printf("exFAT: %u clusters of %u bytes, heap at %" PRIX64 "\n", m_cluster_count, m_cluster_size, m_heap_offset);
+
+	// Main and backup boot regions and the FATs
+	AddExtent(extents, 0, m_heap_offset);
+
+	err = FindExFatBitmap(le32toh(bs.FirstClusterOfRootDirectory), bitmap_nr, cluster, bm_length);
+	if (err) return err;
+
+	bm_bits = static_cast<uint64_t>(m_cluster_count);
+	if (bm_length * 8 < bm_bits)
+		return EINVAL;
+
+	// Bit n of the allocation bitmap stands for cluster n + 2.
+	bit = 0;
+	while (bit < bm_bits) {
+		if (cluster < EXFAT_FIRST_CLUSTER || cluster - EXFAT_FIRST_CLUSTER >= m_cluster_count)
+			return EINVAL;
+
+		cluster_off = m_heap_offset + static_cast<uint64_t>(cluster - EXFAT_FIRST_CLUSTER) * m_cluster_size;
+
+		for (chunk = 0; chunk < m_cluster_size && bit < bm_bits; chunk += FAT_BUF_SIZE) {
+			bits = FAT_BUF_SIZE * 8;
+			if (bits > (m_cluster_size - chunk) * 8) bits = (m_cluster_size - chunk) * 8;
+			if (bits > bm_bits - bit) bits = bm_bits - bit;
+
+			err = m_srcdev.Read(m_fat_buf, (bits + 7) >> 3, m_offset + cluster_off + chunk);
+			if (err) return err;
+
+			end = 0;
+			for (;;) {
+				start = BitmapFindSet(m_fat_buf, end, bits, false);
+				if (start >= bits)
+					break;
+				end = BitmapFindClear(m_fat_buf, start, bits, false);
+				AddExtent(extents, m_heap_offset + (bit + start) * m_cluster_size, (end - start) * m_cluster_size);
+			}
+
+			bit += bits;
+		}
+
+		if (bit < bm_bits) {
+			err = GetExFatNext(cluster, cluster);
+			if (err) return err;
+		}
+	}
+
+	return 0;
+}
+
+int Fat::FindExFatBitmap(uint32_t root_cluster, int bitmap_nr, uint32_t& first_cluster, uint64_t& length)
+{
+	const exfat_bitmap_entry_t *de;
+	uint32_t cluster = root_cluster;
+	uint32_t n;
+	uint64_t chunk;
+	size_t size;
+	size_t k;
+	int err;
+
+	// The root directory is an ordinary cluster chain, the bitmap entry is normally at its very start.
+	for (n = 0; n < m_cluster_count; n++) {
+		if (cluster < EXFAT_FIRST_CLUSTER || cluster - EXFAT_FIRST_CLUSTER >= m_cluster_count)
+			return EINVAL;
+
+		for (chunk = 0; chunk < m_cluster_size; chunk += size) {
+			size = m_cluster_size - chunk;
+			if (size > FAT_BUF_SIZE) size = FAT_BUF_SIZE;
+
+			err = m_srcdev.Read(m_fat_buf, size, m_offset + m_heap_offset + static_cast<uint64_t>(cluster - EXFAT_FIRST_CLUSTER) * m_cluster_size + chunk);
+			if (err) return err;
+
+			for (k = 0; k < size; k += EXFAT_ENTRY_SIZE) {
+				de = reinterpret_cast<const exfat_bitmap_entry_t *>(m_fat_buf + k);
+
+				if (de->EntryType == EXFAT_ENTRY_END)
+					return ENOENT;
+
+				if (de->EntryType == EXFAT_ENTRY_BITMAP && (de->BitmapFlags & EXFAT_BITMAP_FLAG_SECOND) == bitmap_nr) {
+					first_cluster = le32toh(de->FirstCluster);
+					length = le64toh(de->DataLength);
+					return 0;
+				}
+			}
+		}
+
+		err = GetExFatNext(cluster, cluster);
+		if (err) return err;
+	}
+
+	return EINVAL;
+}
+
+int Fat::GetExFatNext(uint32_t cluster, uint32_t& next)
+{
+	uint64_t off = m_fat_offset + static_cast<uint64_t>(cluster) * 4;
+	uint64_t cache_off = off & ~static_cast<uint64_t>(FAT_CACHE_SIZE - 1);
+	uint32_t entry;
+	int err;
+
+	if (cache_off != m_fat_cache_offset) {
+		err = m_srcdev.Read(m_fat_cache, FAT_CACHE_SIZE, m_offset + cache_off);
+		if (err) return err;
+		m_fat_cache_offset = cache_off;
+	}
+
+	memcpy(&entry, m_fat_cache + (off - cache_off), sizeof(entry));
+	entry = le32toh(entry);
+
+	// Chains written without FAT entries are contiguous.
+	if (entry == 0)
+		entry = cluster + 1;
+	if (entry >= EXFAT_BAD_CLUSTER)
+		return EINVAL;
+
+	next = entry;
+	return 0;
+}
@@ -0,0 +1,54 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+
+#include "FileSystem.h"
+
+struct fat_boot_sector_t;
+struct exfat_boot_sector_t;
+
+// FAT12, FAT16, FAT32 and exFAT
+class Fat : public FileSystem
+{
+public:
+	Fat(Device &src, uint64_t offset, uint64_t size);
+	~Fat();
+
+	static bool Probe(Device &src, uint64_t offset);
+
+	int GetExtents(ExtentList &extents) override;
+
+private:
+	int ListFat(ExtentList &extents, const fat_boot_sector_t &bs);
+	int ListExFat(ExtentList &extents, const exfat_boot_sector_t &bs);
+
+	int FindExFatBitmap(uint32_t root_cluster, int bitmap_nr, uint32_t &first_cluster, uint64_t &length);
+	int GetExFatNext(uint32_t cluster, uint32_t &next);
+
+	uint64_t m_fat_offset;
+	uint64_t m_heap_offset;
+	uint32_t m_cluster_size;
+	uint32_t m_cluster_count;
+	uint64_t m_fat_cache_offset;
+	uint8_t *m_fat_cache;
+	uint8_t *m_fat_buf;
+};
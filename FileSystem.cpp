@@ -0,0 +1,48 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "CopyEngine.h"
+#include "Device.h"
+#include "ExtentList.h"
+#include "FileSystem.h"
+
+FileSystem::FileSystem(Device &src, uint64_t offset, uint64_t size) : m_srcdev(src), m_offset(offset), m_size(size)
+{
+}
+
+FileSystem::~FileSystem()
+{
+}
+
+int FileSystem::CopyData(Device& dst)
+{
+	ExtentList extents;
+	CopyEngine engine(m_srcdev, dst);
+	int err;
+
+	err = GetExtents(extents);
+	if (err) return err;
+
+	return engine.Copy(extents);
+}
+
+void FileSystem::AddExtent(ExtentList& extents, uint64_t offset, uint64_t size)
+{
+	extents.Add(m_offset + offset, size);
+}
@@ -16,20 +16,35 @@
 	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 class Device;
+class ExtentList;
 
 class FileSystem
 {
 protected:
-	FileSystem() {}
+	FileSystem(Device &src, uint64_t offset, uint64_t size);
 
 public:
-	virtual ~FileSystem() {}
+	virtual ~FileSystem();
+
+	// Appends the ranges that hold file system data, as absolute offsets on the source device.
+	// On failure (ENOTSUP for unsupported features) the partition is copied whole.
+	virtual int GetExtents(ExtentList &extents) = 0;
+
+	int CopyData(Device &dst);
+
+protected:
+	// offset is relative to the start of the file system.
+	void AddExtent(ExtentList &extents, uint64_t offset, uint64_t size);
 
-	virtual uint64_t GetOccupiedSize() const = 0;
-	virtual int CopyData(Device &dst) = 0;
+	Device &m_srcdev;
+	const uint64_t m_offset;
+	// Size of the partition, the file system may be smaller
+	const uint64_t m_size;
 };
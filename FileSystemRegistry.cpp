@@ -0,0 +1,139 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstring>
+
+#include "FileSystemRegistry.h"
+#include "GptPartitionMap.h"
+#include "MbrPartitionMap.h"
+#include "Apfs.h"
+#include "Ext4.h"
+#include "Fat.h"
+#include "Hfsplus.h"
+#include "Ntfs.h"
+
+template <class T>
+static FileSystem *Create(Device &src, uint64_t offset, uint64_t size)
+{
+	return new T(src, offset, size);
+}
+
+FileSystemRegistry::FileSystemRegistry()
+{
+	RegisterFileSystem("APFS", Apfs::Probe, Create<Apfs>);
+	RegisterFileSystem("HFS+", Hfsplus::Probe, Create<Hfsplus>);
+	RegisterFileSystem("FAT", Fat::Probe, Create<Fat>);
+	RegisterFileSystem("NTFS", Ntfs::Probe, Create<Ntfs>);
+	RegisterFileSystem("ext4", Ext4::Probe, Create<Ext4>);
+
+	RegisterPartitionType(GptPartitionMap::PTYPE_EFI_SYS, "EFI SYSTEM", { "FAT" }, true);
+	RegisterPartitionType(GptPartitionMap::PTYPE_APFS, "APFS", { "APFS" }, false);
+	RegisterPartitionType(GptPartitionMap::PTYPE_HFSPLUS, "HFS+", { "HFS+" }, true);
+	RegisterPartitionType(GptPartitionMap::PTYPE_BASIC_DATA, "Basic data", { "FAT", "NTFS" }, false);
+	RegisterPartitionType(GptPartitionMap::PTYPE_LINUX_DATA, "Linux data", { "ext4" }, false);
+
+	RegisterPartitionType(MbrPartitionMap::PTYPE_FAT12, "FAT12", { "FAT" }, true);
+	RegisterPartitionType(MbrPartitionMap::PTYPE_FAT16_SMALL, "FAT16", { "FAT" }, true);
+	RegisterPartitionType(MbrPartitionMap::PTYPE_FAT16, "FAT16", { "FAT" }, true);
+	RegisterPartitionType(MbrPartitionMap::PTYPE_FAT16_LBA, "FAT16 LBA", { "FAT" }, true);
+	RegisterPartitionType(MbrPartitionMap::PTYPE_FAT32, "FAT32", { "FAT" }, true);
+	RegisterPartitionType(MbrPartitionMap::PTYPE_FAT32_LBA, "FAT32 LBA", { "FAT" }, true);
+	RegisterPartitionType(MbrPartitionMap::PTYPE_NTFS_EXFAT, "NTFS/exFAT", { "NTFS", "FAT" }, false);
+	RegisterPartitionType(MbrPartitionMap::PTYPE_LINUX, "Linux", { "ext4" }, false);
+	RegisterPartitionType(MbrPartitionMap::PTYPE_HFSPLUS, "HFS+", { "HFS+" }, true);
+	RegisterPartitionType(MbrPartitionMap::PTYPE_EFI_SYS, "EFI SYSTEM", { "FAT" }, true);
+}
+
+void FileSystemRegistry::RegisterFileSystem(const char* name, ProbeFunc probe, CreateFunc create)
+{
+	m_fs_types.push_back({ name, probe, create });
+}
+
+void FileSystemRegistry::RegisterPartitionType(const TypeGUID guid, const char* label, std::vector<const char *> fs_names, bool raw_fallback)
+{
+	PartitionType pt;
+
+	memcpy(pt.guid, guid, sizeof(TypeGUID));
+	pt.mbr_type = 0;
+	pt.label = label;
+	pt.fs_names = std::move(fs_names);
+	pt.raw_fallback = raw_fallback;
+
+	m_part_types.push_back(std::move(pt));
+}
+
+void FileSystemRegistry::RegisterPartitionType(uint8_t mbr_type, const char* label, std::vector<const char *> fs_names, bool raw_fallback)
+{
+	PartitionType pt;
+
+	memset(pt.guid, 0, sizeof(TypeGUID));
+	pt.mbr_type = mbr_type;
+	pt.label = label;
+	pt.fs_names = std::move(fs_names);
+	pt.raw_fallback = raw_fallback;
+
+	m_part_types.push_back(std::move(pt));
+}
+
+const FileSystemRegistry::PartitionType* FileSystemRegistry::FindPartitionType(const PartitionMap::Partition& part) const
+{
+	for (const PartitionType &pt : m_part_types) {
+		if (part.mbr_type != 0) {
+			if (pt.mbr_type == part.mbr_type)
+				return &pt;
+		} else if (pt.mbr_type == 0 && !memcmp(pt.guid, part.type_guid, sizeof(TypeGUID))) {
+			return &pt;
+		}
+	}
+
+	return nullptr;
+}
+
+const FileSystemRegistry::FileSystemType* FileSystemRegistry::FindFileSystem(const char* name) const
+{
+	for (const FileSystemType &ft : m_fs_types) {
+		if (!strcmp(ft.name, name))
+			return &ft;
+	}
+
+	return nullptr;
+}
+
+std::unique_ptr<FileSystem> FileSystemRegistry::Probe(Device& src, uint64_t offset, uint64_t size, const PartitionType* ptype, const char** name) const
+{
+	if (ptype) {
+		for (const char *fs_name : ptype->fs_names) {
+			const FileSystemType *ft = FindFileSystem(fs_name);
+
+			if (ft && ft->probe(src, offset)) {
+				if (name) *name = ft->name;
+				return std::unique_ptr<FileSystem>(ft->create(src, offset, size));
+			}
+		}
+	} else {
+		for (const FileSystemType &ft : m_fs_types) {
+			if (ft.probe(src, offset)) {
+				if (name) *name = ft.name;
+				return std::unique_ptr<FileSystem>(ft.create(src, offset, size));
+			}
+		}
+	}
+
+	return nullptr;
+}
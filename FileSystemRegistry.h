@@ -0,0 +1,75 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "PartitionMap.h"
+
+class Device;
+class FileSystem;
+
+// Maps partition types to file system backends and recognizes file systems by their on-disk magic.
+class FileSystemRegistry
+{
+public:
+	typedef uint8_t TypeGUID[0x10];
+	typedef bool (*ProbeFunc)(Device &src, uint64_t offset);
+	typedef FileSystem *(*CreateFunc)(Device &src, uint64_t offset, uint64_t size);
+
+	struct FileSystemType
+	{
+		const char *name;
+		ProbeFunc probe;
+		CreateFunc create;
+	};
+
+	struct PartitionType
+	{
+		// GPT type GUID, or MBR partition type if mbr_type is not 0
+		TypeGUID guid;
+		uint8_t mbr_type;
+		const char *label;
+		// Names of the file systems expected on this partition type, probed in order.
+		std::vector<const char *> fs_names;
+		// Copy the whole partition if none of the file systems is recognized. A recognized file system
+		// whose allocation can't be read is always copied whole.
+		bool raw_fallback;
+	};
+
+	FileSystemRegistry();
+
+	void RegisterFileSystem(const char *name, ProbeFunc probe, CreateFunc create);
+	void RegisterPartitionType(const TypeGUID guid, const char *label, std::vector<const char *> fs_names, bool raw_fallback);
+	void RegisterPartitionType(uint8_t mbr_type, const char *label, std::vector<const char *> fs_names, bool raw_fallback);
+
+	const PartitionType *FindPartitionType(const PartitionMap::Partition &part) const;
+
+	// Probes the file systems expected for ptype, or all registered ones if ptype is unknown.
+	std::unique_ptr<FileSystem> Probe(Device &src, uint64_t offset, uint64_t size, const PartitionType *ptype, const char **name) const;
+
+private:
+	const FileSystemType *FindFileSystem(const char *name) const;
+
+	std::vector<FileSystemType> m_fs_types;
+	std::vector<PartitionType> m_part_types;
+};
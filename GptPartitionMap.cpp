@@ -23,6 +23,7 @@
 #include <endian.h>
 
 #include "Device.h"
+#include "ExtentList.h"
 #include "GptPartitionMap.h"
 
 #define dbg_printf(...) // printf(__VA_ARGS__)
@@ -32,6 +33,9 @@ static_assert(sizeof(GptPartitionMap::PMAP_Entry) == 128, "PMAP Entry wrong size
 
 const GptPartitionMap::PM_GUID GptPartitionMap::PTYPE_EFI_SYS = { 0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11, 0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B };
 const GptPartitionMap::PM_GUID GptPartitionMap::PTYPE_APFS = { 0xEF, 0x57, 0x34, 0x7C, 0x00, 0x00, 0xAA, 0x11, 0xAA, 0x11, 0x00, 0x30, 0x65, 0x43, 0xEC, 0xAC };
+const GptPartitionMap::PM_GUID GptPartitionMap::PTYPE_BASIC_DATA = { 0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44, 0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7 };
+const GptPartitionMap::PM_GUID GptPartitionMap::PTYPE_LINUX_DATA = { 0xAF, 0x3D, 0xC6, 0x0F, 0x83, 0x84, 0x72, 0x47, 0x8E, 0x79, 0x3D, 0x69, 0xD8, 0x47, 0x7D, 0xE4 };
+const GptPartitionMap::PM_GUID GptPartitionMap::PTYPE_HFSPLUS = { 0x00, 0x53, 0x46, 0x48, 0x00, 0x00, 0xAA, 0x11, 0xAA, 0x11, 0x00, 0x30, 0x65, 0x43, 0xEC, 0xAC };
 
 static void PrintGUID(const GptPartitionMap::PM_GUID &guid)
 {
@@ -161,6 +165,37 @@ bool GptPartitionMap::GetPartitionEntry(int partnum, GptPartitionMap::PMAP_Entry
 	}
 }
 
+int GptPartitionMap::GetPartitionCount() const
+{
+	if (!m_hdr || !m_map)
+		return 0;
+
+	unsigned int k;
+
+	for (k = 0; k < le32toh(m_hdr->NumberOfPartitionEntries); k++)
+	{
+		if (le64toh(m_map[k].StartingLBA) == 0 && le64toh(m_map[k].EndingLBA) == 0)
+			break;
+	}
+
+	return k;
+}
+
+bool GptPartitionMap::GetPartition(int partnum, Partition& part) const
+{
+	if (!m_hdr || !m_map || partnum < 0 || partnum >= GetPartitionCount())
+		return false;
+
+	const PMAP_Entry &e = m_map[partnum];
+
+	part.offset = le64toh(e.StartingLBA) * m_sector_size;
+	part.size = (le64toh(e.EndingLBA) - le64toh(e.StartingLBA) + 1) * m_sector_size;
+	memcpy(part.type_guid, e.PartitionTypeGUID, sizeof(PM_GUID));
+	part.mbr_type = 0;
+
+	return true;
+}
+
 void GptPartitionMap::ListEntries()
 {
 	if (!m_hdr || !m_map)
@@ -189,13 +224,11 @@ void GptPartitionMap::ListEntries()
 	}
 }
 
-int GptPartitionMap::CopyGPT(Device& src, Device& dst)
+int GptPartitionMap::GetExtents(Device& src, ExtentList& extents)
 {
-	uint8_t buf[0x1000];
-
-	uint64_t pmap_off;
-	size_t pmap_size;
-	size_t size;
+	PMAP_GptHeader alt_hdr;
+	uint64_t alt_lba;
+	int err;
 
 	dbg_printf("Header size: %08X\n", le32toh(m_hdr->HeaderSize));
 	dbg_printf("Entry size: %08X\n", le32toh(m_hdr->SizeOfPartitionEntry));
@@ -203,49 +236,24 @@ int GptPartitionMap::CopyGPT(Device& src, Device& dst)
 	dbg_printf("Alt LBA: %016" PRIX64 "\n", le64toh(m_hdr->AlternateLBA));
 	dbg_printf("Pe LBA: %016" PRIX64 "\n", le64toh(m_hdr->PartitionEntryLBA));
 
-	src.Read(buf, m_sector_size, 0);
-	dst.Write(buf, m_sector_size, 0);
-	src.Read(buf, m_sector_size, m_sector_size);
-	dst.Write(buf, m_sector_size, m_sector_size);
-
-	pmap_off = le64toh(m_hdr->PartitionEntryLBA) * m_sector_size;
-	pmap_size = le32toh(m_hdr->NumberOfPartitionEntries) * le32toh(m_hdr->SizeOfPartitionEntry);
-
-	dbg_printf("pmap_off = %" PRIX64 " pmap_size = %" PRIX64 "\n", pmap_off, pmap_size);
-
-	while (pmap_size > 0) {
-		size = pmap_size;
-		if (size > 0x1000) size = 0x1000;
-		dbg_printf("read %p %zX %" PRIX64 "\n", buf, size, pmap_off);
-		src.Read(buf, size, pmap_off);
-		dbg_printf("write same\n");
-		dst.Write(buf, size, pmap_off);
-		pmap_off += size;
-		pmap_size -= size;
-	}
-
-	src.Read(buf, m_sector_size, le64toh(m_hdr->AlternateLBA) * m_sector_size);
-	dst.Write(buf, m_sector_size, le64toh(m_hdr->AlternateLBA) * m_sector_size);
+	// Protective MBR and primary header
+	extents.Add(0, 2 * m_sector_size);
+	extents.Add(le64toh(m_hdr->PartitionEntryLBA) * m_sector_size,
+		static_cast<uint64_t>(le32toh(m_hdr->NumberOfPartitionEntries)) * le32toh(m_hdr->SizeOfPartitionEntry));
 
-	const PMAP_GptHeader *alt_hdr = reinterpret_cast<const PMAP_GptHeader *>(buf);
+	alt_lba = le64toh(m_hdr->AlternateLBA);
+	extents.Add(alt_lba * m_sector_size, m_sector_size);
 
-	dbg_printf("Pe LBA: %016" PRIX64 "\n", le64toh(alt_hdr->PartitionEntryLBA));
+	err = src.Read(&alt_hdr, sizeof(alt_hdr), alt_lba * m_sector_size);
+	if (err) return err;
 
-	pmap_off = le64toh(alt_hdr->PartitionEntryLBA) * m_sector_size;
-	pmap_size = le32toh(alt_hdr->NumberOfPartitionEntries) * le32toh(alt_hdr->SizeOfPartitionEntry);
+	dbg_printf("Alt Pe LBA: %016" PRIX64 "\n", le64toh(alt_hdr.PartitionEntryLBA));
 
-	dbg_printf("pmap_off = %" PRIX64 " pmap_size = %" PRIX64 "\n", pmap_off, pmap_size);
+	if (alt_hdr.Signature != m_hdr->Signature)
+		return 0;
 
-	while (pmap_size > 0) {
-		size = pmap_size;
-		if (size > 0x1000) size = 0x1000;
-		dbg_printf("read %p %zX %" PRIX64 "\n", buf, size, pmap_off);
-		src.Read(buf, size, pmap_off);
-		dbg_printf("write same\n");
-		dst.Write(buf, size, pmap_off);
-		pmap_off += size;
-		pmap_size -= size;
-	}
+	extents.Add(le64toh(alt_hdr.PartitionEntryLBA) * m_sector_size,
+		static_cast<uint64_t>(le32toh(alt_hdr.NumberOfPartitionEntries)) * le32toh(alt_hdr.SizeOfPartitionEntry));
 
-	return ENOTSUP;
+	return 0;
 }
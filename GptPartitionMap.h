@@ -22,17 +22,14 @@
 #include <vector>
 
 #include "Crc32.h"
-
-class Device;
+#include "PartitionMap.h"
 
 struct PMAP_GptHeader;
 struct PMAP_Entry;
 
-class GptPartitionMap
+class GptPartitionMap : public PartitionMap
 {
 public:
-	typedef uint8_t PM_GUID[0x10];
-
 	struct PMAP_GptHeader
 	{
 		uint64_t Signature;
@@ -64,15 +61,19 @@ public:
 
 	GptPartitionMap();
 
-	bool LoadAndVerify(Device &dev);
+	bool LoadAndVerify(Device &dev) override;
 
 	int FindFirstAPFSPartition();
 	bool GetPartitionOffsetAndSize(int partnum, uint64_t &offset, uint64_t &size);
 	bool GetPartitionEntry(int partnum, PMAP_Entry &pe);
 
-	void ListEntries();
+	void ListEntries() override;
+
+	int GetPartitionCount() const override;
+	bool GetPartition(int partnum, Partition &part) const override;
 
-	int CopyGPT(Device &src, Device &dst);
+	// Appends the ranges occupied by the protective MBR, both headers and both entry arrays.
+	int GetExtents(Device &src, ExtentList &extents) override;
 
 private:
 	Crc32 m_crc;
@@ -87,4 +88,7 @@ private:
 public:
 	static const PM_GUID PTYPE_EFI_SYS;
 	static const PM_GUID PTYPE_APFS;
+	static const PM_GUID PTYPE_HFSPLUS;
+	static const PM_GUID PTYPE_BASIC_DATA;
+	static const PM_GUID PTYPE_LINUX_DATA;
 };
@@ -0,0 +1,141 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cstdio>
+#include <cinttypes>
+#include <endian.h>
+
+#include "Bitmap.h"
+#include "Device.h"
+#include "ExtentList.h"
+#include "Hfsplus.h"
+#include "hfsplus_layout.h"
+
+#define dbg_printf(...) // printf(__VA_ARGS__)
+
+static constexpr size_t BM_BUF_SIZE = 0x100000;
+
+Hfsplus::Hfsplus(Device &src, uint64_t offset, uint64_t size) : FileSystem(src, offset, size)
+{
+	m_block_size = 0;
+	m_bm_buf = new uint8_t[BM_BUF_SIZE];
+}
+
+Hfsplus::~Hfsplus()
+{
+	delete[] m_bm_buf;
+}
+
+bool Hfsplus::Probe(Device& src, uint64_t offset)
+{
+	uint16_t sig;
+
+	if (src.Read(&sig, sizeof(sig), offset + kHFSVolumeHeaderOffset)) return false;
+
+	return be16toh(sig) == kHFSPlusSigWord || be16toh(sig) == kHFSXSigWord;
+}
+
+int Hfsplus::GetExtents(ExtentList& extents)
+{
+	HFSPlusVolumeHeader vh;
+	uint64_t total_blocks;
+	uint64_t bm_bytes;
+	uint64_t fork_bytes;
+	uint64_t block;
+	uint64_t off;
+	uint64_t size;
+	size_t bsize;
+	int k;
+	int err;
+
+	err = m_srcdev.Read(&vh, sizeof(vh), m_offset + kHFSVolumeHeaderOffset);
+	if (err) return err;
+
+	// HFS wrappers around an embedded HFS+ volume are not supported, the caller can copy those raw.
+	if (be16toh(vh.signature) != kHFSPlusSigWord && be16toh(vh.signature) != kHFSXSigWord)
+		return ENOTSUP;
+
+	m_block_size = be32toh(vh.blockSize);
+	if (m_block_size < 512 || (m_block_size & (m_block_size - 1)))
+		return EINVAL;
+
+	total_blocks = be32toh(vh.totalBlocks);
+	bm_bytes = (total_blocks + 7) >> 3;
+
+	dbg_printf("HFS+ block size %u, %" PRIu64 " blocks, %u free\n", m_block_size, total_blocks, be32toh(vh.freeBlocks));
+
+	// Allocation files with more than 8 extents continue in the extents overflow file. That's rare, so just let the caller copy raw.
+	fork_bytes = 0;
+	for (k = 0; k < 8; k++)
+		fork_bytes += static_cast<uint64_t>(be32toh(vh.allocationFile.extents[k].blockCount)) * m_block_size;
+	if (fork_bytes < bm_bytes)
+		return ENOTSUP;
+
+	// Boot blocks and volume header
+	AddExtent(extents, 0, kHFSVolumeHeaderOffset + sizeof(HFSPlusVolumeHeader));
+
+	block = 0;
+
+	for (k = 0; k < 8 && block < total_blocks; k++) {
+		off = static_cast<uint64_t>(be32toh(vh.allocationFile.extents[k].startBlock)) * m_block_size;
+		size = static_cast<uint64_t>(be32toh(vh.allocationFile.extents[k].blockCount)) * m_block_size;
+
+		while (size > 0 && block < total_blocks) {
+			bsize = size;
+			if (bsize > BM_BUF_SIZE) bsize = BM_BUF_SIZE;
+
+			err = m_srcdev.Read(m_bm_buf, bsize, m_offset + off);
+			if (err) return err;
+
+			if (block + (bsize << 3) > total_blocks)
+				ScanBitmap(extents, m_bm_buf, block, total_blocks - block);
+			else
+				ScanBitmap(extents, m_bm_buf, block, bsize << 3);
+
+			block += bsize << 3;
+			off += bsize;
+			size -= bsize;
+		}
+	}
+
+	// The alternate volume header is 1024 bytes before the end of the partition (TN1150). If the volume
+	// is shorter than the partition, the copy at the end of the last allocation block is kept as well.
+	AddExtent(extents, total_blocks * m_block_size - kHFSAltVolumeHeaderTail, kHFSAltVolumeHeaderTail);
+	if (m_size > total_blocks * m_block_size)
+		AddExtent(extents, m_size - kHFSAltVolumeHeaderTail, kHFSAltVolumeHeaderTail);
+
+	return 0;
+}
+
+void Hfsplus::ScanBitmap(ExtentList& extents, const uint8_t* bm, uint64_t first_block, uint64_t block_count)
+{
+	size_t start;
+	size_t end;
+
+	end = 0;
+	for (;;) {
+		start = BitmapFindSet(bm, end, block_count, true);
+		if (start >= block_count)
+			break;
+		end = BitmapFindClear(bm, start, block_count, true);
+
+		AddExtent(extents, (first_block + start) * m_block_size, (end - start) * m_block_size);
+	}
+}
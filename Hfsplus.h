@@ -0,0 +1,41 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+
+#include "FileSystem.h"
+
+class Hfsplus : public FileSystem
+{
+public:
+	Hfsplus(Device &src, uint64_t offset, uint64_t size);
+	~Hfsplus();
+
+	static bool Probe(Device &src, uint64_t offset);
+
+	int GetExtents(ExtentList &extents) override;
+
+private:
+	void ScanBitmap(ExtentList &extents, const uint8_t *bm, uint64_t first_block, uint64_t block_count);
+
+	uint32_t m_block_size;
+	uint8_t *m_bm_buf;
+};
@@ -0,0 +1,59 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstring>
+
+#include "AppleSparseimage.h"
+#include "ImageFile.h"
+#include "Qcow2Image.h"
+#include "RawImage.h"
+
+std::unique_ptr<ImageFile> ImageFile::CreateFormat(const char* format)
+{
+	if (!strcmp(format, "sparseimage"))
+		return std::unique_ptr<ImageFile>(new AppleSparseimage());
+	if (!strcmp(format, "raw"))
+		return std::unique_ptr<ImageFile>(new RawImage());
+	if (!strcmp(format, "qcow2"))
+		return std::unique_ptr<ImageFile>(new Qcow2Image());
+	return nullptr;
+}
+
+const char* ImageFile::FormatFromName(const char* name)
+{
+	static const struct {
+		const char *ext;
+		const char *format;
+	} exts[] = {
+		{ ".img", "raw" },
+		{ ".raw", "raw" },
+		{ ".dd", "raw" },
+		{ ".qcow2", "qcow2" },
+	};
+
+	size_t len = strlen(name);
+
+	for (const auto &e : exts) {
+		size_t elen = strlen(e.ext);
+		if (len > elen && !strcasecmp(name + len - elen, e.ext))
+			return e.format;
+	}
+
+	return "sparseimage";
+}
@@ -0,0 +1,51 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+
+#include <memory>
+
+#include "Device.h"
+
+class ExtentList;
+
+// Output image. Besides reading and writing, images can be created, reopened for resuming or verifying, and flushed.
+class ImageFile : public Device
+{
+public:
+	virtual int Create(const char *name, uint64_t size) = 0;
+	virtual int Open(const char *name, bool writable) = 0;
+	virtual void Close() = 0;
+	// Writes the metadata and syncs the file, so that everything written so far survives a crash.
+	virtual int Flush() = 0;
+	// Appends the ranges that hold data. Everything else reads as zeros.
+	virtual int GetAllocatedExtents(ExtentList &extents) = 0;
+	// Called with the sorted ranges that are about to be written, so that formats allocating space in the
+	// order of the writes can lay it out in logical order instead.
+	virtual int Reserve(const ExtentList &extents) { (void)extents; return 0; }
+	// Granularity of the space allocated in the file. Units that are never written take no space.
+	virtual uint64_t GetAllocationUnit() const = 0;
+
+	// format is sparseimage, raw or qcow2. Returns nullptr for unknown formats.
+	static std::unique_ptr<ImageFile> CreateFormat(const char *format);
+	// Guesses the format from the file name extension, sparseimage if there is no match.
+	static const char *FormatFromName(const char *name);
+};
@@ -0,0 +1,171 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cinttypes>
+
+#include <chrono>
+
+#include "InstrumentedDevice.h"
+#include "Json.h"
+
+static uint64_t NowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+IoStats::IoStats() : ops(0), bytes(0), errors(0), busy_ns(0), max_ns(0)
+{
+	for (int k = 0; k < HIST_BUCKETS; k++)
+		hist[k] = 0;
+}
+
+void IoStats::Record(size_t size, uint64_t ns, bool error)
+{
+	uint64_t us = ns / 1000;
+	uint64_t prev_max;
+	int bucket;
+
+	ops++;
+	busy_ns += ns;
+	if (error)
+		errors++;
+	else
+		bytes += size;
+
+	prev_max = max_ns;
+	while (ns > prev_max && !max_ns.compare_exchange_weak(prev_max, ns)) ;
+
+	bucket = us ? 64 - __builtin_clzll(us) : 0;
+	if (bucket >= HIST_BUCKETS)
+		bucket = HIST_BUCKETS - 1;
+	hist[bucket]++;
+}
+
+uint64_t IoStats::Percentile(double q) const
+{
+	uint64_t total = ops;
+	uint64_t sum = 0;
+	int k;
+
+	if (total == 0)
+		return 0;
+
+	for (k = 0; k < HIST_BUCKETS; k++) {
+		sum += hist[k];
+		if (sum >= q * total)
+			break;
+	}
+
+	// Upper bound of the bucket
+	return static_cast<uint64_t>(1) << (k < HIST_BUCKETS ? k : HIST_BUCKETS - 1);
+}
+
+void IoStats::PrintJSON(FILE* f) const
+{
+	int last;
+	int k;
+
+	fprintf(f, "{ \"ops\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"errors\": %" PRIu64, ops.load(), bytes.load(), errors.load());
+	fprintf(f, ", \"busy_s\": %.3f, \"max_latency_us\": %" PRIu64, busy_ns / 1e9, max_ns / 1000);
+	fprintf(f, ", \"p50_us\": %" PRIu64 ", \"p99_us\": %" PRIu64, Percentile(0.5), Percentile(0.99));
+
+	for (last = HIST_BUCKETS - 1; last > 0 && hist[last] == 0; last--) ;
+
+	fprintf(f, ", \"latency_hist_us\": [");
+	for (k = 0; k <= last; k++)
+		fprintf(f, "%s[%" PRIu64 ", %" PRIu64 "]", k ? ", " : "", static_cast<uint64_t>(1) << k, hist[k].load());
+	fprintf(f, "] }");
+}
+
+InstrumentedDevice::InstrumentedDevice(Device& dev, const char* name) : m_dev(dev), m_name(name), m_in_flight(0), m_max_in_flight(0)
+{
+	SetSectorSize(dev.GetSectorSize());
+}
+
+InstrumentedDevice::~InstrumentedDevice()
+{
+}
+
+void InstrumentedDevice::Enter()
+{
+	unsigned int cur = ++m_in_flight;
+	unsigned int prev_max = m_max_in_flight;
+
+	while (cur > prev_max && !m_max_in_flight.compare_exchange_weak(prev_max, cur)) ;
+}
+
+void InstrumentedDevice::Leave()
+{
+	m_in_flight--;
+}
+
+int InstrumentedDevice::Read(void* data, size_t size, uint64_t offset)
+{
+	uint64_t start;
+	int err;
+
+	Enter();
+	start = NowNs();
+	err = m_dev.Read(data, size, offset);
+	m_read.Record(size, NowNs() - start, err != 0);
+	Leave();
+
+	return err;
+}
+
+int InstrumentedDevice::Write(const void* data, size_t size, uint64_t offset)
+{
+	uint64_t start;
+	int err;
+
+	Enter();
+	start = NowNs();
+	err = m_dev.Write(data, size, offset);
+	m_write.Record(size, NowNs() - start, err != 0);
+	Leave();
+
+	return err;
+}
+
+int InstrumentedDevice::CopyFrom(int src_fd, uint64_t offset, uint64_t size)
+{
+	uint64_t start;
+	int err;
+
+	Enter();
+	start = NowNs();
+	err = m_dev.CopyFrom(src_fd, offset, size);
+	// Don't count copies the device can't do at all, they are repeated with Write().
+	if (err != ENOTSUP)
+		m_write.Record(size, NowNs() - start, err != 0);
+	Leave();
+
+	return err;
+}
+
+void InstrumentedDevice::PrintJSON(FILE* f) const
+{
+	fprintf(f, "{ \"name\": \"%s\", \"max_in_flight\": %u,\n", JsonEscape(m_name).c_str(), m_max_in_flight.load());
+	fprintf(f, "      \"read\": ");
+	m_read.PrintJSON(f);
+	fprintf(f, ",\n      \"write\": ");
+	m_write.PrintJSON(f);
+	fprintf(f, " }");
+}
@@ -0,0 +1,84 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include <atomic>
+
+#include "Device.h"
+
+// Counters for one direction (read or write) of a device.
+struct IoStats
+{
+	// Latency buckets, bucket n counts operations taking [2^(n-1), 2^n) microseconds
+	static constexpr int HIST_BUCKETS = 32;
+
+	std::atomic<uint64_t> ops;
+	std::atomic<uint64_t> bytes;
+	std::atomic<uint64_t> errors;
+	std::atomic<uint64_t> busy_ns;
+	std::atomic<uint64_t> max_ns;
+	std::atomic<uint64_t> hist[HIST_BUCKETS];
+
+	IoStats();
+
+	void Record(size_t size, uint64_t ns, bool error);
+	// Latency below which the fraction q of all operations completed, in microseconds
+	uint64_t Percentile(double q) const;
+	void PrintJSON(FILE *f) const;
+};
+
+// Wraps a device and records throughput, latency and queue depth of everything passing through.
+class InstrumentedDevice : public Device
+{
+public:
+	InstrumentedDevice(Device &dev, const char *name);
+	~InstrumentedDevice();
+
+	int Read(void *data, size_t size, uint64_t offset) override;
+	int Write(const void *data, size_t size, uint64_t offset) override;
+	uint64_t GetSize() const override { return m_dev.GetSize(); }
+	int GetFileDescriptor() const override { return m_dev.GetFileDescriptor(); }
+	// Counted as a write, the source side of the copy doesn't see it.
+	int CopyFrom(int src_fd, uint64_t offset, uint64_t size) override;
+
+	const char *GetName() const { return m_name; }
+	const IoStats &GetReadStats() const { return m_read; }
+	const IoStats &GetWriteStats() const { return m_write; }
+	unsigned int GetMaxInFlight() const { return m_max_in_flight; }
+
+	void PrintJSON(FILE *f) const;
+
+private:
+	void Enter();
+	void Leave();
+
+	Device &m_dev;
+	const char *m_name;
+
+	IoStats m_read;
+	IoStats m_write;
+
+	std::atomic<unsigned int> m_in_flight;
+	std::atomic<unsigned int> m_max_in_flight;
+};
@@ -0,0 +1,227 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cstdio>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "BufferPool.h"
+#include "IoTuning.h"
+#include "Sysfs.h"
+
+#define dbg_printf(...) // printf(__VA_ARGS__)
+
+static constexpr size_t BUF_SIZE = BufferPool::BUFFER_SIZE;
+// Requests stay aligned for O_DIRECT.
+static constexpr size_t MIN_ALIGN = 0x1000;
+// Smallest request size tried by Calibrate
+static constexpr size_t MIN_PROBE_REQUEST = 0x20000;
+// Parts of the device read by Calibrate
+static constexpr uint64_t PROBE_REGIONS = 8;
+// Queue depths, see Tune()
+static constexpr unsigned int ROTATIONAL_DEPTH = 2;
+static constexpr unsigned int SSD_DEPTH = 4;
+static constexpr unsigned int MULTIQUEUE_DEPTH = 8;
+// A disk reads about this much in the time of a short seek.
+static constexpr uint64_t ROTATIONAL_BRIDGE_GAP = 0x40000;
+
+static bool ReadValue(const std::string &name, uint64_t &value)
+{
+	FILE *f = fopen(name.c_str(), "r");
+	unsigned long long v;
+	int rc;
+
+	if (!f)
+		return false;
+	rc = fscanf(f, "%llu", &v);
+	fclose(f);
+
+	if (rc != 1)
+		return false;
+	value = v;
+	return true;
+}
+
+IoTuning::IoTuning()
+{
+	m_logical_sector = 0x200;
+	m_physical_sector = 0x200;
+	m_optimal_io = 0;
+	m_max_request = 0;
+	m_hw_queues = 1;
+	m_rotational = false;
+	m_request_size = BUF_SIZE;
+	m_queue_depth = SSD_DEPTH;
+	m_bridge_gap = 0;
+}
+
+int IoTuning::Query(const char* path)
+{
+	// A file is tuned for the disk of its filesystem, a partition for its disk.
+	const std::string dir = SysfsDiskDir(path);
+	uint64_t value;
+	DIR *mq;
+	struct dirent *de;
+
+	if (dir.empty() || access((dir + "/queue").c_str(), F_OK))
+		return ENOENT;
+
+	if (ReadValue(dir + "/queue/logical_block_size", value) && value >= 0x200)
+		m_logical_sector = value;
+	if (ReadValue(dir + "/queue/physical_block_size", value) && value >= m_logical_sector)
+		m_physical_sector = value;
+	if (ReadValue(dir + "/queue/optimal_io_size", value))
+		m_optimal_io = value;
+	if (ReadValue(dir + "/queue/max_sectors_kb", value))
+		m_max_request = value << 10;
+	if (ReadValue(dir + "/queue/rotational", value))
+		m_rotational = value != 0;
+
+	// blk-mq lists one directory per hardware queue.
+	m_hw_queues = 0;
+	mq = opendir((dir + "/mq").c_str());
+	if (mq) {
+		while ((de = readdir(mq)) != nullptr) {
+			if (de->d_name[0] != '.')
+				m_hw_queues++;
+		}
+		closedir(mq);
+	}
+	if (m_hw_queues == 0)
+		m_hw_queues = 1;
+
+	dbg_printf("IoTuning %s: sectors %u/%u, optimal %u, max %u, rotational %d, %u queues\n", dir.c_str(),
+		m_logical_sector, m_physical_sector, m_optimal_io, m_max_request, m_rotational, m_hw_queues);
+
+	Tune();
+	return 0;
+}
+
+void IoTuning::Tune()
+{
+	const size_t align = std::max<size_t>(MIN_ALIGN, m_physical_sector);
+
+	// Whole RAID stripes, or else whole requests as the driver takes them, so the kernel doesn't
+	// split off a small remainder from every request. Buffers limit requests to BUF_SIZE.
+	m_request_size = BUF_SIZE;
+	for (uint32_t unit : { m_optimal_io, m_max_request }) {
+		if (unit >= align && unit % align == 0 && unit <= BUF_SIZE) {
+			m_request_size = BUF_SIZE / unit * unit;
+			break;
+		}
+	}
+
+	// More requests in flight only make a disk seek between them. Flash needs a few to keep its
+	// channels busy, and NVMe with several hardware queues some more.
+	if (m_rotational)
+		m_queue_depth = ROTATIONAL_DEPTH;
+	else if (m_hw_queues > 1)
+		m_queue_depth = MULTIQUEUE_DEPTH;
+	else
+		m_queue_depth = SSD_DEPTH;
+
+	// Flash has no seeks to save.
+	m_bridge_gap = m_rotational ? ROTATIONAL_BRIDGE_GAP : 0;
+}
+
+int IoTuning::Calibrate(const char* path, uint64_t probe_size)
+{
+	const size_t align = std::max<size_t>(MIN_ALIGN, m_physical_sector);
+	std::vector<size_t> sizes;
+	std::vector<double> seconds;
+	uint64_t dev_size;
+	uint64_t region;
+	uint64_t slice;
+	uint8_t *buf;
+	ssize_t nread;
+	size_t n;
+	int fd;
+	int err = 0;
+
+	for (size_t size = MIN_PROBE_REQUEST; size <= BUF_SIZE; size <<= 1)
+		sizes.push_back(size);
+	if (std::find(sizes.begin(), sizes.end(), m_request_size) == sizes.end())
+		sizes.push_back(m_request_size);
+	std::sort(sizes.begin(), sizes.end());
+	n = sizes.size();
+
+	// The page cache would measure memory, not the device.
+	fd = open(path, O_RDONLY | O_LARGEFILE | O_DIRECT);
+	if (fd < 0)
+		return errno;
+
+	// Every size reads a slice of each region, so that all of them see the same parts of the disk.
+	dev_size = lseek64(fd, 0, SEEK_END);
+	region = dev_size / PROBE_REGIONS / align * align;
+	slice = std::min<uint64_t>(probe_size / PROBE_REGIONS, region / n) / align * align;
+	if (slice == 0) {
+		close(fd);
+		return EINVAL;
+	}
+
+	buf = BufferPool::Instance().Acquire();
+	if (!buf) {
+		close(fd);
+		return ENOMEM;
+	}
+
+	seconds.assign(n, 0.0);
+	for (size_t r = 0; r < PROBE_REGIONS && !err; r++) {
+		// Rotate the order, so that no size always pays for the seek into the region.
+		for (size_t j = 0; j < n && !err; j++) {
+			const size_t k = (j + r) % n;
+			const uint64_t start = r * region + j * slice;
+			auto begin = std::chrono::steady_clock::now();
+			uint64_t done = 0;
+
+			while (done < slice) {
+				size_t size = std::min<uint64_t>(sizes[k], slice - done);
+
+				nread = pread64(fd, buf, size, start + done);
+				if (nread != static_cast<ssize_t>(size)) {
+					err = nread < 0 ? errno : EIO;
+					break;
+				}
+				done += size;
+			}
+			seconds[k] += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		}
+	}
+
+	BufferPool::Instance().Release(buf);
+	close(fd);
+	if (err)
+		return err;
+
+	m_probes.clear();
+	for (size_t k = 0; k < n; k++)
+		m_probes.push_back({ sizes[k], seconds[k] > 0 ? slice * PROBE_REGIONS / seconds[k] : 0.0 });
+
+	m_request_size = std::max_element(m_probes.begin(), m_probes.end(),
+		[](const Probe &a, const Probe &b) { return a.bytes_per_sec < b.bytes_per_sec; })->request_size;
+
+	return 0;
+}
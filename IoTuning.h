@@ -0,0 +1,77 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+// Request size and number of requests in flight for a device, derived from the queue limits its
+// driver reports in sysfs and optionally from a short read test.
+class IoTuning
+{
+public:
+	// Bytes read at every request size by Calibrate
+	static constexpr uint64_t DEFAULT_PROBE_SIZE = 0x4000000;
+
+	struct Probe
+	{
+		size_t request_size;
+		double bytes_per_sec;
+	};
+
+	IoTuning();
+
+	// Reads the limits of the disk holding path, a block device or a file on it. Returns ENOENT
+	// if sysfs doesn't describe the disk, the defaults stay in place then.
+	int Query(const char *path);
+	// Reads probe_size bytes at several request sizes from path with O_DIRECT and keeps the fastest
+	// size. The sizes take turns in the same regions spread over the device.
+	int Calibrate(const char *path, uint64_t probe_size = DEFAULT_PROBE_SIZE);
+
+	size_t GetRequestSize() const { return m_request_size; }
+	unsigned int GetQueueDepth() const { return m_queue_depth; }
+	// Largest gap between extents that is cheaper to read than to seek over, 0 = none
+	uint64_t GetBridgeGap() const { return m_bridge_gap; }
+
+	unsigned int GetLogicalSectorSize() const { return m_logical_sector; }
+	unsigned int GetPhysicalSectorSize() const { return m_physical_sector; }
+	// 0 if the device doesn't report them
+	uint32_t GetOptimalIoSize() const { return m_optimal_io; }
+	uint32_t GetMaxRequest() const { return m_max_request; }
+	bool IsRotational() const { return m_rotational; }
+	const std::vector<Probe> &GetProbes() const { return m_probes; }
+
+private:
+	void Tune();
+
+	unsigned int m_logical_sector;
+	unsigned int m_physical_sector;
+	uint32_t m_optimal_io;
+	uint32_t m_max_request;
+	unsigned int m_hw_queues;
+	bool m_rotational;
+
+	size_t m_request_size;
+	unsigned int m_queue_depth;
+	uint64_t m_bridge_gap;
+	std::vector<Probe> m_probes;
+};
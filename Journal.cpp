@@ -0,0 +1,181 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cstring>
+#include <cinttypes>
+#include <cstdio>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+
+#include "ExtentList.h"
+#include "Journal.h"
+
+#define dbg_printf(...) // printf(__VA_ARGS__)
+
+static_assert(sizeof(Journal::Header) == 40, "Journal header wrong size");
+static_assert(sizeof(Journal::Record) == 16, "Journal record wrong size");
+
+static constexpr uint32_t JOURNAL_SIGNATURE = 0x4A445346; // 'FSDJ'
+static constexpr uint32_t JOURNAL_VERSION = 1;
+
+Journal::Journal() : m_crc(true)
+{
+	m_seq = 0;
+	m_fd = -1;
+}
+
+Journal::~Journal()
+{
+	Close();
+}
+
+uint32_t Journal::CalcCRC(const void* data, size_t size)
+{
+	m_crc.SetCRC(0xFFFFFFFF);
+	m_crc.Calc(reinterpret_cast<const uint8_t *>(data), size);
+	return m_crc.GetCRC() ^ 0xFFFFFFFF;
+}
+
+void Journal::FillHeader(Journal::Header& hdr, const ExtentList& plan, uint64_t drive_size)
+{
+	uint64_t ext_le[2];
+
+	m_crc.SetCRC(0xFFFFFFFF);
+	for (const Extent &ext : plan) {
+		ext_le[0] = htole64(ext.offset);
+		ext_le[1] = htole64(ext.size);
+		m_crc.Calc(reinterpret_cast<const uint8_t *>(ext_le), sizeof(ext_le));
+	}
+
+	hdr.signature = htole32(JOURNAL_SIGNATURE);
+	hdr.version = htole32(JOURNAL_VERSION);
+	hdr.drive_size = htole64(drive_size);
+	hdr.plan_extents = htole64(plan.Count());
+	hdr.plan_bytes = htole64(plan.TotalSize());
+	hdr.plan_crc = htole32(m_crc.GetCRC() ^ 0xFFFFFFFF);
+	hdr.header_crc = 0;
+	hdr.header_crc = htole32(CalcCRC(&hdr, sizeof(hdr)));
+}
+
+int Journal::Create(const char* name, const ExtentList& plan, uint64_t drive_size)
+{
+	Header hdr;
+
+	Close();
+
+	m_fd = open(name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (m_fd < 0)
+		return errno;
+
+	m_name = name;
+	m_seq = 0;
+
+	FillHeader(hdr, plan, drive_size);
+
+	if (pwrite64(m_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fdatasync(m_fd))
+		return errno ? errno : EIO;
+
+	return 0;
+}
+
+int Journal::Open(const char* name, const ExtentList& plan, uint64_t drive_size, uint64_t& done_offset)
+{
+	Header hdr;
+	Header expected;
+	Record rec;
+	uint64_t offset;
+	uint32_t crc;
+
+	Close();
+
+	m_fd = open(name, O_RDWR);
+	if (m_fd < 0)
+		return errno;
+
+	m_name = name;
+	m_seq = 0;
+	done_offset = 0;
+
+	if (pread64(m_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return EINVAL;
+
+	FillHeader(expected, plan, drive_size);
+	if (memcmp(&hdr, &expected, sizeof(hdr)))
+		return ESTALE;
+
+	// Use the last intact record. A torn record at the end is left over from a crash during a checkpoint.
+	offset = sizeof(hdr);
+	while (pread64(m_fd, &rec, sizeof(rec), offset) == sizeof(rec)) {
+		crc = le32toh(rec.crc);
+		rec.crc = 0;
+		if (crc != CalcCRC(&rec, sizeof(rec)) || le32toh(rec.seq) != m_seq)
+			break;
+
+		done_offset = le64toh(rec.done_offset);
+		m_seq++;
+		offset += sizeof(rec);
+	}
+
+	dbg_printf("Journal: %u records, done up to %" PRIX64 "\n", m_seq, done_offset);
+
+	// Drop anything behind the last good record, new records go there.
+	if (ftruncate(m_fd, offset))
+		return errno;
+
+	return 0;
+}
+
+int Journal::Checkpoint(uint64_t done_offset)
+{
+	Record rec;
+
+	rec.done_offset = htole64(done_offset);
+	rec.seq = htole32(m_seq);
+	rec.crc = 0;
+	rec.crc = htole32(CalcCRC(&rec, sizeof(rec)));
+
+	if (pwrite64(m_fd, &rec, sizeof(rec), sizeof(Header) + static_cast<uint64_t>(m_seq) * sizeof(rec)) != sizeof(rec))
+		return errno ? errno : EIO;
+	if (fdatasync(m_fd))
+		return errno;
+
+	m_seq++;
+
+	return 0;
+}
+
+void Journal::Close()
+{
+	if (m_fd >= 0)
+		close(m_fd);
+	m_fd = -1;
+}
+
+int Journal::Remove()
+{
+	Close();
+
+	if (!m_name.empty() && unlink(m_name.c_str()))
+		return errno;
+
+	return 0;
+}
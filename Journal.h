@@ -0,0 +1,71 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <string>
+
+#include "Crc32.h"
+
+class ExtentList;
+
+// Progress journal for resumable dumps. Records, at checkpoints, the source offset up to which
+// the copy plan is durably stored in the image.
+class Journal
+{
+public:
+	struct Header {
+		uint32_t signature;
+		uint32_t version;
+		uint64_t drive_size;
+		uint64_t plan_extents;
+		uint64_t plan_bytes;
+		uint32_t plan_crc;
+		uint32_t header_crc;
+	} __attribute__((packed, aligned(8)));
+
+	struct Record {
+		uint64_t done_offset;
+		uint32_t seq;
+		uint32_t crc;
+	} __attribute__((packed, aligned(8)));
+
+	Journal();
+	~Journal();
+
+	int Create(const char *name, const ExtentList &plan, uint64_t drive_size);
+	// Fails with ESTALE if the journal was written for a different plan.
+	int Open(const char *name, const ExtentList &plan, uint64_t drive_size, uint64_t &done_offset);
+	int Checkpoint(uint64_t done_offset);
+	void Close();
+	// Closes and deletes the journal once the dump is complete.
+	int Remove();
+
+private:
+	void FillHeader(Header &hdr, const ExtentList &plan, uint64_t drive_size);
+	uint32_t CalcCRC(const void *data, size_t size);
+
+	Crc32 m_crc;
+	std::string m_name;
+	uint32_t m_seq;
+	int m_fd;
+};
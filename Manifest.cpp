@@ -0,0 +1,255 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <endian.h>
+
+#include <string>
+
+#include "BufferPool.h"
+#include "Manifest.h"
+#include "XxHash64.h"
+
+// Buffers per worker, so the copy can hand over the next chunk while all workers are busy
+static constexpr unsigned int BUFS_PER_THREAD = 2;
+
+static_assert(Manifest::MAX_CHUNK_SIZE <= BufferPool::BUFFER_SIZE, "Chunks must fit into pool buffers");
+
+Manifest::Manifest()
+{
+	m_algorithms = 0;
+	m_busy = 0;
+	m_stop = false;
+}
+
+Manifest::~Manifest()
+{
+	Finish();
+}
+
+bool Manifest::ParseAlgorithms(const char* list, unsigned int& algorithms)
+{
+	const char *p = list;
+	size_t len;
+
+	algorithms = 0;
+
+	while (*p) {
+		len = strcspn(p, ",");
+		if (len == 6 && !strncmp(p, "sha256", len))
+			algorithms |= HASH_SHA256;
+		else if (len == 5 && !strncmp(p, "xxh64", len))
+			algorithms |= HASH_XXH64;
+		else
+			return false;
+		p += len;
+		if (*p == ',') p++;
+	}
+
+	return algorithms != 0;
+}
+
+int Manifest::Start(unsigned int algorithms, unsigned int threads)
+{
+	uint8_t *buf;
+
+	m_algorithms = algorithms;
+	m_stop = false;
+
+	if (threads == 0) threads = 1;
+
+	// Under a tight memory budget, fewer chunks can wait for the workers.
+	for (unsigned int k = 0; k < threads * BUFS_PER_THREAD; k++) {
+		buf = BufferPool::Instance().Acquire();
+		if (!buf)
+			break;
+		m_all_bufs.push_back(buf);
+		m_free_bufs.push_back(buf);
+	}
+	if (m_all_bufs.empty())
+		return ENOMEM;
+
+	for (unsigned int k = 0; k < threads; k++)
+		m_threads.emplace_back(&Manifest::WorkerThread, this);
+
+	return 0;
+}
+
+void Manifest::Add(const uint8_t* data, size_t size, uint64_t offset)
+{
+	size_t n;
+	uint8_t *buf;
+	Record *rec;
+
+	while (size > 0) {
+		n = size > MAX_CHUNK_SIZE ? MAX_CHUNK_SIZE : size;
+
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [this] { return !m_free_bufs.empty(); });
+			buf = m_free_bufs.back();
+			m_free_bufs.pop_back();
+			m_records.push_back({ offset, n, {}, 0 });
+			rec = &m_records.back();
+		}
+
+		memcpy(buf, data, n);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_queue.push_back({ rec, buf });
+		}
+		m_cond.notify_all();
+
+		data += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+void Manifest::Finish()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cond.wait(lock, [this] { return m_queue.empty() && m_busy == 0; });
+		m_stop = true;
+	}
+	m_cond.notify_all();
+
+	for (std::thread &t : m_threads)
+		t.join();
+	m_threads.clear();
+
+	for (uint8_t *buf : m_all_bufs)
+		BufferPool::Instance().Release(buf);
+	m_all_bufs.clear();
+	m_free_bufs.clear();
+}
+
+void Manifest::WorkerThread()
+{
+	Job job;
+
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+			if (m_queue.empty())
+				return;
+			job = m_queue.front();
+			m_queue.pop_front();
+			m_busy++;
+		}
+
+		// Only this thread touches the record until it is done.
+		Hash(*job.record, job.buf);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_free_bufs.push_back(job.buf);
+			m_busy--;
+		}
+		m_cond.notify_all();
+	}
+}
+
+void Manifest::Hash(Record& rec, const uint8_t* data) const
+{
+	if (m_algorithms & HASH_SHA256) {
+		Sha256 sha;
+		sha.Update(data, rec.size);
+		sha.Final(rec.sha256);
+	}
+	if (m_algorithms & HASH_XXH64) {
+		XxHash64 xxh;
+		xxh.Update(data, rec.size);
+		rec.xxh64 = xxh.Final();
+	}
+}
+
+int Manifest::Save(const char* name, const char* src_name, uint64_t dev_size) const
+{
+	const std::string tmp_name = std::string(name) + ".tmp";
+	Sha256 sha_total;
+	XxHash64 xxh_total;
+	uint8_t digest[Sha256::DIGEST_SIZE];
+	uint64_t le_val;
+	FILE *f;
+	int err = 0;
+
+	auto put_sha = [&f](const uint8_t *d) {
+		fprintf(f, "  sha256:");
+		for (size_t k = 0; k < Sha256::DIGEST_SIZE; k++)
+			fprintf(f, "%02x", d[k]);
+	};
+
+	f = fopen(tmp_name.c_str(), "w");
+	if (!f)
+		return errno;
+
+	fprintf(f, "# Manifest. Created by fsdump\n");
+	fprintf(f, "# source: %s\n", src_name);
+	fprintf(f, "# size: %" PRIu64 "\n", dev_size);
+	fprintf(f, "# Digests of the copied ranges. The total digests are taken over the records\n");
+	fprintf(f, "# in this order, each as offset and size (64 bit little endian) followed by the digest of the same kind.\n");
+	fprintf(f, "#      pos        size  digests\n");
+
+	for (const Record &rec : m_records) {
+		fprintf(f, "0x%08" PRIX64 "  0x%08" PRIX64, rec.offset, rec.size);
+
+		le_val = htole64(rec.offset);
+		sha_total.Update(reinterpret_cast<const uint8_t *>(&le_val), sizeof(le_val));
+		xxh_total.Update(reinterpret_cast<const uint8_t *>(&le_val), sizeof(le_val));
+		le_val = htole64(rec.size);
+		sha_total.Update(reinterpret_cast<const uint8_t *>(&le_val), sizeof(le_val));
+		xxh_total.Update(reinterpret_cast<const uint8_t *>(&le_val), sizeof(le_val));
+
+		if (m_algorithms & HASH_SHA256) {
+			put_sha(rec.sha256);
+			sha_total.Update(rec.sha256, sizeof(rec.sha256));
+		}
+		if (m_algorithms & HASH_XXH64) {
+			fprintf(f, "  xxh64:%016" PRIx64, rec.xxh64);
+			le_val = htole64(rec.xxh64);
+			xxh_total.Update(reinterpret_cast<const uint8_t *>(&le_val), sizeof(le_val));
+		}
+		fprintf(f, "\n");
+	}
+
+	fprintf(f, "total");
+	if (m_algorithms & HASH_SHA256) {
+		sha_total.Final(digest);
+		put_sha(digest);
+	}
+	if (m_algorithms & HASH_XXH64)
+		fprintf(f, "  xxh64:%016" PRIx64, xxh_total.Final());
+	fprintf(f, "\n");
+
+	if (ferror(f))
+		err = EIO;
+	if (fclose(f) && !err)
+		err = errno;
+	if (!err && rename(tmp_name.c_str(), name))
+		err = errno;
+
+	return err;
+}
@@ -0,0 +1,91 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Sha256.h"
+
+// Digests of the copied data, computed by worker threads while the copy goes on.
+// Every chunk handed to Add gets its own record, so chunks can be hashed in parallel.
+// The digest of the whole image is taken over the list of records.
+class Manifest
+{
+public:
+	enum Algorithm
+	{
+		HASH_SHA256 = 1,
+		HASH_XXH64 = 2
+	};
+
+	static constexpr size_t MAX_CHUNK_SIZE = 0x400000;
+
+	Manifest();
+	~Manifest();
+
+	// Comma separated list of algorithm names
+	static bool ParseAlgorithms(const char *list, unsigned int &algorithms);
+
+	// Returns ENOMEM if the buffer pool has no buffer left for the workers.
+	int Start(unsigned int algorithms, unsigned int threads);
+	// Queues a copy of the data, waits if all workers are busy.
+	void Add(const uint8_t *data, size_t size, uint64_t offset);
+	// Waits until everything queued has been hashed and stops the workers.
+	void Finish();
+
+	int Save(const char *name, const char *src_name, uint64_t dev_size) const;
+
+private:
+	struct Record
+	{
+		uint64_t offset;
+		uint64_t size;
+		uint8_t sha256[Sha256::DIGEST_SIZE];
+		uint64_t xxh64;
+	};
+
+	struct Job
+	{
+		Record *record;
+		uint8_t *buf;
+	};
+
+	void WorkerThread();
+	void Hash(Record &rec, const uint8_t *data) const;
+
+	unsigned int m_algorithms;
+
+	std::deque<Record> m_records;
+	std::deque<Job> m_queue;
+	std::vector<uint8_t *> m_free_bufs;
+	std::vector<uint8_t *> m_all_bufs;
+	std::vector<std::thread> m_threads;
+	size_t m_busy;
+	bool m_stop;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+};
@@ -0,0 +1,209 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+#include <endian.h>
+
+#include <algorithm>
+
+#include "Device.h"
+#include "ExtentList.h"
+#include "MbrPartitionMap.h"
+
+#define dbg_printf(...) // printf(__VA_ARGS__)
+
+static_assert(sizeof(MbrPartitionMap::MBR_Entry) == 16, "MBR Entry wrong size");
+
+static constexpr size_t MBR_ENTRY_OFFSET = 0x1BE;
+static constexpr size_t MBR_SIGNATURE_OFFSET = 0x1FE;
+static constexpr uint16_t MBR_SIGNATURE = 0xAA55;
+// Limit for the EBR chain, so that a loop in a corrupt chain doesn't hang.
+static constexpr unsigned int MAX_LOGICAL_PARTITIONS = 128;
+// Boot loaders like GRUB live between the MBR and the first partition.
+static constexpr uint64_t MAX_BOOT_GAP = 0x100000;
+
+MbrPartitionMap::MbrPartitionMap()
+{
+	m_disk_sectors = 0;
+	m_sector_size = 0x200;
+}
+
+bool MbrPartitionMap::IsExtended(uint8_t type)
+{
+	return type == PTYPE_EXTENDED || type == PTYPE_EXTENDED_LBA || type == PTYPE_LINUX_EXTENDED;
+}
+
+bool MbrPartitionMap::CheckEntry(const MBR_Entry& e, uint64_t base_lba, uint64_t end_lba)
+{
+	uint64_t first = base_lba + le32toh(e.FirstLBA);
+
+	if (e.Status != 0x00 && e.Status != 0x80)
+		return false;
+	if (le32toh(e.FirstLBA) == 0 || le32toh(e.SectorCount) == 0)
+		return false;
+
+	return first < end_lba && le32toh(e.SectorCount) <= end_lba - first;
+}
+
+bool MbrPartitionMap::LoadAndVerify(Device& dev)
+{
+	std::vector<uint8_t> sector;
+	const MBR_Entry *entries;
+	uint16_t sig;
+	int k;
+
+	m_parts.clear();
+	m_ebr_lbas.clear();
+
+	m_sector_size = dev.GetSectorSize();
+	m_disk_sectors = dev.GetSize() / m_sector_size;
+
+	sector.resize(m_sector_size);
+	if (dev.Read(sector.data(), m_sector_size, 0))
+		return false;
+
+	memcpy(&sig, sector.data() + MBR_SIGNATURE_OFFSET, sizeof(sig));
+	if (le16toh(sig) != MBR_SIGNATURE)
+		return false;
+
+	entries = reinterpret_cast<const MBR_Entry *>(sector.data() + MBR_ENTRY_OFFSET);
+
+	for (k = 0; k < 4; k++) {
+		const MBR_Entry &e = entries[k];
+
+		if (e.Type == PTYPE_EMPTY)
+			continue;
+
+		// A boot sector without partition table (FAT superfloppy, for example) fails here.
+		if (!CheckEntry(e, 0, m_disk_sectors)) {
+			m_parts.clear();
+			return false;
+		}
+
+		// Protective or hybrid MBR with a broken GPT. The GPT partition is not something we can copy.
+		if (e.Type == PTYPE_GPT_PROTECTIVE)
+			continue;
+
+		if (IsExtended(e.Type)) {
+			if (!LoadExtended(dev, le32toh(e.FirstLBA), le32toh(e.SectorCount))) {
+				m_parts.clear();
+				return false;
+			}
+			continue;
+		}
+
+		m_parts.push_back({ le32toh(e.FirstLBA), le32toh(e.SectorCount), e.Type });
+	}
+
+	std::sort(m_parts.begin(), m_parts.end(), [](const PartEntry &a, const PartEntry &b) { return a.lba < b.lba; });
+
+	return !m_parts.empty() || !m_ebr_lbas.empty();
+}
+
+bool MbrPartitionMap::LoadExtended(Device& dev, uint64_t ext_lba, uint64_t ext_sectors)
+{
+	std::vector<uint8_t> sector(m_sector_size);
+	const MBR_Entry *entries;
+	uint64_t ebr_lba = ext_lba;
+	uint16_t sig;
+	unsigned int n;
+
+	for (n = 0; n < MAX_LOGICAL_PARTITIONS; n++) {
+		dbg_printf("EBR at %" PRIX64 "\n", ebr_lba);
+
+		if (dev.Read(sector.data(), m_sector_size, ebr_lba * m_sector_size))
+			return false;
+
+		memcpy(&sig, sector.data() + MBR_SIGNATURE_OFFSET, sizeof(sig));
+		if (le16toh(sig) != MBR_SIGNATURE)
+			return false;
+
+		m_ebr_lbas.push_back(ebr_lba);
+
+		entries = reinterpret_cast<const MBR_Entry *>(sector.data() + MBR_ENTRY_OFFSET);
+
+		// The first entry is relative to the EBR, the link to the next EBR is relative to the extended partition.
+		if (entries[0].Type != PTYPE_EMPTY) {
+			if (!CheckEntry(entries[0], ebr_lba, ext_lba + ext_sectors))
+				return false;
+			m_parts.push_back({ ebr_lba + le32toh(entries[0].FirstLBA), le32toh(entries[0].SectorCount), entries[0].Type });
+		}
+
+		if (!IsExtended(entries[1].Type))
+			return true;
+		if (!CheckEntry(entries[1], ext_lba, ext_lba + ext_sectors))
+			return false;
+
+		// The chain must move forward, otherwise it is corrupt.
+		if (ext_lba + le32toh(entries[1].FirstLBA) <= ebr_lba)
+			return false;
+		ebr_lba = ext_lba + le32toh(entries[1].FirstLBA);
+	}
+
+	return false;
+}
+
+int MbrPartitionMap::GetPartitionCount() const
+{
+	return static_cast<int>(m_parts.size());
+}
+
+bool MbrPartitionMap::GetPartition(int partnum, Partition& part) const
+{
+	if (partnum < 0 || partnum >= GetPartitionCount())
+		return false;
+
+	const PartEntry &e = m_parts[partnum];
+
+	part.offset = e.lba * m_sector_size;
+	part.size = e.sectors * m_sector_size;
+	memset(part.type_guid, 0, sizeof(PM_GUID));
+	part.mbr_type = e.type;
+
+	return true;
+}
+
+void MbrPartitionMap::ListEntries()
+{
+	for (const PartEntry &e : m_parts)
+		printf("%02X %016" PRIX64 " %016" PRIX64 "\n", e.type, e.lba, e.lba + e.sectors - 1);
+}
+
+int MbrPartitionMap::GetExtents(Device& src, ExtentList& extents)
+{
+	uint64_t gap_end = m_disk_sectors * m_sector_size;
+
+	(void)src;
+
+	for (const PartEntry &e : m_parts)
+		gap_end = std::min(gap_end, e.lba * m_sector_size);
+	for (uint64_t lba : m_ebr_lbas)
+		gap_end = std::min(gap_end, lba * m_sector_size);
+
+	gap_end = std::min(gap_end, MAX_BOOT_GAP);
+	gap_end = std::max<uint64_t>(gap_end, m_sector_size);
+
+	extents.Add(0, gap_end);
+	for (uint64_t lba : m_ebr_lbas)
+		extents.Add(lba * m_sector_size, m_sector_size);
+
+	return 0;
+}
@@ -0,0 +1,85 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "PartitionMap.h"
+
+// Classic MBR partition table, including logical partitions in extended partitions.
+// On hybrid MBR disks the GPT is authoritative, so this is only used if there is no valid GPT.
+class MbrPartitionMap : public PartitionMap
+{
+public:
+	struct MBR_Entry
+	{
+		uint8_t  Status;
+		uint8_t  FirstCHS[3];
+		uint8_t  Type;
+		uint8_t  LastCHS[3];
+		uint32_t FirstLBA;
+		uint32_t SectorCount;
+	} __attribute__((packed));
+
+	MbrPartitionMap();
+
+	bool LoadAndVerify(Device &dev) override;
+	void ListEntries() override;
+
+	int GetPartitionCount() const override;
+	bool GetPartition(int partnum, Partition &part) const override;
+
+	// Appends the MBR with the boot loader gap behind it, and the EBRs of logical partitions.
+	int GetExtents(Device &src, ExtentList &extents) override;
+
+	static constexpr uint8_t PTYPE_EMPTY = 0x00;
+	static constexpr uint8_t PTYPE_FAT12 = 0x01;
+	static constexpr uint8_t PTYPE_FAT16_SMALL = 0x04;
+	static constexpr uint8_t PTYPE_EXTENDED = 0x05;
+	static constexpr uint8_t PTYPE_FAT16 = 0x06;
+	static constexpr uint8_t PTYPE_NTFS_EXFAT = 0x07;
+	static constexpr uint8_t PTYPE_FAT32 = 0x0B;
+	static constexpr uint8_t PTYPE_FAT32_LBA = 0x0C;
+	static constexpr uint8_t PTYPE_FAT16_LBA = 0x0E;
+	static constexpr uint8_t PTYPE_EXTENDED_LBA = 0x0F;
+	static constexpr uint8_t PTYPE_LINUX_EXTENDED = 0x85;
+	static constexpr uint8_t PTYPE_LINUX = 0x83;
+	static constexpr uint8_t PTYPE_HFSPLUS = 0xAF;
+	static constexpr uint8_t PTYPE_GPT_PROTECTIVE = 0xEE;
+	static constexpr uint8_t PTYPE_EFI_SYS = 0xEF;
+
+private:
+	struct PartEntry
+	{
+		uint64_t lba;
+		uint64_t sectors;
+		uint8_t type;
+	};
+
+	static bool IsExtended(uint8_t type);
+	static bool CheckEntry(const MBR_Entry &e, uint64_t base_lba, uint64_t end_lba);
+	bool LoadExtended(Device &dev, uint64_t ext_lba, uint64_t ext_sectors);
+
+	std::vector<PartEntry> m_parts;
+	std::vector<uint64_t> m_ebr_lbas;
+	uint64_t m_disk_sectors;
+	unsigned int m_sector_size;
+};
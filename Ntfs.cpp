@@ -0,0 +1,280 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+#include <endian.h>
+
+#include "Bitmap.h"
+#include "Device.h"
+#include "ExtentList.h"
+#include "Ntfs.h"
+#include "ntfs_layout.h"
+
+#define dbg_printf(...) // printf(__VA_ARGS__)
+
+static constexpr size_t BM_BUF_SIZE = 0x100000;
+
+Ntfs::Ntfs(Device &src, uint64_t offset, uint64_t size) : FileSystem(src, offset, size)
+{
+	m_cluster_size = 0;
+	m_record_size = 0;
+	m_bitmap_size = 0;
+	m_resident_bitmap = nullptr;
+	m_bm_buf = new uint8_t[BM_BUF_SIZE];
+}
+
+Ntfs::~Ntfs()
+{
+	delete[] m_bm_buf;
+}
+
+bool Ntfs::Probe(Device& src, uint64_t offset)
+{
+	ntfs_boot_sector bs;
+
+	if (src.Read(&bs, sizeof(bs), offset)) return false;
+
+	return !memcmp(bs.oem_id, NTFS_OEM_ID, 8) && le16toh(bs.end_of_sector_marker) == NTFS_BOOT_SIGNATURE;
+}
+
+int Ntfs::GetExtents(ExtentList& extents)
+{
+	ntfs_boot_sector bs;
+	uint32_t bytes_per_sector;
+	uint32_t sectors_per_cluster;
+	uint64_t total_sectors;
+	uint64_t cluster_count;
+	uint64_t cluster;
+	uint64_t off;
+	uint64_t size;
+	size_t bsize;
+	size_t k;
+	int err;
+
+	err = m_srcdev.Read(&bs, sizeof(bs), m_offset);
+	if (err) return err;
+
+	if (memcmp(bs.oem_id, NTFS_OEM_ID, 8) || le16toh(bs.end_of_sector_marker) != NTFS_BOOT_SIGNATURE)
+		return ENOTSUP;
+
+	bytes_per_sector = le16toh(bs.bytes_per_sector);
+	if (bytes_per_sector < 256 || bytes_per_sector > 4096 || (bytes_per_sector & (bytes_per_sector - 1)))
+		return EINVAL;
+
+	// Values above 0x80 are negative shift counts, used for clusters of 128K and more.
+	if (bs.sectors_per_cluster > 0x80)
+		sectors_per_cluster = 1U << (256 - bs.sectors_per_cluster);
+	else
+		sectors_per_cluster = bs.sectors_per_cluster;
+	if (sectors_per_cluster == 0 || (sectors_per_cluster & (sectors_per_cluster - 1)) || sectors_per_cluster > 0x10000)
+		return EINVAL;
+	m_cluster_size = bytes_per_sector * sectors_per_cluster;
+
+	if (bs.clusters_per_mft_record > 0)
+		m_record_size = bs.clusters_per_mft_record * m_cluster_size;
+	else if (bs.clusters_per_mft_record > -32)
+		m_record_size = 1U << -bs.clusters_per_mft_record;
+	if (m_record_size < NTFS_FIXUP_STRIDE || m_record_size > 0x10000)
+		return EINVAL;
+
+	total_sectors = le64toh(bs.number_of_sectors);
+	cluster_count = total_sectors / sectors_per_cluster;
+
+	dbg_printf("NTFS: %" PRIu64 " clusters of %u bytes, MFT at %" PRIX64 "\n", cluster_count, m_cluster_size, le64toh(bs.mft_lcn));
+
+	err = ReadBitmapRecord(le64toh(bs.mft_lcn) * m_cluster_size);
+	if (err) return err;
+
+	if (m_bitmap_size * 8 < cluster_count)
+		return EINVAL;
+
+	cluster = 0;
+	if (m_resident_bitmap) {
+		ScanBitmap(extents, m_resident_bitmap, 0, cluster_count);
+		cluster = cluster_count;
+	}
+
+	for (k = 0; k < m_runs.size() && cluster < cluster_count; k++) {
+		off = m_runs[k].lcn * m_cluster_size;
+		size = m_runs[k].length * m_cluster_size;
+
+		while (size > 0 && cluster < cluster_count) {
+			bsize = size;
+			if (bsize > BM_BUF_SIZE) bsize = BM_BUF_SIZE;
+
+			err = m_srcdev.Read(m_bm_buf, bsize, m_offset + off);
+			if (err) return err;
+
+			if (cluster + bsize * 8 > cluster_count)
+				ScanBitmap(extents, m_bm_buf, cluster, cluster_count - cluster);
+			else
+				ScanBitmap(extents, m_bm_buf, cluster, bsize * 8);
+
+			cluster += bsize * 8;
+			off += bsize;
+			size -= bsize;
+		}
+	}
+
+	if (cluster < cluster_count)
+		return EINVAL;
+
+	// The backup boot sector sits just behind the last sector of the volume and isn't covered by $Bitmap.
+	AddExtent(extents, total_sectors * bytes_per_sector, bytes_per_sector);
+
+	return 0;
+}
+
+int Ntfs::ReadBitmapRecord(uint64_t mft_offset)
+{
+	const ntfs_mft_record *rec;
+	const ntfs_attr_record *attr;
+	const uint16_t *usa;
+	uint16_t *fixup;
+	uint32_t attr_off;
+	uint32_t attr_len;
+	uint32_t k;
+	int err;
+
+	// Record 6 always lies in the first run of the MFT, so no need to look at the MFT's own runlist.
+	m_record.resize(m_record_size);
+	err = m_srcdev.Read(m_record.data(), m_record_size, m_offset + mft_offset + NTFS_MFT_RECORD_BITMAP * m_record_size);
+	if (err) return err;
+
+	rec = reinterpret_cast<const ntfs_mft_record *>(m_record.data());
+	if (le32toh(rec->magic) != NTFS_FILE_MAGIC || !(le16toh(rec->flags) & NTFS_MFT_RECORD_IN_USE))
+		return EINVAL;
+
+	// Undo the update sequence fixups, the last word of every 512 byte stride is stored in the update sequence array.
+	if (le16toh(rec->usa_count) != m_record_size / NTFS_FIXUP_STRIDE + 1)
+		return EINVAL;
+	if (le16toh(rec->usa_ofs) + le16toh(rec->usa_count) * 2U > m_record_size)
+		return EINVAL;
+
+	usa = reinterpret_cast<const uint16_t *>(m_record.data() + le16toh(rec->usa_ofs));
+	for (k = 1; k < le16toh(rec->usa_count); k++) {
+		fixup = reinterpret_cast<uint16_t *>(m_record.data() + k * NTFS_FIXUP_STRIDE - 2);
+		if (*fixup != usa[0])
+			return EINVAL;
+		*fixup = usa[k];
+	}
+
+	attr_off = le16toh(rec->attrs_offset);
+	for (;;) {
+		if (attr_off + 8 > m_record_size)
+			return EINVAL;
+		attr = reinterpret_cast<const ntfs_attr_record *>(m_record.data() + attr_off);
+		if (le32toh(attr->type) == NTFS_AT_END)
+			break;
+		attr_len = le32toh(attr->length);
+		if (attr_len < 16 || attr_off + attr_len > m_record_size)
+			return EINVAL;
+
+		if (le32toh(attr->type) == NTFS_AT_DATA && attr->name_length == 0) {
+			if (!attr->non_resident) {
+				if (le16toh(attr->r.value_offset) + le32toh(attr->r.value_length) > attr_len)
+					return EINVAL;
+				m_resident_bitmap = m_record.data() + attr_off + le16toh(attr->r.value_offset);
+				m_bitmap_size = le32toh(attr->r.value_length);
+				return 0;
+			}
+
+			if (le64toh(attr->nr.lowest_vcn) != 0 || le16toh(attr->nr.mapping_pairs_offset) >= attr_len)
+				return ENOTSUP;
+			// The rest of the runlist is in another record, listed in the attribute list.
+			if (static_cast<uint64_t>(le64toh(attr->nr.highest_vcn)) + 1 < static_cast<uint64_t>(le64toh(attr->nr.allocated_size)) / m_cluster_size)
+				return ENOTSUP;
+			m_bitmap_size = le64toh(attr->nr.data_size);
+			return DecodeRunlist(m_record.data() + attr_off + le16toh(attr->nr.mapping_pairs_offset), m_record.data() + attr_off + attr_len);
+		}
+
+		attr_off += attr_len;
+	}
+
+	// $DATA continued in other records via an attribute list (a very fragmented $Bitmap) isn't
+	// supported. The dump copies the whole partition instead.
+	return ENOTSUP;
+}
+
+int Ntfs::DecodeRunlist(const uint8_t* mp, const uint8_t* mp_end)
+{
+	Run run;
+	int64_t lcn = 0;
+	int64_t delta;
+	uint64_t length;
+	int len_bytes;
+	int off_bytes;
+	int k;
+
+	m_runs.clear();
+
+	while (mp < mp_end && *mp != 0) {
+		len_bytes = *mp & 0x0F;
+		off_bytes = *mp >> 4;
+		mp++;
+
+		if (len_bytes == 0 || len_bytes > 8 || off_bytes > 8 || mp + len_bytes + off_bytes > mp_end)
+			return EINVAL;
+
+		length = 0;
+		for (k = 0; k < len_bytes; k++)
+			length |= static_cast<uint64_t>(mp[k]) << (8 * k);
+		mp += len_bytes;
+
+		// A run without offset is sparse, which makes no sense for $Bitmap.
+		if (off_bytes == 0)
+			return EINVAL;
+
+		delta = 0;
+		for (k = 0; k < off_bytes; k++)
+			delta |= static_cast<int64_t>(mp[k]) << (8 * k);
+		if (off_bytes < 8 && (mp[off_bytes - 1] & 0x80))
+			delta |= -(static_cast<int64_t>(1) << (8 * off_bytes));
+		mp += off_bytes;
+
+		lcn += delta;
+		if (lcn < 0)
+			return EINVAL;
+
+		run.lcn = lcn;
+		run.length = length;
+		m_runs.push_back(run);
+	}
+
+	return 0;
+}
+
+void Ntfs::ScanBitmap(ExtentList& extents, const uint8_t* bm, uint64_t first_cluster, uint64_t cluster_count)
+{
+	size_t start;
+	size_t end;
+
+	end = 0;
+	for (;;) {
+		start = BitmapFindSet(bm, end, cluster_count, false);
+		if (start >= cluster_count)
+			break;
+		end = BitmapFindClear(bm, start, cluster_count, false);
+
+		AddExtent(extents, (first_cluster + start) * m_cluster_size, (end - start) * m_cluster_size);
+	}
+}
@@ -0,0 +1,54 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "FileSystem.h"
+
+class Ntfs : public FileSystem
+{
+	struct Run {
+		uint64_t lcn;
+		uint64_t length;
+	};
+
+public:
+	Ntfs(Device &src, uint64_t offset, uint64_t size);
+	~Ntfs();
+
+	static bool Probe(Device &src, uint64_t offset);
+
+	int GetExtents(ExtentList &extents) override;
+
+private:
+	int ReadBitmapRecord(uint64_t mft_offset);
+	int DecodeRunlist(const uint8_t *mp, const uint8_t *mp_end);
+	void ScanBitmap(ExtentList &extents, const uint8_t *bm, uint64_t first_cluster, uint64_t cluster_count);
+
+	uint32_t m_cluster_size;
+	uint32_t m_record_size;
+	uint64_t m_bitmap_size;
+	std::vector<uint8_t> m_record;
+	std::vector<Run> m_runs;
+	const uint8_t *m_resident_bitmap;
+	uint8_t *m_bm_buf;
+};
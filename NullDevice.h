@@ -0,0 +1,51 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+
+#include "Device.h"
+
+// Sink that discards all writes and reads back zeros, for measuring the read side alone.
+class NullDevice : public Device
+{
+public:
+	NullDevice(uint64_t size) : m_size(size) {}
+
+	int Read(void *data, size_t size, uint64_t offset) override
+	{
+		if (offset + size > m_size) return EINVAL;
+		memset(data, 0, size);
+		return 0;
+	}
+
+	int Write(const void *data, size_t size, uint64_t offset) override
+	{
+		(void)data;
+		if (offset + size > m_size) return EINVAL;
+		return 0;
+	}
+
+	uint64_t GetSize() const override { return m_size; }
+
+private:
+	uint64_t m_size;
+};
@@ -0,0 +1,148 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "Numa.h"
+#include "Sysfs.h"
+
+static constexpr const char *NODE_DIR = "/sys/devices/system/node";
+// Bits in the node mask passed to mbind
+static constexpr unsigned long MAX_NODES = 64;
+
+static int ReadInt(const std::string &name, int &value)
+{
+	FILE *f = fopen(name.c_str(), "r");
+	int rc;
+
+	if (!f)
+		return errno;
+	rc = fscanf(f, "%d", &value);
+	fclose(f);
+
+	return rc == 1 ? 0 : EINVAL;
+}
+
+int NumaNodeCount()
+{
+	char name[64];
+	int count = 0;
+
+	while (count < static_cast<int>(MAX_NODES)) {
+		snprintf(name, sizeof(name), "%s/node%d", NODE_DIR, count);
+		if (access(name, F_OK))
+			break;
+		count++;
+	}
+
+	return count > 0 ? count : 1;
+}
+
+int NumaDeviceNode(const char* path)
+{
+	std::string dir;
+	int node;
+
+	// The block device itself has no node, its controller (a PCI device further up) does.
+	for (dir = SysfsDiskDir(path); dir.size() > 1; dir = dir.substr(0, dir.rfind('/'))) {
+		if (ReadInt(dir + "/numa_node", node) == 0)
+			return node >= 0 ? node : -1;
+	}
+
+	return -1;
+}
+
+int NumaCurrentNode()
+{
+	unsigned int cpu;
+	unsigned int node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, nullptr))
+		return -1;
+
+	return node;
+}
+
+int NumaBindThread(int node)
+{
+	char name[64];
+	char list[4096];
+	cpu_set_t set;
+	FILE *f;
+	char *p;
+	char *end;
+	long first;
+	long last;
+
+	snprintf(name, sizeof(name), "%s/node%d/cpulist", NODE_DIR, node);
+	f = fopen(name, "r");
+	if (!f)
+		return errno;
+	p = fgets(list, sizeof(list), f);
+	fclose(f);
+	if (!p)
+		return EINVAL;
+
+	// Ranges like "0-7,16-23"
+	CPU_ZERO(&set);
+	while (*p && *p != '\n') {
+		first = strtol(p, &end, 10);
+		if (end == p) return EINVAL;
+		last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &set);
+		p = *end == ',' ? end + 1 : end;
+	}
+
+	if (CPU_COUNT(&set) == 0)
+		return EINVAL;
+
+	if (sched_setaffinity(0, sizeof(set), &set))
+		return errno;
+
+	return 0;
+}
+
+int NumaBindMemory(void* mem, size_t size, int node)
+{
+	unsigned long mask;
+
+	if (node < 0 || node >= static_cast<int>(MAX_NODES))
+		return EINVAL;
+
+	mask = 1UL << node;
+	// Preferred rather than bound, so running out of memory on the node doesn't fail.
+	if (syscall(SYS_mbind, mem, size, MPOL_PREFERRED, &mask, MAX_NODES, 0))
+		return errno;
+
+	return 0;
+}
@@ -0,0 +1,37 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+
+// NUMA placement from sysfs and plain system calls, so libnuma isn't needed.
+// On systems without NUMA everything is node 0.
+
+// Number of NUMA nodes, 1 if the system doesn't have NUMA
+int NumaNodeCount();
+// Node a block device (or the device holding a file) is attached to, -1 if unknown
+int NumaDeviceNode(const char *path);
+// Node of the CPU the calling thread currently runs on, -1 if unknown
+int NumaCurrentNode();
+
+// Restricts the calling thread to the CPUs of node. Threads started afterwards inherit this.
+int NumaBindThread(int node);
+// Places the pages of a range on node. Only affects pages that haven't been touched yet.
+int NumaBindMemory(void *mem, size_t size, int node);
@@ -0,0 +1,53 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+
+class Device;
+class ExtentList;
+
+// Common interface of the supported partitioning schemes.
+class PartitionMap
+{
+public:
+	typedef uint8_t PM_GUID[0x10];
+
+	struct Partition
+	{
+		uint64_t offset;
+		uint64_t size;
+		// Type of the partition. Only the field of the scheme in use is valid.
+		PM_GUID  type_guid;
+		uint8_t  mbr_type;
+	};
+
+	virtual ~PartitionMap() {}
+
+	virtual bool LoadAndVerify(Device &dev) = 0;
+	virtual void ListEntries() = 0;
+
+	// Number of partitions, not counting empty slots.
+	virtual int GetPartitionCount() const = 0;
+	virtual bool GetPartition(int partnum, Partition &part) const = 0;
+
+	// Appends the ranges occupied by the partition map itself.
+	virtual int GetExtents(Device &src, ExtentList &extents) = 0;
+};
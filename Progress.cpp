@@ -0,0 +1,94 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cinttypes>
+#include <cstdio>
+
+#include <chrono>
+
+#include <unistd.h>
+
+#include "Progress.h"
+
+static uint64_t NowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Progress::Progress()
+{
+	m_total = 0;
+	m_start_ns = 0;
+	m_last_print_ns = 0;
+	m_interval_ns = 0;
+	m_done = 0;
+	m_label = nullptr;
+	m_tty = false;
+}
+
+void Progress::Start(uint64_t total_bytes, unsigned int interval_ms)
+{
+	m_total = total_bytes;
+	m_start_ns = NowNs();
+	m_last_print_ns = m_start_ns;
+	m_interval_ns = static_cast<uint64_t>(interval_ms) * 1000000;
+	m_done = 0;
+	// On a terminal, the line is updated in place. In a log, every update gets its own line, so print less often.
+	m_tty = !m_label && isatty(fileno(stderr));
+	if (!m_tty)
+		m_interval_ns *= 10;
+}
+
+void Progress::Update(uint64_t done_bytes)
+{
+	uint64_t now = NowNs();
+
+	m_done = done_bytes;
+
+	if (now - m_last_print_ns < m_interval_ns)
+		return;
+
+	m_last_print_ns = now;
+	Print(done_bytes, false);
+}
+
+void Progress::Finish()
+{
+	Print(m_done, true);
+}
+
+double Progress::GetElapsed() const
+{
+	return (NowNs() - m_start_ns) / 1e9;
+}
+
+void Progress::Print(uint64_t done_bytes, bool final)
+{
+	double elapsed = GetElapsed();
+	double rate = elapsed > 0 ? done_bytes / elapsed : 0;
+	uint64_t eta = 0;
+
+	if (rate > 0 && m_total > done_bytes)
+		eta = static_cast<uint64_t>((m_total - done_bytes) / rate);
+
+	fprintf(stderr, "%s%s%s%" PRIu64 " / %" PRIu64 " MiB (%.1f%%), %.1f MB/s, ETA %" PRIu64 ":%02" PRIu64 ":%02" PRIu64 "%s",
+		m_tty ? "\r" : "", m_label ? m_label : "", m_label ? ": " : "", done_bytes >> 20, m_total >> 20, m_total ? 100.0 * done_bytes / m_total : 100.0,
+		rate / 1e6, eta / 3600, eta / 60 % 60, eta % 60, (m_tty && !final) ? "" : "\n");
+	fflush(stderr);
+}
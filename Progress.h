@@ -0,0 +1,50 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+
+// Prints the copy progress with throughput and estimated remaining time at regular intervals.
+class Progress
+{
+public:
+	Progress();
+
+	// Prefixes every line, for several copies running at once. Lines are then never updated in place.
+	void SetLabel(const char *label) { m_label = label; }
+
+	void Start(uint64_t total_bytes, unsigned int interval_ms);
+	// done_bytes counts from the start of this run
+	void Update(uint64_t done_bytes);
+	void Finish();
+
+	double GetElapsed() const;
+
+private:
+	void Print(uint64_t done_bytes, bool final);
+
+	uint64_t m_total;
+	uint64_t m_start_ns;
+	uint64_t m_last_print_ns;
+	uint64_t m_interval_ns;
+	uint64_t m_done;
+	const char *m_label;
+	bool m_tty;
+};
@@ -0,0 +1,592 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+
+#include "ExtentList.h"
+#include "Qcow2Image.h"
+
+#define dbg_printf(...) // printf(__VA_ARGS__)
+
+static constexpr uint32_t QCOW_MAGIC = 0x514649FB;
+static constexpr uint32_t QCOW_VERSION = 3;
+// 64 KiB, the qemu-img default
+static constexpr uint32_t CLUSTER_BITS = 16;
+// 16 bit refcounts
+static constexpr uint32_t REFCOUNT_ORDER = 4;
+
+static constexpr uint64_t QCOW_OFLAG_COPIED = 1ULL << 63;
+static constexpr uint64_t QCOW_OFLAG_COMPRESSED = 1ULL << 62;
+static constexpr uint64_t QCOW_OFLAG_ZERO = 1ULL << 0;
+static constexpr uint64_t QCOW_OFFSET_MASK = 0x00FFFFFFFFFFFE00ULL;
+
+static uint64_t DivUp(uint64_t a, uint64_t b)
+{
+	return (a + b - 1) / b;
+}
+
+Qcow2Image::Qcow2Image()
+{
+	m_size = 0;
+	m_fd = -1;
+	m_writable = false;
+	m_cluster_bits = CLUSTER_BITS;
+	m_cluster_size = 1ULL << CLUSTER_BITS;
+	m_l2_bits = CLUSTER_BITS - 3;
+	m_l1_offset = 0;
+	m_l1_size = 0;
+	m_rt_offset = 0;
+	m_rt_clusters = 0;
+	m_rb_offset = 0;
+	m_rb_count = 0;
+	m_data_start = 0;
+	m_file_end = 0;
+	m_flushed_end = 0;
+}
+
+Qcow2Image::~Qcow2Image()
+{
+	Close();
+}
+
+void Qcow2Image::SetupLayout(uint64_t size)
+{
+	const uint64_t refs_per_block = m_cluster_size * 8 >> REFCOUNT_ORDER;
+	uint64_t guest_clusters;
+	uint64_t l1_clusters;
+	uint64_t rt_clusters;
+	uint64_t total;
+	uint64_t rb_count = 1;
+
+	m_size = size;
+	guest_clusters = DivUp(size, m_cluster_size);
+	m_l1_size = static_cast<uint32_t>(DivUp(guest_clusters, 1ULL << m_l2_bits));
+	l1_clusters = DivUp(m_l1_size * sizeof(uint64_t), m_cluster_size);
+	if (l1_clusters == 0) l1_clusters = 1;
+
+	// Enough refcount blocks for a completely filled image. The unused ones stay holes in the file.
+	for (;;) {
+		rt_clusters = DivUp(rb_count * sizeof(uint64_t), m_cluster_size);
+		total = 1 + l1_clusters + rt_clusters + rb_count + m_l1_size + guest_clusters;
+		if (DivUp(total, refs_per_block) <= rb_count)
+			break;
+		rb_count = DivUp(total, refs_per_block);
+	}
+
+	m_l1_offset = m_cluster_size;
+	m_rt_offset = m_l1_offset + l1_clusters * m_cluster_size;
+	m_rt_clusters = static_cast<uint32_t>(rt_clusters);
+	m_rb_offset = m_rt_offset + rt_clusters * m_cluster_size;
+	m_rb_count = rb_count;
+	m_data_start = m_rb_offset + rb_count * m_cluster_size;
+}
+
+int Qcow2Image::Create(const char* name, uint64_t size)
+{
+	Header hdr;
+	int err;
+
+	Close();
+
+	m_fd = open(name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (m_fd < 0)
+		return errno;
+
+	m_writable = true;
+	m_cluster_bits = CLUSTER_BITS;
+	m_cluster_size = 1ULL << CLUSTER_BITS;
+	m_l2_bits = CLUSTER_BITS - 3;
+	SetupLayout(size);
+
+	m_l2.clear();
+	m_l2.resize(m_l1_size);
+	m_file_end = m_data_start;
+	m_flushed_end = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = htobe32(QCOW_MAGIC);
+	hdr.version = htobe32(QCOW_VERSION);
+	hdr.cluster_bits = htobe32(m_cluster_bits);
+	hdr.size = htobe64(size);
+	hdr.l1_size = htobe32(m_l1_size);
+	hdr.l1_table_offset = htobe64(m_l1_offset);
+	hdr.refcount_table_offset = htobe64(m_rt_offset);
+	hdr.refcount_table_clusters = htobe32(m_rt_clusters);
+	hdr.refcount_order = htobe32(REFCOUNT_ORDER);
+	hdr.header_length = htobe32(sizeof(hdr));
+
+	// The rest of the header cluster is zero, which ends the (empty) list of header extensions.
+	err = PWrite(&hdr, sizeof(hdr), 0);
+	if (!err)
+		err = Flush();
+	if (err)
+		Close();
+
+	return err;
+}
+
+int Qcow2Image::Open(const char* name, bool writable)
+{
+	Header hdr;
+	std::vector<uint64_t> l1;
+	off64_t file_size;
+	int err;
+
+	Close();
+
+	m_fd = open(name, writable ? O_RDWR : O_RDONLY);
+	if (m_fd < 0)
+		return errno;
+
+	err = PRead(&hdr, sizeof(hdr), 0);
+	if (err) goto error;
+
+	err = EINVAL;
+	if (be32toh(hdr.magic) != QCOW_MAGIC) goto error;
+	if (be32toh(hdr.version) != 2 && be32toh(hdr.version) != 3) goto error;
+	if (be32toh(hdr.cluster_bits) < 9 || be32toh(hdr.cluster_bits) > 21) goto error;
+
+	err = ENOTSUP;
+	if (hdr.backing_file_offset != 0 || hdr.crypt_method != 0) goto error;
+	if (be32toh(hdr.version) == 3 && hdr.incompatible_features != 0) goto error;
+
+	m_cluster_bits = be32toh(hdr.cluster_bits);
+	m_cluster_size = 1ULL << m_cluster_bits;
+	m_l2_bits = m_cluster_bits - 3;
+	SetupLayout(be64toh(hdr.size));
+
+	// Only images with the layout of Create can be extended, anything else is read-only.
+	if (writable) {
+		if (be32toh(hdr.version) != QCOW_VERSION || be32toh(hdr.refcount_order) != REFCOUNT_ORDER ||
+			be32toh(hdr.l1_size) != m_l1_size || be64toh(hdr.l1_table_offset) != m_l1_offset ||
+			be64toh(hdr.refcount_table_offset) != m_rt_offset || be32toh(hdr.refcount_table_clusters) != m_rt_clusters)
+			goto error;
+	}
+
+	m_l1_size = be32toh(hdr.l1_size);
+	m_l1_offset = be64toh(hdr.l1_table_offset);
+
+	err = EINVAL;
+	if (m_l1_size < DivUp(DivUp(m_size, m_cluster_size), 1ULL << m_l2_bits)) goto error;
+
+	l1.resize(m_l1_size);
+	err = PRead(l1.data(), m_l1_size * sizeof(uint64_t), m_l1_offset);
+	if (err) goto error;
+
+	m_l2.clear();
+	m_l2.resize(m_l1_size);
+	for (uint32_t k = 0; k < m_l1_size; k++) {
+		m_l2[k].offset = be64toh(l1[k]) & QCOW_OFFSET_MASK;
+		m_l2[k].dirty = false;
+	}
+
+	if (writable) {
+		// Clusters appended after the last flush aren't referenced by anything, they are reused.
+		err = FindFlushedEnd(m_file_end);
+		if (err) goto error;
+	} else {
+		file_size = lseek64(m_fd, 0, SEEK_END);
+		if (file_size < 0) {
+			err = errno;
+			goto error;
+		}
+		m_file_end = DivUp(file_size, m_cluster_size) * m_cluster_size;
+	}
+
+	if (m_file_end < m_data_start)
+		m_file_end = m_data_start;
+
+	// The unreferenced clusters still hold data of the interrupted run. Cutting them off makes
+	// them read as zeros again when they are handed out, as Write expects from a new cluster.
+	if (writable && ftruncate64(m_fd, m_file_end)) {
+		err = errno;
+		goto error;
+	}
+	m_flushed_end = m_file_end;
+	m_writable = writable;
+
+	return 0;
+
+error:
+	Close();
+	return err;
+}
+
+void Qcow2Image::Close()
+{
+	if (m_fd >= 0 && m_writable)
+		Flush();
+
+	if (m_fd >= 0)
+		close(m_fd);
+	m_fd = -1;
+	m_writable = false;
+	m_l2.clear();
+}
+
+int Qcow2Image::Flush()
+{
+	std::vector<uint64_t> buf(static_cast<size_t>(1) << m_l2_bits);
+	std::vector<uint64_t> l1(m_l1_size);
+	uint64_t old_end;
+	int err;
+
+	if (!m_writable)
+		return 0;
+
+	if (ftruncate64(m_fd, m_file_end))
+		return errno;
+
+	for (L2Table &t : m_l2) {
+		if (!t.dirty)
+			continue;
+		for (size_t k = 0; k < buf.size(); k++)
+			buf[k] = htobe64(t.entries[k]);
+		err = PWrite(buf.data(), m_cluster_size, t.offset);
+		if (err) return err;
+		t.dirty = false;
+	}
+
+	// Data and L2 tables must be on disk before anything refers to them.
+	if (fdatasync(m_fd))
+		return errno;
+
+	for (uint32_t k = 0; k < m_l1_size; k++)
+		l1[k] = m_l2[k].offset ? htobe64(m_l2[k].offset | QCOW_OFLAG_COPIED) : 0;
+	err = PWrite(l1.data(), m_l1_size * sizeof(uint64_t), m_l1_offset);
+	if (err) return err;
+
+	old_end = m_flushed_end;
+	m_flushed_end = m_file_end;
+	err = WriteRefcounts(old_end);
+	if (err) return err;
+
+	if (fdatasync(m_fd))
+		return errno;
+
+	return 0;
+}
+
+int Qcow2Image::WriteRefcounts(uint64_t old_end)
+{
+	const uint64_t refs_per_block = m_cluster_size * 8 >> REFCOUNT_ORDER;
+	const uint64_t old_clusters = old_end >> m_cluster_bits;
+	const uint64_t new_clusters = m_file_end >> m_cluster_bits;
+	const uint64_t old_used = DivUp(old_clusters, refs_per_block);
+	const uint64_t new_used = DivUp(new_clusters, refs_per_block);
+	const uint64_t rb_first = m_rb_offset >> m_cluster_bits;
+	std::vector<uint16_t> rb(refs_per_block);
+	std::vector<uint64_t> rt;
+	uint64_t first;
+	uint64_t last;
+	uint64_t c;
+	int err;
+
+	// Everything in front of the refcount blocks is in use, of those only the ones that cover the file,
+	// and everything from the start of the data area up to the end of the file.
+	auto in_use = [&](uint64_t cluster) {
+		if (cluster < rb_first)
+			return true;
+		if (cluster < (m_data_start >> m_cluster_bits))
+			return cluster - rb_first < new_used;
+		return cluster < new_clusters;
+	};
+
+	auto write_block = [&](uint64_t idx) {
+		for (uint64_t k = 0; k < refs_per_block; k++) {
+			c = idx * refs_per_block + k;
+			rb[k] = htobe16(in_use(c) ? 1 : 0);
+		}
+		return PWrite(rb.data(), m_cluster_size, m_rb_offset + idx * m_cluster_size);
+	};
+
+	if (new_clusters == old_clusters)
+		return 0;
+
+	// The blocks covering the new clusters, and the ones that hold the refcounts of newly used refcount blocks
+	first = old_clusters / refs_per_block;
+	last = (new_clusters - 1) / refs_per_block;
+	for (uint64_t idx = first; idx <= last; idx++) {
+		err = write_block(idx);
+		if (err) return err;
+	}
+	for (uint64_t idx = old_used; idx < new_used; idx++) {
+		uint64_t holder = (rb_first + idx) / refs_per_block;
+		if (holder >= first && holder <= last)
+			continue;
+		err = write_block(holder);
+		if (err) return err;
+	}
+
+	if (new_used != old_used) {
+		rt.resize(m_rt_clusters * m_cluster_size / sizeof(uint64_t), 0);
+		for (uint64_t idx = 0; idx < new_used; idx++)
+			rt[idx] = htobe64(m_rb_offset + idx * m_cluster_size);
+		err = PWrite(rt.data(), rt.size() * sizeof(uint64_t), m_rt_offset);
+		if (err) return err;
+	}
+
+	return 0;
+}
+
+int Qcow2Image::FindFlushedEnd(uint64_t& end)
+{
+	const uint64_t refs_per_block = m_cluster_size * 8 >> REFCOUNT_ORDER;
+	std::vector<uint64_t> rt(m_rt_clusters * m_cluster_size / sizeof(uint64_t));
+	std::vector<uint16_t> rb(refs_per_block);
+	size_t idx;
+	size_t k;
+	int err;
+
+	end = 0;
+
+	err = PRead(rt.data(), rt.size() * sizeof(uint64_t), m_rt_offset);
+	if (err) return err;
+
+	for (idx = rt.size(); idx > 0 && rt[idx - 1] == 0; idx--)
+		;
+	if (idx == 0)
+		return 0;
+	idx--;
+
+	err = PRead(rb.data(), m_cluster_size, be64toh(rt[idx]) & QCOW_OFFSET_MASK);
+	if (err) return err;
+
+	for (k = rb.size(); k > 0 && rb[k - 1] == 0; k--)
+		;
+
+	end = (idx * refs_per_block + k) << m_cluster_bits;
+	return 0;
+}
+
+int Qcow2Image::GetL2(uint32_t l1_idx, bool alloc, L2Table *&table)
+{
+	L2Table &t = m_l2[l1_idx];
+	int err;
+
+	table = nullptr;
+
+	if (!t.entries) {
+		if (t.offset == 0 && !alloc)
+			return 0;
+
+		t.entries.reset(new uint64_t[static_cast<size_t>(1) << m_l2_bits]);
+
+		if (t.offset == 0) {
+			memset(t.entries.get(), 0, m_cluster_size);
+			t.offset = AllocCluster();
+			t.dirty = true;
+		} else {
+			err = PRead(t.entries.get(), m_cluster_size, t.offset);
+			if (err) {
+				t.entries.reset();
+				return err;
+			}
+			for (size_t k = 0; k < (static_cast<size_t>(1) << m_l2_bits); k++)
+				t.entries[k] = be64toh(t.entries[k]);
+			t.dirty = false;
+		}
+	}
+
+	table = &t;
+	return 0;
+}
+
+uint64_t Qcow2Image::AllocCluster()
+{
+	uint64_t offset = m_file_end;
+
+	m_file_end += m_cluster_size;
+	return offset;
+}
+
+int Qcow2Image::GetAllocatedExtents(ExtentList& extents)
+{
+	const uint64_t l2_entries = 1ULL << m_l2_bits;
+	L2Table *t;
+	uint64_t offset;
+	uint64_t size;
+	int err;
+
+	for (uint32_t l1_idx = 0; l1_idx < m_l1_size; l1_idx++) {
+		err = GetL2(l1_idx, false, t);
+		if (err) return err;
+		if (!t) continue;
+
+		for (uint64_t k = 0; k < l2_entries; k++) {
+			if ((t->entries[k] & QCOW_OFFSET_MASK) == 0 || (t->entries[k] & QCOW_OFLAG_ZERO))
+				continue;
+			offset = (l1_idx * l2_entries + k) << m_cluster_bits;
+			if (offset >= m_size)
+				break;
+			size = m_cluster_size;
+			if (offset + size > m_size)
+				size = m_size - offset;
+			extents.Add(offset, size);
+		}
+	}
+
+	return 0;
+}
+
+int Qcow2Image::Read(void* data, size_t size, uint64_t offset)
+{
+	uint8_t *out_data = reinterpret_cast<uint8_t *>(data);
+	L2Table *t;
+	uint64_t cluster;
+	uint64_t in_cluster;
+	uint64_t entry;
+	uint64_t host;
+	size_t run;
+	int err;
+
+	if ((offset + size) > m_size)
+		return EINVAL;
+
+	while (size > 0) {
+		cluster = offset >> m_cluster_bits;
+		in_cluster = offset & (m_cluster_size - 1);
+		run = m_cluster_size - in_cluster;
+		if (run > size) run = size;
+
+		err = GetL2(cluster >> m_l2_bits, false, t);
+		if (err) return err;
+		entry = t ? t->entries[cluster & ((1ULL << m_l2_bits) - 1)] : 0;
+		if (entry & QCOW_OFLAG_COMPRESSED)
+			return ENOTSUP;
+		host = entry & QCOW_OFFSET_MASK;
+
+		if (host == 0 || (entry & QCOW_OFLAG_ZERO)) {
+			memset(out_data, 0, run);
+		} else {
+			// Clusters that follow each other in the file are read in one go.
+			while (run < size && ((cluster + 1) & ((1ULL << m_l2_bits) - 1)) != 0) {
+				uint64_t next = t->entries[(cluster + 1) & ((1ULL << m_l2_bits) - 1)];
+				if ((next & (QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO)) || (next & QCOW_OFFSET_MASK) != host + run + in_cluster)
+					break;
+				cluster++;
+				run += (size - run > m_cluster_size) ? m_cluster_size : size - run;
+			}
+			err = PRead(out_data, run, host + in_cluster);
+			if (err) return err;
+		}
+
+		size -= run;
+		offset += run;
+		out_data += run;
+	}
+
+	return 0;
+}
+
+int Qcow2Image::Write(const void* data, size_t size, uint64_t offset)
+{
+	const uint8_t *in_data = reinterpret_cast<const uint8_t *>(data);
+	L2Table *t;
+	uint64_t cluster;
+	uint64_t in_cluster;
+	uint64_t host = 0;
+	uint64_t run_host = 0;
+	size_t run = 0;
+	size_t n;
+	int err;
+
+	if (!m_writable)
+		return EBADF;
+	if ((offset + size) > m_size)
+		return EINVAL;
+
+	// Pieces that land next to each other in the file are collected and written with one call.
+	while (size > 0) {
+		cluster = offset >> m_cluster_bits;
+		in_cluster = offset & (m_cluster_size - 1);
+		n = m_cluster_size - in_cluster;
+		if (n > size) n = size;
+
+		err = GetL2(cluster >> m_l2_bits, true, t);
+		if (err) return err;
+
+		uint64_t &entry = t->entries[cluster & ((1ULL << m_l2_bits) - 1)];
+		if (entry & QCOW_OFLAG_COMPRESSED)
+			return ENOTSUP;
+		if ((entry & QCOW_OFFSET_MASK) == 0 || (entry & QCOW_OFLAG_ZERO)) {
+			// A new cluster reads as zero outside of what is written now, as it lies beyond the old end of the file.
+			entry = AllocCluster() | QCOW_OFLAG_COPIED;
+			t->dirty = true;
+		}
+		host = (entry & QCOW_OFFSET_MASK) + in_cluster;
+
+		if (run > 0 && run_host + run != host) {
+			err = PWrite(in_data - run, run, run_host);
+			if (err) return err;
+			run = 0;
+		}
+		if (run == 0)
+			run_host = host;
+		run += n;
+
+		size -= n;
+		offset += n;
+		in_data += n;
+	}
+
+	if (run > 0)
+		return PWrite(in_data - run, run, run_host);
+
+	return 0;
+}
+
+int Qcow2Image::PWrite(const void* data, size_t size, uint64_t offset)
+{
+	const uint8_t *in_data = reinterpret_cast<const uint8_t *>(data);
+	ssize_t nwritten;
+
+	while (size > 0) {
+		nwritten = pwrite64(m_fd, in_data, size, offset);
+		if (nwritten < 0) return errno;
+		if (nwritten == 0) return EIO;
+		size -= nwritten;
+		offset += nwritten;
+		in_data += nwritten;
+	}
+
+	return 0;
+}
+
+int Qcow2Image::PRead(void* data, size_t size, uint64_t offset)
+{
+	uint8_t *out_data = reinterpret_cast<uint8_t *>(data);
+	ssize_t nread;
+
+	while (size > 0) {
+		nread = pread64(m_fd, out_data, size, offset);
+		if (nread < 0) return errno;
+		if (nread == 0) return EIO;
+		size -= nread;
+		offset += nread;
+		out_data += nread;
+	}
+
+	return 0;
+}
@@ -0,0 +1,111 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <memory>
+#include <vector>
+
+#include "ImageFile.h"
+
+// QEMU copy-on-write image, version 3, without backing files, compression or snapshots.
+// Data clusters are appended to the file in the order they are first written. The L2 tables
+// are kept in memory and written together with L1 and the refcounts on Flush and Close.
+class Qcow2Image : public ImageFile
+{
+	struct Header {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t backing_file_offset;
+		uint32_t backing_file_size;
+		uint32_t cluster_bits;
+		uint64_t size;
+		uint32_t crypt_method;
+		uint32_t l1_size;
+		uint64_t l1_table_offset;
+		uint64_t refcount_table_offset;
+		uint32_t refcount_table_clusters;
+		uint32_t nb_snapshots;
+		uint64_t snapshots_offset;
+		uint64_t incompatible_features;
+		uint64_t compatible_features;
+		uint64_t autoclear_features;
+		uint32_t refcount_order;
+		uint32_t header_length;
+	} __attribute__((packed));
+
+	struct L2Table {
+		std::unique_ptr<uint64_t[]> entries;
+		uint64_t offset;
+		bool dirty;
+	};
+
+public:
+	Qcow2Image();
+	~Qcow2Image();
+
+	int Create(const char *name, uint64_t size) override;
+	int Open(const char *name, bool writable) override;
+	void Close() override;
+	int Flush() override;
+	int GetAllocatedExtents(ExtentList &extents) override;
+	uint64_t GetAllocationUnit() const override { return m_cluster_size; }
+
+	int Read(void *data, size_t size, uint64_t offset) override;
+	int Write(const void *data, size_t size, uint64_t offset) override;
+
+	uint64_t GetSize() const override { return m_size; }
+
+private:
+	void SetupLayout(uint64_t size);
+	// Loads the L2 table, or with alloc set creates it if it doesn't exist yet. table is nullptr for a missing table.
+	int GetL2(uint32_t l1_idx, bool alloc, L2Table *&table);
+	uint64_t AllocCluster();
+	// End of the clusters in use according to the refcounts, which are up to date as of the last flush
+	int FindFlushedEnd(uint64_t &end);
+	int WriteRefcounts(uint64_t old_end);
+	int PWrite(const void *data, size_t size, uint64_t offset);
+	int PRead(void *data, size_t size, uint64_t offset);
+
+	uint64_t m_size;
+	int m_fd;
+	bool m_writable;
+
+	uint32_t m_cluster_bits;
+	uint64_t m_cluster_size;
+	uint32_t m_l2_bits;
+
+	// Fixed layout: header, L1 table, refcount table, room for all refcount blocks, then L2 tables and data.
+	uint64_t m_l1_offset;
+	uint32_t m_l1_size;
+	uint64_t m_rt_offset;
+	uint32_t m_rt_clusters;
+	uint64_t m_rb_offset;
+	uint64_t m_rb_count;
+	uint64_t m_data_start;
+
+	std::vector<L2Table> m_l2;
+	// End of the file, new clusters are appended here
+	uint64_t m_file_end;
+	// m_file_end as of the last flush, clusters below are covered by the written refcounts
+	uint64_t m_flushed_end;
+};
@@ -0,0 +1,130 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "RamDevice.h"
+
+static constexpr size_t RAM_PAGE_SHIFT = 20;
+static constexpr size_t RAM_PAGE_SIZE = 1 << RAM_PAGE_SHIFT;
+
+RamDevice::RamDevice(uint64_t size) : m_size(size)
+{
+	m_pages.resize((size + RAM_PAGE_SIZE - 1) >> RAM_PAGE_SHIFT);
+}
+
+RamDevice::~RamDevice()
+{
+}
+
+int RamDevice::Read(void* data, size_t size, uint64_t offset)
+{
+	uint8_t *out = reinterpret_cast<uint8_t *>(data);
+	size_t in_page;
+	size_t chunk;
+
+	if (offset + size > m_size)
+		return EINVAL;
+
+	while (size > 0) {
+		in_page = offset & (RAM_PAGE_SIZE - 1);
+		chunk = RAM_PAGE_SIZE - in_page;
+		if (chunk > size) chunk = size;
+
+		const std::unique_ptr<uint8_t[]> &page = m_pages[offset >> RAM_PAGE_SHIFT];
+		if (page)
+			memcpy(out, page.get() + in_page, chunk);
+		else
+			memset(out, 0, chunk);
+
+		out += chunk;
+		offset += chunk;
+		size -= chunk;
+	}
+
+	return 0;
+}
+
+int RamDevice::Write(const void* data, size_t size, uint64_t offset)
+{
+	const uint8_t *in = reinterpret_cast<const uint8_t *>(data);
+	size_t in_page;
+	size_t chunk;
+
+	if (offset + size > m_size)
+		return EINVAL;
+
+	while (size > 0) {
+		in_page = offset & (RAM_PAGE_SIZE - 1);
+		chunk = RAM_PAGE_SIZE - in_page;
+		if (chunk > size) chunk = size;
+
+		std::unique_ptr<uint8_t[]> &page = m_pages[offset >> RAM_PAGE_SHIFT];
+		if (!page)
+			page.reset(new uint8_t[RAM_PAGE_SIZE]());
+		memcpy(page.get() + in_page, in, chunk);
+
+		in += chunk;
+		offset += chunk;
+		size -= chunk;
+	}
+
+	return 0;
+}
+
+uint64_t RamDevice::GetAllocatedSize() const
+{
+	uint64_t total = 0;
+
+	for (const std::unique_ptr<uint8_t[]> &page : m_pages)
+		if (page) total += RAM_PAGE_SIZE;
+
+	return total;
+}
+
+int RamDevice::Save(const char* name) const
+{
+	int fd;
+	size_t n;
+	size_t size;
+	int err = 0;
+
+	fd = open(name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0)
+		return errno;
+
+	for (n = 0; n < m_pages.size() && !err; n++) {
+		if (!m_pages[n])
+			continue;
+		size = (static_cast<uint64_t>(n + 1) << RAM_PAGE_SHIFT) > m_size ? m_size - (static_cast<uint64_t>(n) << RAM_PAGE_SHIFT) : RAM_PAGE_SIZE;
+		if (pwrite64(fd, m_pages[n].get(), size, static_cast<uint64_t>(n) << RAM_PAGE_SHIFT) != static_cast<ssize_t>(size))
+			err = errno ? errno : EIO;
+	}
+
+	if (!err && ftruncate64(fd, m_size))
+		err = errno;
+
+	close(fd);
+
+	return err;
+}
@@ -0,0 +1,48 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <memory>
+#include <vector>
+
+#include "Device.h"
+
+// Device in memory. Pages are allocated on first write, so large devices only cost what is written.
+class RamDevice : public Device
+{
+public:
+	RamDevice(uint64_t size);
+	~RamDevice();
+
+	int Read(void *data, size_t size, uint64_t offset) override;
+	int Write(const void *data, size_t size, uint64_t offset) override;
+	uint64_t GetSize() const override { return m_size; }
+
+	uint64_t GetAllocatedSize() const;
+	// Writes the contents to a (sparse) file.
+	int Save(const char *name) const;
+
+private:
+	uint64_t m_size;
+	std::vector<std::unique_ptr<uint8_t[]>> m_pages;
+};
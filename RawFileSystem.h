@@ -0,0 +1,32 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "FileSystem.h"
+
+// Fallback for partitions without a supported file system: the whole partition is copied.
+class RawFileSystem : public FileSystem
+{
+public:
+	RawFileSystem(Device &src, uint64_t offset, uint64_t size);
+	~RawFileSystem();
+
+	int GetExtents(ExtentList &extents) override;
+};
@@ -0,0 +1,212 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "Bitmap.h"
+#include "ExtentList.h"
+#include "RawImage.h"
+
+// Granularity of the zero check. Zero blocks of this size are not written, so they stay holes.
+static constexpr size_t ZERO_BLOCK_SIZE = 0x1000;
+
+RawImage::RawImage()
+{
+	m_size = 0;
+	m_fd = -1;
+	m_skip_zero = false;
+}
+
+RawImage::~RawImage()
+{
+	Close();
+}
+
+int RawImage::Create(const char* name, uint64_t size)
+{
+	Close();
+
+	m_fd = open(name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (m_fd < 0)
+		return errno;
+
+	// The whole file is a hole to begin with.
+	if (ftruncate64(m_fd, size)) {
+		int err = errno;
+		Close();
+		return err;
+	}
+
+	m_size = size;
+	m_skip_zero = true;
+
+	return 0;
+}
+
+int RawImage::Open(const char* name, bool writable)
+{
+	off64_t size;
+
+	Close();
+
+	m_fd = open(name, writable ? O_RDWR : O_RDONLY);
+	if (m_fd < 0)
+		return errno;
+
+	size = lseek64(m_fd, 0, SEEK_END);
+	if (size < 0) {
+		int err = errno;
+		Close();
+		return err;
+	}
+
+	m_size = size;
+	m_skip_zero = false;
+
+	return 0;
+}
+
+void RawImage::Close()
+{
+	if (m_fd >= 0)
+		close(m_fd);
+	m_fd = -1;
+}
+
+int RawImage::Flush()
+{
+	if (fdatasync(m_fd))
+		return errno;
+
+	return 0;
+}
+
+int RawImage::GetAllocatedExtents(ExtentList& extents)
+{
+	off64_t data_start;
+	off64_t hole_start = 0;
+
+	for (;;) {
+		data_start = lseek64(m_fd, hole_start, SEEK_DATA);
+		if (data_start < 0)
+			return errno == ENXIO ? 0 : errno;
+		hole_start = lseek64(m_fd, data_start, SEEK_HOLE);
+		if (hole_start < 0)
+			return errno;
+		extents.Add(data_start, hole_start - data_start);
+		if (static_cast<uint64_t>(hole_start) >= m_size)
+			return 0;
+	}
+}
+
+uint64_t RawImage::GetAllocationUnit() const
+{
+	return ZERO_BLOCK_SIZE;
+}
+
+int RawImage::Read(void* data, size_t size, uint64_t offset)
+{
+	uint8_t *out_data = reinterpret_cast<uint8_t *>(data);
+	ssize_t nread;
+
+	if ((offset + size) > m_size)
+		return EINVAL;
+
+	while (size > 0) {
+		nread = pread64(m_fd, out_data, size, offset);
+		if (nread < 0) return errno;
+		if (nread == 0) return EIO;
+
+		size -= nread;
+		offset += nread;
+		out_data += nread;
+	}
+
+	return 0;
+}
+
+int RawImage::Write(const void* data, size_t size, uint64_t offset)
+{
+	const uint8_t *in_data = reinterpret_cast<const uint8_t *>(data);
+	size_t run;
+	size_t blk;
+	ssize_t nwritten;
+
+	if ((offset + size) > m_size)
+		return EINVAL;
+
+	while (size > 0) {
+		// Split off the next run of non-zero blocks, zero blocks are skipped over.
+		run = 0;
+		if (m_skip_zero) {
+			while (size > 0) {
+				blk = size < ZERO_BLOCK_SIZE ? size : ZERO_BLOCK_SIZE;
+				if (!BufferIsZero(in_data, blk))
+					break;
+				in_data += blk;
+				offset += blk;
+				size -= blk;
+			}
+			while (run < size) {
+				blk = size - run < ZERO_BLOCK_SIZE ? size - run : ZERO_BLOCK_SIZE;
+				if (BufferIsZero(in_data + run, blk))
+					break;
+				run += blk;
+			}
+		} else {
+			run = size;
+		}
+
+		while (run > 0) {
+			nwritten = pwrite64(m_fd, in_data, run, offset);
+			if (nwritten < 0) return errno;
+			if (nwritten == 0) return EIO;
+
+			run -= nwritten;
+			size -= nwritten;
+			offset += nwritten;
+			in_data += nwritten;
+		}
+	}
+
+	return 0;
+}
+
+int RawImage::CopyFrom(int src_fd, uint64_t offset, uint64_t size)
+{
+	off64_t in_offset = offset;
+	off64_t out_offset = offset;
+	ssize_t ncopied;
+
+	if ((offset + size) > m_size)
+		return EINVAL;
+
+	while (size > 0) {
+		ncopied = copy_file_range(src_fd, &in_offset, m_fd, &out_offset, size, 0);
+		if (ncopied < 0) return errno;
+		if (ncopied == 0) return EIO;
+
+		size -= ncopied;
+	}
+
+	return 0;
+}
@@ -0,0 +1,52 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "ImageFile.h"
+
+// Plain disk image. Only the copied ranges are written, everything else stays a hole in the file.
+class RawImage : public ImageFile
+{
+public:
+	RawImage();
+	~RawImage();
+
+	int Create(const char *name, uint64_t size) override;
+	int Open(const char *name, bool writable) override;
+	void Close() override;
+	int Flush() override;
+	int GetAllocatedExtents(ExtentList &extents) override;
+	uint64_t GetAllocationUnit() const override;
+
+	int Read(void *data, size_t size, uint64_t offset) override;
+	int Write(const void *data, size_t size, uint64_t offset) override;
+	int CopyFrom(int src_fd, uint64_t offset, uint64_t size) override;
+
+	uint64_t GetSize() const override { return m_size; }
+
+private:
+	uint64_t m_size;
+	int m_fd;
+	// Set for a new image, where skipping a block of zeros leaves the same content
+	bool m_skip_zero;
+};
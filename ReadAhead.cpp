@@ -0,0 +1,144 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "BufferPool.h"
+#include "Device.h"
+#include "ReadAhead.h"
+
+ReadAhead::ReadAhead(std::initializer_list<Device *> devs, size_t depth) : m_devs(devs)
+{
+	BufferPool &pool = BufferPool::Instance();
+	size_t d;
+
+	m_chunks = nullptr;
+	m_abort = false;
+
+	// With a tight memory budget, the readers run less far ahead.
+	m_slots.resize(depth);
+	for (m_depth = 0; m_depth < depth; m_depth++) {
+		Slot &slot = m_slots[m_depth];
+
+		for (d = 0; d < m_devs.size(); d++) {
+			slot.buf[d] = pool.Acquire();
+			if (!slot.buf[d])
+				break;
+		}
+		if (d < m_devs.size()) {
+			while (d > 0)
+				pool.Release(slot.buf[--d]);
+			break;
+		}
+	}
+	m_slots.resize(m_depth);
+}
+
+ReadAhead::~ReadAhead()
+{
+	Stop();
+
+	for (Slot &slot : m_slots) {
+		for (size_t d = 0; d < m_devs.size(); d++)
+			BufferPool::Instance().Release(slot.buf[d]);
+	}
+}
+
+void ReadAhead::Start(const std::vector<Extent>& chunks)
+{
+	m_chunks = &chunks;
+	m_abort = false;
+
+	for (size_t k = 0; k < m_depth; k++) {
+		m_slots[k].chunk = k;
+		for (size_t d = 0; d < m_devs.size(); d++)
+			m_slots[k].done[d] = false;
+	}
+
+	for (size_t d = 0; d < m_devs.size(); d++)
+		m_threads.emplace_back(&ReadAhead::ReadThread, this, d);
+}
+
+const ReadAhead::Slot& ReadAhead::Wait(size_t idx)
+{
+	Slot &slot = m_slots[idx % m_depth];
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	m_cond.wait(lock, [&] {
+		for (size_t d = 0; d < m_devs.size(); d++) {
+			if (!slot.done[d])
+				return false;
+		}
+		return true;
+	});
+
+	return slot;
+}
+
+void ReadAhead::Release(size_t idx)
+{
+	Slot &slot = m_slots[idx % m_depth];
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		slot.chunk = idx + m_depth;
+		for (size_t d = 0; d < m_devs.size(); d++)
+			slot.done[d] = false;
+	}
+	m_cond.notify_all();
+}
+
+void ReadAhead::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_abort = true;
+	}
+	m_cond.notify_all();
+
+	for (std::thread &t : m_threads)
+		t.join();
+	m_threads.clear();
+	m_chunks = nullptr;
+}
+
+void ReadAhead::ReadThread(size_t dev)
+{
+	Device &device = *m_devs[dev];
+	size_t idx;
+	int err;
+
+	for (idx = 0; idx < m_chunks->size(); idx++) {
+		Slot &slot = m_slots[idx % m_depth];
+		const Extent &chunk = (*m_chunks)[idx];
+
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [&] { return m_abort || (slot.chunk == idx && !slot.done[dev]); });
+			if (m_abort) return;
+		}
+
+		err = device.Read(slot.buf[dev], chunk.size, chunk.offset);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			slot.err[dev] = err;
+			slot.done[dev] = true;
+		}
+		m_cond.notify_all();
+	}
+}
@@ -0,0 +1,79 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <condition_variable>
+#include <initializer_list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ExtentList.h"
+
+class Device;
+
+// Reads a list of chunks ahead of the consumer, with one thread per device. Every chunk is read
+// from each device into a pool buffer of its own, and the consumer takes the chunks in order.
+class ReadAhead
+{
+public:
+	static constexpr size_t MAX_DEVICES = 2;
+
+	struct Slot
+	{
+		uint8_t *buf[MAX_DEVICES];
+		int err[MAX_DEVICES];
+		bool done[MAX_DEVICES];
+		// Index of the chunk this slot holds
+		size_t chunk;
+	};
+
+	// Takes buffers for up to depth chunks, fewer if the memory budget doesn't allow more.
+	ReadAhead(std::initializer_list<Device *> devs, size_t depth);
+	~ReadAhead();
+
+	// Chunks that can be in flight, 0 if the pool had no buffers
+	size_t GetDepth() const { return m_depth; }
+
+	// Starts the readers. chunks must not change until Stop returns.
+	void Start(const std::vector<Extent> &chunks);
+	// Waits until all devices have read chunk idx.
+	const Slot &Wait(size_t idx);
+	// Hands the buffers of chunk idx back to the readers, for chunk idx + depth.
+	void Release(size_t idx);
+	// Stops the readers, also if not all chunks have been taken.
+	void Stop();
+
+private:
+	void ReadThread(size_t dev);
+
+	std::vector<Device *> m_devs;
+	std::vector<Slot> m_slots;
+	size_t m_depth;
+
+	const std::vector<Extent> *m_chunks;
+	std::vector<std::thread> m_threads;
+	bool m_abort;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+};
@@ -0,0 +1,144 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+
+#include <algorithm>
+#include <string>
+
+#include "RescueMap.h"
+
+void RescueMap::AddBad(uint64_t offset, uint64_t size)
+{
+	m_bad.Add(offset, size);
+}
+
+int RescueMap::Load(const char* name)
+{
+	FILE *f;
+	char line[256];
+	uint64_t pos;
+	uint64_t size;
+	char status;
+	bool status_line = true;
+
+	f = fopen(name, "r");
+	if (!f)
+		return errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		// The first non-comment line holds the current position, not a range.
+		if (status_line) {
+			status_line = false;
+			continue;
+		}
+		if (sscanf(line, "%" SCNi64 " %" SCNi64 " %c", &pos, &size, &status) == 3 && status == '-')
+			m_bad.Add(pos, size);
+	}
+
+	fclose(f);
+
+	m_bad.Sort();
+
+	return 0;
+}
+
+int RescueMap::Save(const char* name, const ExtentList& plan, uint64_t dev_size, uint64_t done_offset)
+{
+	const std::string tmp_name = std::string(name) + ".tmp";
+	const bool finished = plan.Count() == 0 || done_offset >= plan[plan.Count() - 1].offset + plan[plan.Count() - 1].size;
+	ExtentList bad = m_bad;
+	FILE *f;
+	uint64_t pos = 0;
+	uint64_t start;
+	uint64_t end;
+	size_t b = 0;
+	int err = 0;
+
+	uint64_t run_offset = 0;
+	uint64_t run_size = 0;
+	char run_status = 0;
+
+	// Neighbouring ranges of the same status are written as one line.
+	auto put = [&](uint64_t offset, uint64_t size, char status) {
+		if (size == 0)
+			return;
+		if (status == run_status && offset == run_offset + run_size) {
+			run_size += size;
+			return;
+		}
+		if (run_size > 0)
+			fprintf(f, "0x%08" PRIX64 "  0x%08" PRIX64 "  %c\n", run_offset, run_size, run_status);
+		run_offset = offset;
+		run_size = size;
+		run_status = status;
+	};
+	// Planned data is finished below done_offset and not tried above it.
+	auto put_planned = [&](uint64_t offset, uint64_t end_offset) {
+		uint64_t split = std::min(std::max(done_offset, offset), end_offset);
+
+		put(offset, split - offset, '+');
+		put(split, end_offset - split, '?');
+	};
+
+	bad.Sort();
+
+	f = fopen(tmp_name.c_str(), "w");
+	if (!f)
+		return errno;
+
+	fprintf(f, "# Mapfile. Created by fsdump\n");
+	fprintf(f, "# current_pos  current_status  current_pass\n");
+	fprintf(f, "0x%08" PRIX64 "     %c               1\n", finished ? static_cast<uint64_t>(0) : done_offset, finished ? '+' : '?');
+	fprintf(f, "#      pos        size  status\n");
+
+	for (const Extent &ext : plan) {
+		put(pos, ext.offset - pos, '?');
+		pos = ext.offset;
+
+		for (; b < bad.Count() && bad[b].offset < ext.offset + ext.size; b++) {
+			if (bad[b].offset + bad[b].size <= pos)
+				continue;
+			start = std::max(bad[b].offset, pos);
+			end = std::min(bad[b].offset + bad[b].size, ext.offset + ext.size);
+			put_planned(pos, start);
+			put(start, end - start, '-');
+			pos = end;
+		}
+
+		put_planned(pos, ext.offset + ext.size);
+		pos = ext.offset + ext.size;
+	}
+	put(pos, dev_size - pos, '?');
+	if (run_size > 0)
+		fprintf(f, "0x%08" PRIX64 "  0x%08" PRIX64 "  %c\n", run_offset, run_size, run_status);
+
+	if (ferror(f))
+		err = EIO;
+	if (fclose(f) && !err)
+		err = errno;
+	if (!err && rename(tmp_name.c_str(), name))
+		err = errno;
+
+	return err;
+}
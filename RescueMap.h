@@ -0,0 +1,40 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+
+#include "ExtentList.h"
+
+// Unreadable ranges of the source, saved in the mapfile format of GNU ddrescue.
+class RescueMap
+{
+public:
+	void AddBad(uint64_t offset, uint64_t size);
+	const ExtentList &GetBad() const { return m_bad; }
+
+	// Reads the bad ranges of an existing mapfile, for resuming.
+	int Load(const char *name);
+	// Ranges in plan below done_offset are written as finished or bad, everything else as not tried.
+	int Save(const char *name, const ExtentList &plan, uint64_t dev_size, uint64_t done_offset);
+
+private:
+	ExtentList m_bad;
+};
@@ -0,0 +1,171 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <thread>
+#include <vector>
+
+#include "BufferPool.h"
+#include "Device.h"
+#include "ExtentList.h"
+#include "Progress.h"
+#include "RestoreEngine.h"
+
+#define dbg_printf(...) // printf(__VA_ARGS__)
+
+// Pool buffers are aligned for O_DIRECT.
+static constexpr size_t BUF_SIZE = BufferPool::BUFFER_SIZE;
+
+RestoreEngine::RestoreEngine(Device &src, Device &dst) : m_src(src), m_dst(dst)
+{
+	m_threads = 1;
+	m_request_size = BUF_SIZE;
+	m_progress = nullptr;
+	m_extents = nullptr;
+	m_next_extent = 0;
+	m_next_offset = 0;
+	m_done = 0;
+	m_err = 0;
+	m_starved = 0;
+}
+
+RestoreEngine::~RestoreEngine()
+{
+}
+
+void RestoreEngine::SetRequestSize(size_t size)
+{
+	m_request_size = (size > 0 && size < BUF_SIZE) ? size : BUF_SIZE;
+}
+
+int RestoreEngine::Restore(const ExtentList& extents)
+{
+	std::vector<std::thread> threads;
+	ExtentList holes;
+	uint64_t pos = 0;
+	int err = 0;
+
+	// Only the unused parts of the image, a larger device keeps whatever is behind it.
+	for (const Extent &ext : extents) {
+		if (ext.offset > pos)
+			holes.Add(pos, ext.offset - pos);
+		pos = ext.offset + ext.size;
+	}
+	if (pos < m_src.GetSize())
+		holes.Add(pos, m_src.GetSize() - pos);
+
+	if (m_discard) {
+		for (const Extent &hole : holes) {
+			err = m_discard(hole.offset, hole.size);
+			if (err) break;
+		}
+		if (err)
+			fprintf(stderr, "Discarding unused ranges failed: %s\n", strerror(err));
+	}
+
+	// Raw images leave blocks of zeros out, so the holes can be data as well.
+	if (m_zero) {
+		for (const Extent &hole : holes) {
+			err = m_zero(hole.offset, hole.size);
+			if (err) {
+				fprintf(stderr, "Zeroing unused ranges failed: %s\n", strerror(err));
+				return err;
+			}
+		}
+	}
+
+	m_extents = &extents;
+	m_next_extent = 0;
+	m_next_offset = extents.Count() > 0 ? extents[0].offset : 0;
+	m_done = 0;
+	m_err = 0;
+	m_starved = 0;
+
+	for (unsigned int k = 0; k < m_threads; k++)
+		threads.emplace_back(&RestoreEngine::WriteThread, this);
+	for (std::thread &t : threads)
+		t.join();
+
+	m_extents = nullptr;
+	return m_err;
+}
+
+void RestoreEngine::WriteThread()
+{
+	uint8_t *buf;
+	uint64_t offset;
+	uint64_t size;
+	int err;
+
+	// Without a buffer, this thread leaves the work to the others. It only fails if none got one.
+	buf = BufferPool::Instance().Acquire();
+	if (!buf) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (++m_starved == m_threads && !m_err) m_err = ENOMEM;
+		return;
+	}
+
+	for (;;) {
+		// Take the next piece of at most m_request_size from the current extent.
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_err || m_next_extent >= m_extents->Count())
+				break;
+
+			const Extent &ext = (*m_extents)[m_next_extent];
+			offset = m_next_offset;
+			size = ext.offset + ext.size - offset;
+			if (size > m_request_size) size = m_request_size;
+
+			m_next_offset += size;
+			if (m_next_offset >= ext.offset + ext.size) {
+				m_next_extent++;
+				if (m_next_extent < m_extents->Count())
+					m_next_offset = (*m_extents)[m_next_extent].offset;
+			}
+		}
+
+		dbg_printf("Restore %" PRIX64 " L %" PRIX64 "\n", offset, size);
+
+		{
+			std::lock_guard<std::mutex> lock(m_read_mutex);
+			err = m_src.Read(buf, size, offset);
+		}
+		if (!err)
+			err = m_dst.Write(buf, size, offset);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (err) {
+				fprintf(stderr, "Error %d restoring %" PRIX64 "\n", err, offset);
+				if (!m_err) m_err = err;
+				break;
+			}
+			m_done += size;
+			if (m_progress)
+				m_progress->Update(m_done);
+		}
+	}
+
+	BufferPool::Instance().Release(buf);
+}
@@ -0,0 +1,76 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <functional>
+#include <mutex>
+
+class Device;
+class ExtentList;
+class Progress;
+
+// Writes the allocated ranges of an image back to a device. Several threads write in parallel,
+// so devices that need deep queues for full speed get them.
+class RestoreEngine
+{
+public:
+	typedef std::function<int(uint64_t offset, uint64_t size)> RangeFunc;
+
+	RestoreEngine(Device &src, Device &dst);
+	~RestoreEngine();
+
+	void SetThreads(unsigned int threads) { m_threads = threads ? threads : 1; }
+	// Largest write, at most the size of a pool buffer
+	void SetRequestSize(size_t size);
+	void SetProgress(Progress *progress) { m_progress = progress; }
+	// Called for the ranges between the allocated extents, failures are reported but not fatal.
+	void SetDiscard(RangeFunc func) { m_discard = func; }
+	// Called for the same ranges after discarding, so that they read as zeros like in the image.
+	// Failures abort the restore.
+	void SetZero(RangeFunc func) { m_zero = func; }
+
+	// extents must be sorted and within the size of both devices.
+	int Restore(const ExtentList &extents);
+
+private:
+	void WriteThread();
+
+	Device &m_src;
+	Device &m_dst;
+	unsigned int m_threads;
+	size_t m_request_size;
+	Progress *m_progress;
+	RangeFunc m_discard;
+	RangeFunc m_zero;
+
+	const ExtentList *m_extents;
+	size_t m_next_extent;
+	uint64_t m_next_offset;
+	uint64_t m_done;
+	int m_err;
+	// Threads that got no buffer from the pool
+	unsigned int m_starved;
+	std::mutex m_mutex;
+	// Images aren't safe for concurrent reads, the writes to the device are.
+	std::mutex m_read_mutex;
+};
@@ -0,0 +1,235 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstring>
+
+#ifdef __x86_64__
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "Sha256.h"
+
+// FIPS 180-4
+
+static const uint32_t K[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+static inline uint32_t Ror(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+const Sha256::TransformFunc Sha256::s_transform = Sha256::SelectTransform();
+
+Sha256::Sha256()
+{
+	Reset();
+}
+
+void Sha256::Reset()
+{
+	m_state[0] = 0x6A09E667;
+	m_state[1] = 0xBB67AE85;
+	m_state[2] = 0x3C6EF372;
+	m_state[3] = 0xA54FF53A;
+	m_state[4] = 0x510E527F;
+	m_state[5] = 0x9B05688C;
+	m_state[6] = 0x1F83D9AB;
+	m_state[7] = 0x5BE0CD19;
+	m_buf_len = 0;
+	m_total = 0;
+}
+
+void Sha256::Update(const uint8_t* data, size_t size)
+{
+	size_t n;
+
+	m_total += size;
+
+	if (m_buf_len > 0) {
+		n = 64 - m_buf_len;
+		if (n > size) n = size;
+		memcpy(m_buf + m_buf_len, data, n);
+		m_buf_len += n;
+		data += n;
+		size -= n;
+		if (m_buf_len < 64)
+			return;
+		s_transform(m_state, m_buf, 1);
+		m_buf_len = 0;
+	}
+
+	// Full blocks are processed in place, without copying them to the buffer.
+	n = size / 64;
+	if (n > 0) {
+		s_transform(m_state, data, n);
+		data += n * 64;
+		size -= n * 64;
+	}
+
+	memcpy(m_buf, data, size);
+	m_buf_len = size;
+}
+
+void Sha256::Final(uint8_t* digest)
+{
+	const uint64_t bits = m_total * 8;
+	int k;
+
+	m_buf[m_buf_len++] = 0x80;
+	if (m_buf_len > 56) {
+		memset(m_buf + m_buf_len, 0, 64 - m_buf_len);
+		s_transform(m_state, m_buf, 1);
+		m_buf_len = 0;
+	}
+	memset(m_buf + m_buf_len, 0, 56 - m_buf_len);
+	for (k = 0; k < 8; k++)
+		m_buf[56 + k] = static_cast<uint8_t>(bits >> (56 - 8 * k));
+	s_transform(m_state, m_buf, 1);
+
+	for (k = 0; k < 8; k++) {
+		digest[4 * k] = static_cast<uint8_t>(m_state[k] >> 24);
+		digest[4 * k + 1] = static_cast<uint8_t>(m_state[k] >> 16);
+		digest[4 * k + 2] = static_cast<uint8_t>(m_state[k] >> 8);
+		digest[4 * k + 3] = static_cast<uint8_t>(m_state[k]);
+	}
+
+	Reset();
+}
+
+Sha256::TransformFunc Sha256::SelectTransform()
+{
+#ifdef __x86_64__
+	unsigned int eax, ebx, ecx, edx;
+
+	// The SHA extensions are CPUID leaf 7, EBX bit 29. They need SSE4.1 as well.
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1U << 29)) &&
+		__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1))
+		return TransformShaNi;
+#endif
+	return TransformGeneric;
+}
+
+void Sha256::TransformGeneric(uint32_t *state, const uint8_t* data, size_t blocks)
+{
+	for (; blocks > 0; blocks--, data += 64) {
+		const uint8_t *block = data;
+		uint32_t w[64];
+		uint32_t a, b, c, d, e, f, g, h;
+		uint32_t t1, t2;
+		int k;
+
+		for (k = 0; k < 16; k++)
+			w[k] = (static_cast<uint32_t>(block[4 * k]) << 24) | (static_cast<uint32_t>(block[4 * k + 1]) << 16) |
+				(static_cast<uint32_t>(block[4 * k + 2]) << 8) | block[4 * k + 3];
+		for (k = 16; k < 64; k++)
+			w[k] = w[k - 16] + (Ror(w[k - 15], 7) ^ Ror(w[k - 15], 18) ^ (w[k - 15] >> 3)) +
+				w[k - 7] + (Ror(w[k - 2], 17) ^ Ror(w[k - 2], 19) ^ (w[k - 2] >> 10));
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		f = state[5];
+		g = state[6];
+		h = state[7];
+
+		for (k = 0; k < 64; k++) {
+			t1 = h + (Ror(e, 6) ^ Ror(e, 11) ^ Ror(e, 25)) + ((e & f) ^ (~e & g)) + K[k] + w[k];
+			t2 = (Ror(a, 2) ^ Ror(a, 13) ^ Ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+#ifdef __x86_64__
+// Four rounds per step. Message words are kept in four registers, m[g & 3] holds group g - 4 before it is replaced.
+__attribute__((target("sha,sse4.1")))
+void Sha256::TransformShaNi(uint32_t *state, const uint8_t* data, size_t blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abef_save, cdgh_save;
+	__m128i msg, tmp;
+	__m128i m[4];
+	int g;
+
+	tmp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[0]));
+	state1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[4]));
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);
+	state1 = _mm_shuffle_epi32(state1, 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	for (; blocks > 0; blocks--, data += 64) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		for (g = 0; g < 16; g++) {
+			if (g < 4) {
+				m[g] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * g)), mask);
+			} else {
+				tmp = _mm_add_epi32(_mm_sha256msg1_epu32(m[g & 3], m[(g + 1) & 3]), _mm_alignr_epi8(m[(g + 3) & 3], m[(g + 2) & 3], 4));
+				m[g & 3] = _mm_sha256msg2_epu32(tmp, m[(g + 3) & 3]);
+			}
+
+			msg = _mm_add_epi32(m[g & 3], _mm_loadu_si128(reinterpret_cast<const __m128i *>(&K[4 * g])));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]), state0);
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]), state1);
+}
+#endif
@@ -0,0 +1,51 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+class Sha256
+{
+public:
+	static constexpr size_t DIGEST_SIZE = 32;
+
+	Sha256();
+
+	void Reset();
+	void Update(const uint8_t *data, size_t size);
+	void Final(uint8_t *digest);
+
+private:
+	typedef void (*TransformFunc)(uint32_t *state, const uint8_t *data, size_t blocks);
+
+	static TransformFunc SelectTransform();
+	static void TransformGeneric(uint32_t *state, const uint8_t *data, size_t blocks);
+#ifdef __x86_64__
+	static void TransformShaNi(uint32_t *state, const uint8_t *data, size_t blocks);
+#endif
+
+	static const TransformFunc s_transform;
+
+	uint32_t m_state[8];
+	uint8_t m_buf[64];
+	size_t m_buf_len;
+	uint64_t m_total;
+};
@@ -0,0 +1,52 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "Sysfs.h"
+
+std::string SysfsDiskDir(const char* path)
+{
+	struct stat st;
+	char link[64];
+	char real[PATH_MAX];
+	std::string dir;
+	dev_t dev;
+
+	if (stat(path, &st))
+		return std::string();
+
+	// /sys/dev/block/M:m links to the device, a partition is a subdirectory of its disk.
+	dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+	snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+	if (!realpath(link, real))
+		return std::string();
+
+	dir = real;
+	if (access((dir + "/partition").c_str(), F_OK) == 0)
+		dir = dir.substr(0, dir.rfind('/'));
+
+	return dir;
+}
@@ -0,0 +1,304 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <sys/stat.h>
+
+#include "ThrottledDevice.h"
+
+// Bucket size in seconds worth of tokens
+static constexpr double BURST_SEC = 0.1;
+// Averaging window for the latency backoff
+static constexpr uint64_t BACKOFF_WINDOW_NS = 500000000;
+static constexpr double BACKOFF_MIN_RATE = 1e6;
+static constexpr uint64_t CONTROL_CHECK_NS = 1000000000;
+
+static volatile sig_atomic_t s_reload = 0;
+
+static uint64_t NowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ThrottledDevice::ThrottledDevice(Device& dev) : m_dev(dev)
+{
+	SetSectorSize(dev.GetSectorSize());
+
+	m_limits.bytes_per_sec = 0;
+	m_limits.ops_per_sec = 0;
+	m_limits.latency_us = 0;
+	m_byte_tokens = 0;
+	m_op_tokens = 0;
+	m_last_refill_ns = NowNs();
+	m_backoff_rate = 0;
+	m_window_start_ns = m_last_refill_ns;
+	m_window_bytes = 0;
+	m_window_ops = 0;
+	m_window_latency_ns = 0;
+	m_control_mtime = 0;
+	m_control_check_ns = 0;
+}
+
+ThrottledDevice::~ThrottledDevice()
+{
+}
+
+void ThrottledDevice::SetLimits(const ThrottledDevice::Limits& limits)
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+
+	m_limits = limits;
+	m_backoff_rate = 0;
+}
+
+ThrottledDevice::Limits ThrottledDevice::GetLimits() const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+
+	return m_limits;
+}
+
+int ThrottledDevice::GetFileDescriptor() const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+
+	if (m_limits.bytes_per_sec || m_limits.ops_per_sec || m_limits.latency_us || !m_control_file.empty())
+		return -1;
+
+	return m_dev.GetFileDescriptor();
+}
+
+void ThrottledDevice::SetControlFile(const char* name)
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+
+	m_control_file = name;
+	m_control_mtime = 0;
+	m_control_check_ns = 0;
+}
+
+void ThrottledDevice::RequestReload()
+{
+	s_reload = 1;
+}
+
+bool ThrottledDevice::ParseSize(const char* str, uint64_t& value)
+{
+	char *end;
+
+	value = strtoull(str, &end, 10);
+	if (end == str)
+		return false;
+
+	switch (*end) {
+	case 'T': case 't': value <<= 10; // fall through
+	case 'G': case 'g': value <<= 10; // fall through
+	case 'M': case 'm': value <<= 10; // fall through
+	case 'K': case 'k': value <<= 10; end++; break;
+	default: break;
+	}
+
+	return *end == 0 || *end == '\n' || *end == ' ';
+}
+
+int ThrottledDevice::LoadControlFile()
+{
+	FILE *f;
+	char line[128];
+	char *eq;
+	uint64_t value;
+
+	f = fopen(m_control_file.c_str(), "r");
+	if (!f)
+		return errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		eq = strchr(line, '=');
+		if (line[0] == '#' || !eq || !ParseSize(eq + 1, value))
+			continue;
+		*eq = 0;
+
+		if (!strcmp(line, "rate"))
+			m_limits.bytes_per_sec = value;
+		else if (!strcmp(line, "iops"))
+			m_limits.ops_per_sec = value;
+		else if (!strcmp(line, "latency"))
+			m_limits.latency_us = value * 1000;
+	}
+
+	fclose(f);
+
+	m_backoff_rate = 0;
+
+	fprintf(stderr, "Throttle: rate %" PRIu64 " B/s, %" PRIu64 " IOPS, latency target %" PRIu64 " ms\n",
+		m_limits.bytes_per_sec, m_limits.ops_per_sec, m_limits.latency_us / 1000);
+
+	return 0;
+}
+
+void ThrottledDevice::CheckControlFile(uint64_t now)
+{
+	struct stat st;
+
+	if (m_control_file.empty())
+		return;
+	if (!s_reload && now - m_control_check_ns < CONTROL_CHECK_NS)
+		return;
+
+	m_control_check_ns = now;
+
+	if (stat(m_control_file.c_str(), &st))
+		return;
+	if (!s_reload && st.st_mtime == m_control_mtime)
+		return;
+
+	s_reload = 0;
+	m_control_mtime = st.st_mtime;
+	LoadControlFile();
+}
+
+void ThrottledDevice::Acquire(size_t size)
+{
+	double rate;
+	double elapsed;
+	double wait = 0;
+	uint64_t now;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+
+		now = NowNs();
+		CheckControlFile(now);
+
+		elapsed = (now - m_last_refill_ns) / 1e9;
+		m_last_refill_ns = now;
+
+		rate = static_cast<double>(m_limits.bytes_per_sec);
+		if (m_backoff_rate > 0 && (rate == 0 || m_backoff_rate < rate))
+			rate = m_backoff_rate;
+
+		if (rate > 0) {
+			m_byte_tokens = std::min(m_byte_tokens + rate * elapsed, rate * BURST_SEC);
+			m_byte_tokens -= size;
+			if (m_byte_tokens < 0)
+				wait = -m_byte_tokens / rate;
+		} else {
+			m_byte_tokens = 0;
+		}
+
+		if (m_limits.ops_per_sec > 0) {
+			m_op_tokens = std::min(m_op_tokens + m_limits.ops_per_sec * elapsed, std::max(m_limits.ops_per_sec * BURST_SEC, 1.0));
+			m_op_tokens -= 1;
+			if (m_op_tokens < 0)
+				wait = std::max(wait, -m_op_tokens / m_limits.ops_per_sec);
+		} else {
+			m_op_tokens = 0;
+		}
+	}
+
+	if (wait > 0)
+		std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+}
+
+void ThrottledDevice::Complete(size_t size, uint64_t latency_ns)
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	uint64_t now;
+	uint64_t avg_us;
+	double observed;
+
+	if (m_limits.latency_us == 0)
+		return;
+
+	m_window_bytes += size;
+	m_window_ops++;
+	m_window_latency_ns += latency_ns;
+
+	now = NowNs();
+	if (now - m_window_start_ns < BACKOFF_WINDOW_NS)
+		return;
+
+	avg_us = m_window_latency_ns / m_window_ops / 1000;
+	observed = m_window_bytes * 1e9 / (now - m_window_start_ns);
+
+	if (avg_us > m_limits.latency_us) {
+		// Halve the rate until the device recovers
+		m_backoff_rate = std::max((m_backoff_rate > 0 ? m_backoff_rate : observed) / 2, BACKOFF_MIN_RATE);
+		fprintf(stderr, "Read latency %" PRIu64 " ms, backing off to %.1f MB/s\n", avg_us / 1000, m_backoff_rate / 1e6);
+	} else if (m_backoff_rate > 0 && avg_us < m_limits.latency_us / 2) {
+		m_backoff_rate *= 1.25;
+		// Drop the backoff once it no longer limits anything
+		if ((m_limits.bytes_per_sec && m_backoff_rate >= m_limits.bytes_per_sec) || m_backoff_rate >= 2 * observed)
+			m_backoff_rate = 0;
+	}
+
+	m_window_start_ns = now;
+	m_window_bytes = 0;
+	m_window_ops = 0;
+	m_window_latency_ns = 0;
+}
+
+int ThrottledDevice::Read(void* data, size_t size, uint64_t offset)
+{
+	uint64_t start;
+	int err;
+
+	Acquire(size);
+	start = NowNs();
+	err = m_dev.Read(data, size, offset);
+	Complete(size, NowNs() - start);
+
+	return err;
+}
+
+int ThrottledDevice::Write(const void* data, size_t size, uint64_t offset)
+{
+	uint64_t start;
+	int err;
+
+	Acquire(size);
+	start = NowNs();
+	err = m_dev.Write(data, size, offset);
+	Complete(size, NowNs() - start);
+
+	return err;
+}
+
+int ThrottledDevice::CopyFrom(int src_fd, uint64_t offset, uint64_t size)
+{
+	uint64_t start;
+	int err;
+
+	Acquire(size);
+	start = NowNs();
+	err = m_dev.CopyFrom(src_fd, offset, size);
+	Complete(size, NowNs() - start);
+
+	return err;
+}
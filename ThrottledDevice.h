@@ -0,0 +1,91 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <mutex>
+#include <string>
+
+#include "Device.h"
+
+// Limits bandwidth and IOPS of a device with token buckets, for dumping disks of live systems.
+// The limits can be changed at runtime through a control file, and the bandwidth can back off
+// automatically when the device latency goes up.
+class ThrottledDevice : public Device
+{
+public:
+	struct Limits
+	{
+		uint64_t bytes_per_sec;  // 0 = unlimited
+		uint64_t ops_per_sec;    // 0 = unlimited
+		uint64_t latency_us;     // Back off above this average latency, 0 = off
+	};
+
+	ThrottledDevice(Device &dev);
+	~ThrottledDevice();
+
+	void SetLimits(const Limits &limits);
+	Limits GetLimits() const;
+
+	// The file contains lines like "rate=50M", "iops=200" or "latency=20" (ms). It is reread when it changes
+	// or when RequestReload() has been called, which is safe to do from a signal handler.
+	void SetControlFile(const char *name);
+	static void RequestReload();
+
+	int Read(void *data, size_t size, uint64_t offset) override;
+	int Write(const void *data, size_t size, uint64_t offset) override;
+	uint64_t GetSize() const override { return m_dev.GetSize(); }
+	// Only passed through without any limits, reads of the file by a kernel copy can't be throttled.
+	int GetFileDescriptor() const override;
+	// Kernel copies into the device are throttled like writes.
+	int CopyFrom(int src_fd, uint64_t offset, uint64_t size) override;
+
+	// Parses a number with an optional K, M, G or T suffix (powers of 1024)
+	static bool ParseSize(const char *str, uint64_t &value);
+
+private:
+	void Acquire(size_t size);
+	void Complete(size_t size, uint64_t latency_ns);
+	void CheckControlFile(uint64_t now);
+	int LoadControlFile();
+
+	Device &m_dev;
+
+	mutable std::mutex m_mtx;
+	Limits m_limits;
+
+	// Token buckets, may go negative for requests larger than the burst size.
+	double m_byte_tokens;
+	double m_op_tokens;
+	uint64_t m_last_refill_ns;
+
+	// Bandwidth limit set by the latency backoff, 0 = not active
+	double m_backoff_rate;
+	uint64_t m_window_start_ns;
+	uint64_t m_window_bytes;
+	uint64_t m_window_ops;
+	uint64_t m_window_latency_ns;
+
+	std::string m_control_file;
+	int64_t m_control_mtime;
+	uint64_t m_control_check_ns;
+};
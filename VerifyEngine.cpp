@@ -0,0 +1,119 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "BufferPool.h"
+#include "Device.h"
+#include "Progress.h"
+#include "VerifyEngine.h"
+
+#define dbg_printf(...) // printf(__VA_ARGS__)
+
+static constexpr size_t BUF_SIZE = BufferPool::BUFFER_SIZE;
+// Number of chunks in flight, each reader can run this far ahead of the comparison
+static constexpr size_t DEPTH = 4;
+// Resolution of the reported mismatches
+static constexpr size_t COMPARE_GRANULE = 0x1000;
+
+enum { SIDE_SRC = 0, SIDE_IMG = 1 };
+
+VerifyEngine::VerifyEngine(Device &src, Device &img) : m_reader({ &src, &img }, DEPTH)
+{
+	m_progress = nullptr;
+}
+
+VerifyEngine::~VerifyEngine()
+{
+}
+
+int VerifyEngine::Verify(const ExtentList& extents)
+{
+	uint64_t offset;
+	uint64_t size;
+	uint64_t verified = 0;
+	size_t idx;
+	int err = 0;
+
+	if (m_reader.GetDepth() == 0)
+		return ENOMEM;
+
+	m_chunks.clear();
+	m_mismatches.Clear();
+	m_unreadable.Clear();
+
+	// Both readers walk the same list of buffer-sized chunks.
+	for (const Extent &ext : extents) {
+		for (offset = ext.offset; offset < ext.offset + ext.size; offset += size) {
+			size = ext.offset + ext.size - offset;
+			if (size > BUF_SIZE) size = BUF_SIZE;
+			m_chunks.push_back({ offset, size });
+		}
+	}
+
+	m_reader.Start(m_chunks);
+
+	for (idx = 0; idx < m_chunks.size(); idx++) {
+		const ReadAhead::Slot &slot = m_reader.Wait(idx);
+		const Extent &chunk = m_chunks[idx];
+
+		if (slot.err[SIDE_IMG]) {
+			fprintf(stderr, "Error %d reading the image at %" PRIX64 "\n", slot.err[SIDE_IMG], chunk.offset);
+			err = slot.err[SIDE_IMG];
+			break;
+		}
+
+		if (slot.err[SIDE_SRC]) {
+			dbg_printf("Source error %d at %" PRIX64 "\n", slot.err[SIDE_SRC], chunk.offset);
+			m_unreadable.Add(chunk.offset, chunk.size);
+		} else {
+			Compare(slot.buf[SIDE_SRC], slot.buf[SIDE_IMG], chunk.size, chunk.offset);
+		}
+
+		verified += chunk.size;
+		if (m_progress)
+			m_progress->Update(verified);
+
+		m_reader.Release(idx);
+	}
+
+	m_reader.Stop();
+
+	return err;
+}
+
+void VerifyEngine::Compare(const uint8_t* src, const uint8_t* img, size_t size, uint64_t offset)
+{
+	size_t pos;
+	size_t len;
+
+	if (memcmp(src, img, size) == 0)
+		return;
+
+	// Narrow the difference down, adjacent granules are merged by ExtentList::Add.
+	for (pos = 0; pos < size; pos += len) {
+		len = size - pos;
+		if (len > COMPARE_GRANULE) len = COMPARE_GRANULE;
+		if (memcmp(src + pos, img + pos, len) != 0)
+			m_mismatches.Add(offset + pos, len);
+	}
+}
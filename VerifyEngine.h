@@ -0,0 +1,59 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+#include "ExtentList.h"
+#include "ReadAhead.h"
+
+class Device;
+class Progress;
+
+// Compares planned extents on the source with the same offsets in an image.
+// The source and the image are read by separate threads, so both devices are busy at the same time.
+class VerifyEngine
+{
+public:
+	VerifyEngine(Device &src, Device &img);
+	~VerifyEngine();
+
+	void SetProgress(Progress *progress) { m_progress = progress; }
+
+	// extents must be sorted. Source read errors are recorded and skipped, image read errors abort.
+	int Verify(const ExtentList &extents);
+
+	const ExtentList &GetMismatches() const { return m_mismatches; }
+	const ExtentList &GetUnreadable() const { return m_unreadable; }
+
+private:
+	void Compare(const uint8_t *src, const uint8_t *img, size_t size, uint64_t offset);
+
+	Progress *m_progress;
+
+	std::vector<Extent> m_chunks;
+	ReadAhead m_reader;
+
+	ExtentList m_mismatches;
+	ExtentList m_unreadable;
+};
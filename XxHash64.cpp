@@ -0,0 +1,154 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstring>
+#include <endian.h>
+
+#include "XxHash64.h"
+
+static constexpr uint64_t P1 = 0x9E3779B185EBCA87ULL;
+static constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr uint64_t P3 = 0x165667B19E3779F9ULL;
+static constexpr uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+static constexpr uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t Rol(uint64_t x, int n)
+{
+	return (x << n) | (x >> (64 - n));
+}
+
+static inline uint64_t Load64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static inline uint32_t Load32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static inline uint64_t Round(uint64_t acc, uint64_t input)
+{
+	acc += input * P2;
+	acc = Rol(acc, 31);
+	return acc * P1;
+}
+
+static inline uint64_t MergeRound(uint64_t acc, uint64_t val)
+{
+	acc ^= Round(0, val);
+	return acc * P1 + P4;
+}
+
+XxHash64::XxHash64(uint64_t seed) : m_seed(seed)
+{
+	Reset();
+}
+
+void XxHash64::Reset()
+{
+	m_acc[0] = m_seed + P1 + P2;
+	m_acc[1] = m_seed + P2;
+	m_acc[2] = m_seed;
+	m_acc[3] = m_seed - P1;
+	m_buf_len = 0;
+	m_total = 0;
+}
+
+void XxHash64::Update(const uint8_t* data, size_t size)
+{
+	size_t n;
+
+	m_total += size;
+
+	if (m_buf_len > 0) {
+		n = 32 - m_buf_len;
+		if (n > size) n = size;
+		memcpy(m_buf + m_buf_len, data, n);
+		m_buf_len += n;
+		data += n;
+		size -= n;
+		if (m_buf_len < 32)
+			return;
+		for (int k = 0; k < 4; k++)
+			m_acc[k] = Round(m_acc[k], Load64(m_buf + 8 * k));
+		m_buf_len = 0;
+	}
+
+	while (size >= 32) {
+		m_acc[0] = Round(m_acc[0], Load64(data));
+		m_acc[1] = Round(m_acc[1], Load64(data + 8));
+		m_acc[2] = Round(m_acc[2], Load64(data + 16));
+		m_acc[3] = Round(m_acc[3], Load64(data + 24));
+		data += 32;
+		size -= 32;
+	}
+
+	memcpy(m_buf, data, size);
+	m_buf_len = size;
+}
+
+uint64_t XxHash64::Final()
+{
+	const uint8_t *p = m_buf;
+	size_t left = m_buf_len;
+	uint64_t h;
+
+	if (m_total >= 32) {
+		h = Rol(m_acc[0], 1) + Rol(m_acc[1], 7) + Rol(m_acc[2], 12) + Rol(m_acc[3], 18);
+		for (int k = 0; k < 4; k++)
+			h = MergeRound(h, m_acc[k]);
+	} else {
+		h = m_seed + P5;
+	}
+
+	h += m_total;
+
+	while (left >= 8) {
+		h ^= Round(0, Load64(p));
+		h = Rol(h, 27) * P1 + P4;
+		p += 8;
+		left -= 8;
+	}
+	if (left >= 4) {
+		h ^= Load32(p) * P1;
+		h = Rol(h, 23) * P2 + P3;
+		p += 4;
+		left -= 4;
+	}
+	while (left > 0) {
+		h ^= *p * P5;
+		h = Rol(h, 11) * P1;
+		p++;
+		left--;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+
+	Reset();
+	return h;
+}
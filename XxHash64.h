@@ -0,0 +1,41 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit xxHash, a fast non-cryptographic hash
+class XxHash64
+{
+public:
+	XxHash64(uint64_t seed = 0);
+
+	void Reset();
+	void Update(const uint8_t *data, size_t size);
+	uint64_t Final();
+
+private:
+	uint64_t m_seed;
+	uint64_t m_acc[4];
+	uint8_t m_buf[32];
+	size_t m_buf_len;
+	uint64_t m_total;
+};
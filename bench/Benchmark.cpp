@@ -0,0 +1,481 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include "Apfs.h"
+#include "AppleSparseimage.h"
+#include "Bitmap.h"
+#include "CopyEngine.h"
+#include "BufferPool.h"
+#include "Crc32.h"
+#include "ExtentList.h"
+#include "NullDevice.h"
+#include "Numa.h"
+#include "RamDevice.h"
+#include "Sha256.h"
+#include "SyntheticApfs.h"
+#include "ThrottledDevice.h"
+#include "XxHash64.h"
+
+// Size of the buffers for the bitmap and checksum kernels
+static constexpr size_t KERNEL_BUFFER_SIZE = 0x4000000;
+static constexpr size_t SPARSE_IO_SIZE = 0x100000;
+// Pool buffers touched per pass of the NUMA benchmark
+static constexpr size_t NUMA_BUFFERS = 16;
+// Gap bridged by the copy engine benchmark, about what a disk reads in the time of a short seek
+static constexpr uint64_t BRIDGE_GAP = 0x40000;
+
+class Timer
+{
+public:
+	Timer() { Reset(); }
+
+	void Reset() { m_start = std::chrono::steady_clock::now(); }
+	double GetElapsed() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count(); }
+
+private:
+	std::chrono::steady_clock::time_point m_start;
+};
+
+// Every benchmark runs a number of iterations and reports the fastest one.
+static void Report(const char *name, double seconds, uint64_t bytes, const char *extra = nullptr)
+{
+	printf("%-24s %10.3f ms %10.1f MB/s", name, seconds * 1e3, seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+	if (extra)
+		printf("  %s", extra);
+	printf("\n");
+}
+
+static int BenchApfs(const SyntheticApfs::Params &params, unsigned int iterations, const char *save_name)
+{
+	RamDevice ram(params.block_count * params.block_size);
+	NullDevice null(ram.GetSize());
+	SyntheticApfs gen(params);
+	ExtentList extents;
+	char extra[128];
+	double best;
+	Timer timer;
+	int err;
+
+	err = gen.Generate(ram);
+	if (err) {
+		fprintf(stderr, "Error %d generating the container.\n", err);
+		return err;
+	}
+	Report("generate", timer.GetElapsed(), ram.GetAllocatedSize());
+
+	if (save_name) {
+		err = ram.Save(save_name);
+		if (err) {
+			fprintf(stderr, "Error %d saving the container to %s.\n", err, save_name);
+			return err;
+		}
+	}
+
+	best = 1e9;
+	for (unsigned int k = 0; k < iterations; k++) {
+		Apfs apfs(ram, 0, ram.GetSize());
+
+		extents.Clear();
+		timer.Reset();
+		err = apfs.GetExtents(extents);
+		if (err) {
+			fprintf(stderr, "Error %d listing the extents.\n", err);
+			return err;
+		}
+		if (timer.GetElapsed() < best) best = timer.GetElapsed();
+	}
+	snprintf(extra, sizeof(extra), "%zu extents, %" PRIu64 " blocks", extents.Count(), params.block_count);
+	Report("apfs_get_extents", best, params.block_count / 8, extra);
+
+	// Overlapping ranges (the checkpoint areas are also marked in the bitmap) are only merged by Sort.
+	extents.Sort();
+	if (extents.TotalSize() != gen.GetAllocatedBlocks() * params.block_size)
+		fprintf(stderr, "Warning: extents cover %" PRIu64 " bytes, %" PRIu64 " blocks are allocated.\n",
+			extents.TotalSize(), gen.GetAllocatedBlocks());
+
+	best = 1e9;
+	for (unsigned int k = 0; k < iterations; k++) {
+		Apfs apfs(ram, 0, ram.GetSize());
+
+		timer.Reset();
+		err = apfs.CopyData(null);
+		if (err) {
+			fprintf(stderr, "Error %d copying the data.\n", err);
+			return err;
+		}
+		if (timer.GetElapsed() < best) best = timer.GetElapsed();
+	}
+	Report("apfs_copy_data", best, extents.TotalSize());
+
+	// Time to copy through the engine, the saved reads are what matters on a real disk.
+	for (uint64_t gap : { static_cast<uint64_t>(0), BRIDGE_GAP }) {
+		best = 1e9;
+		for (unsigned int k = 0; k < iterations; k++) {
+			CopyEngine engine(ram, null);
+
+			engine.SetGapBridging(gap);
+			timer.Reset();
+			err = engine.Copy(extents);
+			if (err) {
+				fprintf(stderr, "Error %d copying the extents.\n", err);
+				return err;
+			}
+			if (timer.GetElapsed() < best) best = timer.GetElapsed();
+			snprintf(extra, sizeof(extra), "%" PRIu64 " reads saved, %" PRIu64 " gap bytes read", engine.GetReadsSaved(), engine.GetGapBytes());
+		}
+		Report(gap ? "copy_engine_bridged" : "copy_engine", best, extents.TotalSize(), gap ? extra : nullptr);
+	}
+
+	return 0;
+}
+
+static void BenchBitmap(unsigned int iterations, uint32_t avg_run)
+{
+	std::vector<uint8_t> bm(KERNEL_BUFFER_SIZE);
+	std::mt19937_64 rng(1);
+	std::exponential_distribution<double> run_len(1.0 / avg_run);
+	const size_t bits = bm.size() * 8;
+	size_t pos = 0;
+	size_t len;
+	size_t runs = 0;
+	bool set = false;
+
+	while (pos < bits) {
+		len = static_cast<size_t>(run_len(rng)) + 1;
+		if (len > bits - pos) len = bits - pos;
+		for (size_t n = pos; set && n < pos + len; n++)
+			bm[n >> 3] |= 1 << (n & 7);
+		pos += len;
+		set = !set;
+	}
+
+	for (int msb = 0; msb < 2; msb++) {
+		double best = 1e9;
+		Timer timer;
+
+		for (unsigned int k = 0; k < iterations; k++) {
+			size_t start;
+			size_t end = 0;
+
+			runs = 0;
+			timer.Reset();
+			for (;;) {
+				start = BitmapFindSet(bm.data(), end, bits, msb);
+				if (start >= bits)
+					break;
+				end = BitmapFindClear(bm.data(), start, bits, msb);
+				runs++;
+			}
+			if (timer.GetElapsed() < best) best = timer.GetElapsed();
+		}
+
+		char extra[64];
+		snprintf(extra, sizeof(extra), "%zu runs", runs);
+		Report(msb ? "bitmap_scan_msb" : "bitmap_scan_lsb", best, bm.size(), extra);
+	}
+}
+
+static void BenchChecksums(unsigned int iterations)
+{
+	static const size_t block_sizes[] = { 0x1000, 0x4000, 0x10000 };
+	std::vector<uint8_t> buf(KERNEL_BUFFER_SIZE);
+	std::mt19937 rng(1);
+	Crc32 crc(true, 0x04C11DB7);
+	double best;
+	Timer timer;
+	size_t valid;
+
+	for (size_t k = 0; k < buf.size(); k += 4) {
+		uint32_t v = rng();
+		memcpy(buf.data() + k, &v, sizeof(v));
+	}
+
+	// The blocks fail verification, which doesn't matter as the whole block is summed anyway.
+	for (size_t bs : block_sizes) {
+		char name[32];
+
+		best = 1e9;
+		valid = 0;
+		for (unsigned int k = 0; k < iterations; k++) {
+			timer.Reset();
+			for (size_t off = 0; off < buf.size(); off += bs)
+				valid += Apfs::VerifyBlock(buf.data() + off, bs);
+			if (timer.GetElapsed() < best) best = timer.GetElapsed();
+		}
+		snprintf(name, sizeof(name), "fletcher64_%zuk", bs >> 10);
+		Report(name, best, buf.size(), valid ? "unexpected valid blocks" : nullptr);
+	}
+
+	best = 1e9;
+	for (unsigned int k = 0; k < iterations; k++) {
+		timer.Reset();
+		crc.SetCRC(0xFFFFFFFF);
+		crc.Calc(buf.data(), buf.size());
+		if (timer.GetElapsed() < best) best = timer.GetElapsed();
+	}
+	Report("crc32", best, buf.size());
+
+	best = 1e9;
+	for (unsigned int k = 0; k < iterations; k++) {
+		Sha256 sha;
+		uint8_t digest[Sha256::DIGEST_SIZE];
+
+		timer.Reset();
+		sha.Update(buf.data(), buf.size());
+		sha.Final(digest);
+		if (timer.GetElapsed() < best) best = timer.GetElapsed();
+	}
+	Report("sha256", best, buf.size());
+
+	best = 1e9;
+	for (unsigned int k = 0; k < iterations; k++) {
+		XxHash64 xxh;
+
+		timer.Reset();
+		xxh.Update(buf.data(), buf.size());
+		xxh.Final();
+		if (timer.GetElapsed() < best) best = timer.GetElapsed();
+	}
+	Report("xxh64", best, buf.size());
+}
+
+// Copies and hashes pool buffers on one thread, like a dump worker. cpu_node < 0 leaves the
+// thread unpinned, mem_node < 0 takes any buffers.
+static double RunNumaCase(int cpu_node, int mem_node, unsigned int iterations)
+{
+	BufferPool &pool = BufferPool::Instance();
+	double best = 1e9;
+
+	std::thread worker([&]() {
+		std::vector<uint8_t *> bufs;
+		Timer timer;
+
+		if (cpu_node >= 0 && NumaBindThread(cpu_node))
+			return;
+		for (size_t k = 0; k < NUMA_BUFFERS; k++) {
+			uint8_t *buf = pool.Acquire(mem_node);
+
+			if (!buf) break;
+			memset(buf, static_cast<int>(k), BufferPool::BUFFER_SIZE);
+			bufs.push_back(buf);
+		}
+
+		for (unsigned int it = 0; it < iterations && bufs.size() >= 2; it++) {
+			timer.Reset();
+			for (size_t k = 0; k + 1 < bufs.size(); k++) {
+				XxHash64 xxh;
+
+				memcpy(bufs[k + 1], bufs[k], BufferPool::BUFFER_SIZE);
+				xxh.Update(bufs[k + 1], BufferPool::BUFFER_SIZE);
+				xxh.Final();
+			}
+			if (timer.GetElapsed() < best) best = timer.GetElapsed();
+		}
+
+		for (uint8_t *buf : bufs)
+			pool.Release(buf);
+	});
+	worker.join();
+
+	return best;
+}
+
+// The same work with the buffers on the node of the thread and on another node.
+static void BenchNuma(unsigned int iterations)
+{
+	uint64_t bytes = (NUMA_BUFFERS - 1) * BufferPool::BUFFER_SIZE;
+	int nodes = NumaNodeCount();
+	char name[32];
+
+	Report("numa_unpinned", RunNumaCase(-1, -1, iterations), bytes);
+	for (int node = 0; node < nodes; node++) {
+		snprintf(name, sizeof(name), "numa_local_%d", node);
+		Report(name, RunNumaCase(node, node, iterations), bytes);
+		if (nodes > 1) {
+			snprintf(name, sizeof(name), "numa_remote_%d", node);
+			Report(name, RunNumaCase(node, (node + 1) % nodes, iterations), bytes);
+		}
+	}
+}
+
+static int BenchSparseimage(const char *dir, uint64_t size)
+{
+	std::string name = std::string(dir) + "/fsdump_bench.sparseimage";
+	std::vector<uint8_t> buf(SPARSE_IO_SIZE);
+	AppleSparseimage img;
+	uint64_t written = 0;
+	uint64_t off;
+	Timer timer;
+	int err;
+
+	memset(buf.data(), 0x5A, buf.size());
+
+	// Every fourth megabyte is skipped, so the image has holes like a real dump.
+	err = img.Create(name.c_str(), size);
+	if (err) {
+		fprintf(stderr, "Error %d creating %s.\n", err, name.c_str());
+		return err;
+	}
+	for (off = 0; off + buf.size() <= size && !err; off += buf.size()) {
+		if ((off / buf.size()) % 4 == 3)
+			continue;
+		err = img.Write(buf.data(), buf.size(), off);
+		written += buf.size();
+	}
+	if (!err)
+		err = img.Flush();
+	img.Close();
+	Report("sparseimage_write", timer.GetElapsed(), written);
+
+	timer.Reset();
+	if (!err)
+		err = img.Open(name.c_str(), false);
+	Report("sparseimage_open", timer.GetElapsed(), 0);
+
+	timer.Reset();
+	for (off = 0; off + buf.size() <= size && !err; off += buf.size())
+		err = img.Read(buf.data(), buf.size(), off);
+	Report("sparseimage_read", timer.GetElapsed(), size);
+	img.Close();
+
+	unlink(name.c_str());
+
+	if (err)
+		fprintf(stderr, "Error %d in the sparseimage benchmark.\n", err);
+	return err;
+}
+
+static void PrintSyntax()
+{
+	printf("Syntax: fsdump_bench [options]\n");
+	printf("  --size=n           size of the synthetic APFS container (default 1G)\n");
+	printf("  --block-size=n     APFS block size (default 4096)\n");
+	printf("  --fill=percent     allocated blocks in partially used chunks (default 50)\n");
+	printf("  --run=n            average run length in blocks, smaller is more fragmented (default 64)\n");
+	printf("  --full-chunks=pct  completely allocated chunks (default 10)\n");
+	printf("  --cab              use CABs even if the CIB addresses fit into the space manager\n");
+	printf("  --save=file        write the container to a sparse file\n");
+	printf("  --iterations=n     repetitions, the fastest one is reported (default 3)\n");
+	printf("  --dir=path         directory for the sparseimage test (default /tmp)\n");
+	printf("  --image-size=n     size of the sparseimage test (default 256M)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_opts[] = {
+		{ "size", required_argument, nullptr, 'S' },
+		{ "block-size", required_argument, nullptr, 'b' },
+		{ "fill", required_argument, nullptr, 'f' },
+		{ "run", required_argument, nullptr, 'l' },
+		{ "full-chunks", required_argument, nullptr, 'F' },
+		{ "cab", no_argument, nullptr, 'c' },
+		{ "save", required_argument, nullptr, 'o' },
+		{ "iterations", required_argument, nullptr, 'i' },
+		{ "dir", required_argument, nullptr, 'd' },
+		{ "image-size", required_argument, nullptr, 'm' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+
+	SyntheticApfs::Params params = SyntheticApfs::DefaultParams();
+	uint64_t size = 0x40000000;
+	uint64_t image_size = 0x10000000;
+	unsigned int iterations = 3;
+	const char *save_name = nullptr;
+	const char *dir = "/tmp";
+	uint64_t value;
+	int opt;
+	int err;
+
+	while ((opt = getopt_long(argc, argv, "", long_opts, nullptr)) != -1) {
+		switch (opt) {
+		case 'S':
+		case 'b':
+		case 'm':
+			if (!ThrottledDevice::ParseSize(optarg, value)) {
+				PrintSyntax();
+				return EINVAL;
+			}
+			if (opt == 'S')
+				size = value;
+			else if (opt == 'b')
+				params.block_size = static_cast<uint32_t>(value);
+			else
+				image_size = value;
+			break;
+		case 'f':
+			params.fill = strtod(optarg, nullptr) / 100.0;
+			break;
+		case 'l':
+			params.avg_run = strtoul(optarg, nullptr, 0);
+			break;
+		case 'F':
+			params.full_chunks = strtod(optarg, nullptr) / 100.0;
+			break;
+		case 'c':
+			params.use_cabs = true;
+			break;
+		case 'o':
+			save_name = optarg;
+			break;
+		case 'i':
+			iterations = strtoul(optarg, nullptr, 0);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		default:
+			PrintSyntax();
+			return EINVAL;
+		}
+	}
+
+	if (params.block_size == 0 || params.avg_run == 0 || iterations == 0) {
+		PrintSyntax();
+		return EINVAL;
+	}
+	params.block_count = size / params.block_size;
+
+	printf("APFS container: %" PRIu64 " blocks of %u bytes, fill %.0f%%, run %u, full chunks %.0f%%%s\n",
+		params.block_count, params.block_size, params.fill * 100, params.avg_run, params.full_chunks * 100,
+		params.use_cabs ? ", CABs" : "");
+
+	err = BenchApfs(params, iterations, save_name);
+	if (err) return err;
+
+	BenchBitmap(iterations, params.avg_run);
+	BenchChecksums(iterations);
+	BenchNuma(iterations);
+
+	return BenchSparseimage(dir, image_size);
+}
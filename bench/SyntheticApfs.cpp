@@ -0,0 +1,315 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cstring>
+#include <endian.h>
+
+#include "SyntheticApfs.h"
+#include "Device.h"
+#include "apfs_layout.h"
+
+// Fixed layout: superblock at 0, checkpoint descriptors at 1..8, checkpoint data at 9..16,
+// CIBs from 20 on, followed by the CABs and the bitmaps.
+static constexpr uint32_t XP_DESC_BASE = 1;
+static constexpr uint32_t XP_DESC_BLOCKS = 8;
+static constexpr uint32_t XP_DATA_BASE = 9;
+static constexpr uint32_t XP_DATA_BLOCKS = 8;
+static constexpr uint32_t CIB_BASE = 20;
+static constexpr uint32_t SM_ADDR_OFFSET = 0x200;
+static constexpr uint64_t SM_OID = 0x400;
+static constexpr uint64_t XID = 7;
+
+SyntheticApfs::SyntheticApfs(const Params &params) : m_params(params), m_rng(params.seed)
+{
+	m_allocated = 0;
+	m_meta_end = 0;
+}
+
+SyntheticApfs::Params SyntheticApfs::DefaultParams()
+{
+	Params p;
+
+	p.block_size = NX_DEFAULT_BLOCK_SIZE;
+	p.block_count = 0x40000;
+	p.fill = 0.5;
+	p.avg_run = 64;
+	p.full_chunks = 0.1;
+	p.use_cabs = false;
+	p.seed = 1;
+
+	return p;
+}
+
+int SyntheticApfs::Generate(Device &dev)
+{
+	const uint32_t bs = m_params.block_size;
+	const uint32_t blocks_per_chunk = bs * 8;
+	const uint32_t chunks_per_cib = (bs - sizeof(chunk_info_block_t)) / sizeof(chunk_info_t);
+	const uint32_t cibs_per_cab = (bs - sizeof(cib_addr_block_t)) / sizeof(paddr_t);
+	const uint32_t max_sm_addrs = (bs - SM_ADDR_OFFSET) / sizeof(paddr_t);
+	std::vector<uint8_t> block(bs);
+	std::vector<uint8_t> bm(bs);
+	uint64_t chunk_count;
+	uint32_t cib_count;
+	uint32_t cab_count;
+	uint64_t cab_base;
+	uint64_t bm_base;
+	std::vector<uint32_t> free_counts;
+	uint64_t free_total = 0;
+	uint32_t cnt;
+	uint64_t k;
+	int err;
+
+	if (bs < NX_MINIMUM_BLOCK_SIZE || bs > NX_MAXIMUM_BLOCK_SIZE || (bs & (bs - 1)))
+		return EINVAL;
+	if (m_params.block_count * bs > dev.GetSize())
+		return EINVAL;
+
+	chunk_count = (m_params.block_count + blocks_per_chunk - 1) / blocks_per_chunk;
+	cib_count = static_cast<uint32_t>((chunk_count + chunks_per_cib - 1) / chunks_per_cib);
+	cab_count = 0;
+	if (m_params.use_cabs || cib_count > max_sm_addrs)
+		cab_count = (cib_count + cibs_per_cab - 1) / cibs_per_cab;
+	if (cab_count > max_sm_addrs)
+		return EINVAL;
+
+	cab_base = CIB_BASE + cib_count;
+	bm_base = cab_base + cab_count;
+	m_meta_end = bm_base + chunk_count;
+	if (m_meta_end > blocks_per_chunk || m_meta_end >= m_params.block_count)
+		return EINVAL;
+
+	m_allocated = 0;
+	free_counts.resize(chunk_count);
+
+	// Bitmaps, these have no object header
+	for (k = 0; k < chunk_count; k++) {
+		FillBitmap(bm.data(), k * blocks_per_chunk, ChunkBlocks(k), free_counts[k]);
+		free_total += free_counts[k];
+		err = WriteBlock(dev, bm_base + k, bm, false);
+		if (err) return err;
+	}
+
+	for (uint32_t c = 0; c < cib_count; c++) {
+		chunk_info_block_t *cib = reinterpret_cast<chunk_info_block_t *>(block.data());
+
+		memset(block.data(), 0, bs);
+		cib->cib_o.o_oid = htole64(CIB_BASE + c);
+		cib->cib_o.o_xid = htole64(XID);
+		cib->cib_o.o_type = htole32(OBJ_PHYSICAL | OBJECT_TYPE_SPACEMAN_CIB);
+		cib->cib_index = htole32(c);
+
+		for (cnt = 0; cnt < chunks_per_cib; cnt++) {
+			k = static_cast<uint64_t>(c) * chunks_per_cib + cnt;
+			if (k >= chunk_count) break;
+
+			chunk_info_t &ci = cib->cib_chunk_info[cnt];
+			ci.ci_xid = htole64(XID);
+			ci.ci_addr = htole64(k * blocks_per_chunk);
+			ci.ci_block_count = htole32(ChunkBlocks(k));
+			ci.ci_free_count = htole32(free_counts[k]);
+			ci.ci_bitmap_addr = htole64(bm_base + k);
+		}
+		cib->cib_chunk_info_count = htole32(cnt);
+
+		err = WriteBlock(dev, CIB_BASE + c, block, true);
+		if (err) return err;
+	}
+
+	for (uint32_t c = 0; c < cab_count; c++) {
+		cib_addr_block_t *cab = reinterpret_cast<cib_addr_block_t *>(block.data());
+
+		memset(block.data(), 0, bs);
+		cab->cab_o.o_oid = htole64(cab_base + c);
+		cab->cab_o.o_xid = htole64(XID);
+		cab->cab_o.o_type = htole32(OBJ_PHYSICAL | OBJECT_TYPE_SPACEMAN_CAB);
+		cab->cab_index = htole32(c);
+
+		for (cnt = 0; cnt < cibs_per_cab && c * cibs_per_cab + cnt < cib_count; cnt++)
+			cab->cab_cib_addr[cnt] = htole64(CIB_BASE + c * cibs_per_cab + cnt);
+		cab->cab_cib_count = htole32(cnt);
+
+		err = WriteBlock(dev, cab_base + c, block, true);
+		if (err) return err;
+	}
+
+	// Space manager, the only object in the checkpoint data area
+	{
+		spaceman_phys_t *sm = reinterpret_cast<spaceman_phys_t *>(block.data());
+		uint64_t *addrs = reinterpret_cast<uint64_t *>(block.data() + SM_ADDR_OFFSET);
+
+		memset(block.data(), 0, bs);
+		sm->sm_o.o_oid = htole64(SM_OID);
+		sm->sm_o.o_xid = htole64(XID);
+		sm->sm_o.o_type = htole32(OBJ_EPHEMERAL | OBJECT_TYPE_SPACEMAN);
+		sm->sm_block_size = htole32(bs);
+		sm->sm_blocks_per_chunk = htole32(blocks_per_chunk);
+		sm->sm_chunks_per_cib = htole32(chunks_per_cib);
+		sm->sm_cibs_per_cab = htole32(cibs_per_cab);
+		sm->sm_dev[SD_MAIN].sm_block_count = htole64(m_params.block_count);
+		sm->sm_dev[SD_MAIN].sm_chunk_count = htole64(chunk_count);
+		sm->sm_dev[SD_MAIN].sm_cib_count = htole32(cib_count);
+		sm->sm_dev[SD_MAIN].sm_cab_count = htole32(cab_count);
+		sm->sm_dev[SD_MAIN].sm_free_count = htole64(free_total);
+		sm->sm_dev[SD_MAIN].sm_addr_offset = htole32(SM_ADDR_OFFSET);
+
+		if (cab_count > 0) {
+			for (uint32_t c = 0; c < cab_count; c++)
+				addrs[c] = htole64(cab_base + c);
+		} else {
+			for (uint32_t c = 0; c < cib_count; c++)
+				addrs[c] = htole64(CIB_BASE + c);
+		}
+
+		err = WriteBlock(dev, XP_DATA_BASE, block, true);
+		if (err) return err;
+	}
+
+	// Checkpoint map and superblock. The superblock is also written to block 0.
+	{
+		checkpoint_map_phys_t *cpm = reinterpret_cast<checkpoint_map_phys_t *>(block.data());
+
+		memset(block.data(), 0, bs);
+		cpm->cpm_o.o_oid = htole64(XP_DESC_BASE);
+		cpm->cpm_o.o_xid = htole64(XID);
+		cpm->cpm_o.o_type = htole32(OBJ_PHYSICAL | OBJECT_TYPE_CHECKPOINT_MAP);
+		cpm->cpm_flags = htole32(CHECKPOINT_MAP_LAST);
+		cpm->cpm_count = htole32(1);
+		cpm->cpm_map[0].cpm_type = htole32(OBJ_EPHEMERAL | OBJECT_TYPE_SPACEMAN);
+		cpm->cpm_map[0].cpm_size = htole32(bs);
+		cpm->cpm_map[0].cpm_oid = htole64(SM_OID);
+		cpm->cpm_map[0].cpm_paddr = htole64(XP_DATA_BASE);
+
+		err = WriteBlock(dev, XP_DESC_BASE, block, true);
+		if (err) return err;
+	}
+
+	{
+		nx_superblock_t *nxsb = reinterpret_cast<nx_superblock_t *>(block.data());
+
+		memset(block.data(), 0, bs);
+		nxsb->nx_o.o_oid = htole64(OID_NX_SUPERBLOCK);
+		nxsb->nx_o.o_xid = htole64(XID);
+		nxsb->nx_o.o_type = htole32(OBJ_EPHEMERAL | OBJECT_TYPE_NX_SUPERBLOCK);
+		nxsb->nx_magic = htole32(NX_MAGIC);
+		nxsb->nx_block_size = htole32(bs);
+		nxsb->nx_block_count = htole64(m_params.block_count);
+		nxsb->nx_incompatible_features = htole64(NX_INCOMPAT_VERSION2);
+		nxsb->nx_next_oid = htole64(SM_OID + 1);
+		nxsb->nx_next_xid = htole64(XID + 1);
+		nxsb->nx_xp_desc_blocks = htole32(XP_DESC_BLOCKS);
+		nxsb->nx_xp_data_blocks = htole32(XP_DATA_BLOCKS);
+		nxsb->nx_xp_desc_base = htole64(XP_DESC_BASE);
+		nxsb->nx_xp_data_base = htole64(XP_DATA_BASE);
+		nxsb->nx_xp_desc_next = htole32(2);
+		nxsb->nx_xp_data_next = htole32(1);
+		nxsb->nx_xp_desc_index = htole32(0);
+		nxsb->nx_xp_desc_len = htole32(2);
+		nxsb->nx_xp_data_index = htole32(0);
+		nxsb->nx_xp_data_len = htole32(1);
+		nxsb->nx_spaceman_oid = htole64(SM_OID);
+		nxsb->nx_max_file_systems = htole32(1);
+
+		err = WriteBlock(dev, XP_DESC_BASE + 1, block, true);
+		if (err) return err;
+		err = WriteBlock(dev, 0, block, true);
+		if (err) return err;
+	}
+
+	return 0;
+}
+
+void SyntheticApfs::FillBitmap(uint8_t *bm, uint64_t first_block, uint32_t blocks, uint32_t &free_count)
+{
+	std::uniform_real_distribution<double> uni(0.0, 1.0);
+	std::exponential_distribution<double> run_len(1.0 / m_params.avg_run);
+	uint32_t pos = 0;
+	uint32_t len;
+	bool set;
+
+	memset(bm, 0, m_params.block_size);
+
+	if (uni(m_rng) < m_params.full_chunks) {
+		memset(bm, 0xFF, (blocks + 7) / 8);
+		pos = blocks;
+	} else {
+		// Alternating runs, the run lengths are scaled so that the requested fill ratio comes out on average.
+		set = uni(m_rng) < m_params.fill;
+		while (pos < blocks) {
+			double scale = set ? 2.0 * m_params.fill : 2.0 * (1.0 - m_params.fill);
+			len = static_cast<uint32_t>(run_len(m_rng) * scale) + 1;
+			if (len > blocks - pos) len = blocks - pos;
+			if (set) {
+				for (uint32_t n = pos; n < pos + len; n++)
+					bm[n >> 3] |= 1 << (n & 7);
+			}
+			pos += len;
+			set = !set;
+		}
+	}
+
+	// The metadata written by Generate has to be marked as allocated.
+	for (uint64_t n = first_block; n < first_block + blocks && n < m_meta_end; n++)
+		bm[(n - first_block) >> 3] |= 1 << ((n - first_block) & 7);
+
+	free_count = 0;
+	for (uint32_t n = 0; n < blocks; n++)
+		if (!(bm[n >> 3] & (1 << (n & 7))))
+			free_count++;
+
+	m_allocated += blocks - free_count;
+}
+
+uint32_t SyntheticApfs::ChunkBlocks(uint64_t chunk) const
+{
+	const uint64_t blocks_per_chunk = m_params.block_size * 8;
+
+	if ((chunk + 1) * blocks_per_chunk > m_params.block_count)
+		return static_cast<uint32_t>(m_params.block_count - chunk * blocks_per_chunk);
+	return static_cast<uint32_t>(blocks_per_chunk);
+}
+
+int SyntheticApfs::WriteBlock(Device &dev, uint64_t paddr, std::vector<uint8_t> &block, bool seal)
+{
+	if (seal)
+		Seal(block);
+
+	return dev.Write(block.data(), block.size(), paddr * m_params.block_size);
+}
+
+void SyntheticApfs::Seal(std::vector<uint8_t> &block)
+{
+	const uint32_t *data = reinterpret_cast<const uint32_t *>(block.data());
+	const size_t cnt = block.size() / sizeof(uint32_t);
+	uint64_t sum1 = 0;
+	uint64_t sum2 = 0;
+	uint64_t c1;
+	uint64_t c2;
+
+	for (size_t k = 2; k < cnt; k++) {
+		sum1 = (sum1 + le32toh(data[k])) % 0xFFFFFFFF;
+		sum2 = (sum2 + sum1) % 0xFFFFFFFF;
+	}
+
+	c1 = 0xFFFFFFFF - ((sum1 + sum2) % 0xFFFFFFFF);
+	c2 = 0xFFFFFFFF - ((sum1 + c1) % 0xFFFFFFFF);
+
+	*reinterpret_cast<uint64_t *>(block.data()) = htole64(c1 | (c2 << 32));
+}
@@ -0,0 +1,67 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+class Device;
+
+// Writes an APFS container with just enough metadata for fsdump: checkpoints, space manager,
+// CIBs (optionally behind CABs) and allocation bitmaps. File system trees are not generated.
+class SyntheticApfs
+{
+public:
+	struct Params
+	{
+		uint32_t block_size;
+		uint64_t block_count;
+		// Fraction of the blocks outside of full chunks that are allocated
+		double fill;
+		// Average length of allocated and free runs in blocks, smaller means more fragmented
+		uint32_t avg_run;
+		// Fraction of chunks that are completely allocated
+		double full_chunks;
+		// Reference the CIBs through CABs, as large containers do
+		bool use_cabs;
+		uint32_t seed;
+	};
+
+	SyntheticApfs(const Params &params);
+
+	static Params DefaultParams();
+
+	int Generate(Device &dev);
+
+	uint64_t GetAllocatedBlocks() const { return m_allocated; }
+	uint64_t GetMetaBlocks() const { return m_meta_end; }
+
+private:
+	void FillBitmap(uint8_t *bm, uint64_t first_block, uint32_t blocks, uint32_t &free_count);
+	uint32_t ChunkBlocks(uint64_t chunk) const;
+	int WriteBlock(Device &dev, uint64_t paddr, std::vector<uint8_t> &block, bool seal);
+	static void Seal(std::vector<uint8_t> &block);
+
+	Params m_params;
+	std::mt19937_64 m_rng;
+	uint64_t m_allocated;
+	uint64_t m_meta_end;
+};
@@ -0,0 +1,163 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+
+// All fields are little-endian on disk. Only the parts needed to find allocated blocks are described.
+
+#define EXT4_SUPERBLOCK_OFFSET 1024
+#define EXT4_SUPER_MAGIC       0xEF53
+
+#define EXT4_FEATURE_COMPAT_SPARSE_SUPER2  0x0200
+#define EXT4_FEATURE_INCOMPAT_META_BG      0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT        0x0080
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM    0x0010
+#define EXT4_FEATURE_RO_COMPAT_BIGALLOC    0x0200
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM 0x0400
+
+#define EXT4_BG_INODE_UNINIT 0x0001
+#define EXT4_BG_BLOCK_UNINIT 0x0002
+#define EXT4_BG_INODE_ZEROED 0x0004
+
+#define EXT4_MIN_DESC_SIZE 32
+
+struct ext4_super_block
+{
+	uint32_t s_inodes_count;
+	uint32_t s_blocks_count_lo;
+	uint32_t s_r_blocks_count_lo;
+	uint32_t s_free_blocks_count_lo;
+	uint32_t s_free_inodes_count;
+	uint32_t s_first_data_block;
+	uint32_t s_log_block_size;
+	uint32_t s_log_cluster_size;
+	uint32_t s_blocks_per_group;
+	uint32_t s_clusters_per_group;
+	uint32_t s_inodes_per_group;
+	uint32_t s_mtime;
+	uint32_t s_wtime;
+	uint16_t s_mnt_count;
+	uint16_t s_max_mnt_count;
+	uint16_t s_magic;
+	uint16_t s_state;
+	uint16_t s_errors;
+	uint16_t s_minor_rev_level;
+	uint32_t s_lastcheck;
+	uint32_t s_checkinterval;
+	uint32_t s_creator_os;
+	uint32_t s_rev_level;
+	uint16_t s_def_resuid;
+	uint16_t s_def_resgid;
+	uint32_t s_first_ino;
+	uint16_t s_inode_size;
+	uint16_t s_block_group_nr;
+	uint32_t s_feature_compat;
+	uint32_t s_feature_incompat;
+	uint32_t s_feature_ro_compat;
+	uint8_t  s_uuid[16];
+	char     s_volume_name[16];
+	char     s_last_mounted[64];
+	uint32_t s_algorithm_usage_bitmap;
+	uint8_t  s_prealloc_blocks;
+	uint8_t  s_prealloc_dir_blocks;
+	uint16_t s_reserved_gdt_blocks;
+	uint8_t  s_journal_uuid[16];
+	uint32_t s_journal_inum;
+	uint32_t s_journal_dev;
+	uint32_t s_last_orphan;
+	uint32_t s_hash_seed[4];
+	uint8_t  s_def_hash_version;
+	uint8_t  s_jnl_backup_type;
+	uint16_t s_desc_size;
+	uint32_t s_default_mount_opts;
+	uint32_t s_first_meta_bg;
+	uint32_t s_mkfs_time;
+	uint32_t s_jnl_blocks[17];
+	uint32_t s_blocks_count_hi;
+	uint32_t s_r_blocks_count_hi;
+	uint32_t s_free_blocks_count_hi;
+	uint16_t s_min_extra_isize;
+	uint16_t s_want_extra_isize;
+	uint32_t s_flags;
+	uint16_t s_raid_stride;
+	uint16_t s_mmp_interval;
+	uint64_t s_mmp_block;
+	uint32_t s_raid_stripe_width;
+	uint8_t  s_log_groups_per_flex;
+	uint8_t  s_checksum_type;
+	uint16_t s_reserved_pad;
+	uint64_t s_kbytes_written;
+	uint32_t s_snapshot_inum;
+	uint32_t s_snapshot_id;
+	uint64_t s_snapshot_r_blocks_count;
+	uint32_t s_snapshot_list;
+	uint32_t s_error_count;
+	uint32_t s_first_error_time;
+	uint32_t s_first_error_ino;
+	uint64_t s_first_error_block;
+	uint8_t  s_first_error_func[32];
+	uint32_t s_first_error_line;
+	uint32_t s_last_error_time;
+	uint32_t s_last_error_ino;
+	uint32_t s_last_error_line;
+	uint64_t s_last_error_block;
+	uint8_t  s_last_error_func[32];
+	uint8_t  s_mount_opts[64];
+	uint32_t s_usr_quota_inum;
+	uint32_t s_grp_quota_inum;
+	uint32_t s_overhead_clusters;
+	uint32_t s_backup_bgs[2];
+	uint8_t  s_reserved[0x1AC];
+} __attribute__((packed));
+
+static_assert(sizeof(ext4_super_block) == 1024, "ext4 superblock wrong size");
+
+struct ext4_group_desc
+{
+	uint32_t bg_block_bitmap_lo;
+	uint32_t bg_inode_bitmap_lo;
+	uint32_t bg_inode_table_lo;
+	uint16_t bg_free_blocks_count_lo;
+	uint16_t bg_free_inodes_count_lo;
+	uint16_t bg_used_dirs_count_lo;
+	uint16_t bg_flags;
+	uint32_t bg_exclude_bitmap_lo;
+	uint16_t bg_block_bitmap_csum_lo;
+	uint16_t bg_inode_bitmap_csum_lo;
+	uint16_t bg_itable_unused_lo;
+	uint16_t bg_checksum;
+
+	// Only present if EXT4_FEATURE_INCOMPAT_64BIT is set
+	uint32_t bg_block_bitmap_hi;
+	uint32_t bg_inode_bitmap_hi;
+	uint32_t bg_inode_table_hi;
+	uint16_t bg_free_blocks_count_hi;
+	uint16_t bg_free_inodes_count_hi;
+	uint16_t bg_used_dirs_count_hi;
+	uint16_t bg_itable_unused_hi;
+	uint32_t bg_exclude_bitmap_hi;
+	uint16_t bg_block_bitmap_csum_hi;
+	uint16_t bg_inode_bitmap_csum_hi;
+	uint32_t bg_reserved;
+} __attribute__((packed));
+
+static_assert(sizeof(ext4_group_desc) == 64, "ext4 group descriptor wrong size");
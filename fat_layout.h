@@ -0,0 +1,122 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+
+// All fields are little-endian on disk.
+
+struct fat_boot_sector_t
+{
+	uint8_t  BS_jmpBoot[3];
+	char     BS_OEMName[8];
+	uint16_t BPB_BytsPerSec;
+	uint8_t  BPB_SecPerClus;
+	uint16_t BPB_RsvdSecCnt;
+	uint8_t  BPB_NumFATs;
+	uint16_t BPB_RootEntCnt;
+	uint16_t BPB_TotSec16;
+	uint8_t  BPB_Media;
+	uint16_t BPB_FATSz16;
+	uint16_t BPB_SecPerTrk;
+	uint16_t BPB_NumHeads;
+	uint32_t BPB_HiddSec;
+	uint32_t BPB_TotSec32;
+
+	// FAT32 only
+	uint32_t BPB_FATSz32;
+	uint16_t BPB_ExtFlags;
+	uint16_t BPB_FSVer;
+	uint32_t BPB_RootClus;
+	uint16_t BPB_FSInfo;
+	uint16_t BPB_BkBootSec;
+	uint8_t  BPB_Reserved[12];
+	uint8_t  BS_DrvNum;
+	uint8_t  BS_Reserved1;
+	uint8_t  BS_BootSig;
+	uint32_t BS_VolID;
+	char     BS_VolLab[11];
+	char     BS_FilSysType[8];
+	uint8_t  BS_BootCode[420];
+	uint16_t BS_Signature;
+} __attribute__((packed));
+
+static_assert(sizeof(fat_boot_sector_t) == 512, "FAT boot sector wrong size");
+
+#define FAT_SIGNATURE 0xAA55
+
+#define FAT12_MAX_CLUSTERS 4084
+#define FAT16_MAX_CLUSTERS 65524
+
+#define FAT12_BAD_CLUSTER 0x00000FF7
+#define FAT16_BAD_CLUSTER 0x0000FFF7
+#define FAT32_BAD_CLUSTER 0x0FFFFFF7
+#define FAT32_ENTRY_MASK  0x0FFFFFFF
+
+#define FAT32_EXTFLAG_MIRRORING_OFF 0x0080
+#define FAT32_EXTFLAG_ACTIVE_MASK   0x000F
+
+struct exfat_boot_sector_t
+{
+	uint8_t  JumpBoot[3];
+	char     FileSystemName[8];
+	uint8_t  MustBeZero[53];
+	uint64_t PartitionOffset;
+	uint64_t VolumeLength;
+	uint32_t FatOffset;
+	uint32_t FatLength;
+	uint32_t ClusterHeapOffset;
+	uint32_t ClusterCount;
+	uint32_t FirstClusterOfRootDirectory;
+	uint32_t VolumeSerialNumber;
+	uint16_t FileSystemRevision;
+	uint16_t VolumeFlags;
+	uint8_t  BytesPerSectorShift;
+	uint8_t  SectorsPerClusterShift;
+	uint8_t  NumberOfFats;
+	uint8_t  DriveSelect;
+	uint8_t  PercentInUse;
+	uint8_t  Reserved[7];
+	uint8_t  BootCode[390];
+	uint16_t BootSignature;
+} __attribute__((packed));
+
+static_assert(sizeof(exfat_boot_sector_t) == 512, "exFAT boot sector wrong size");
+
+#define EXFAT_VOLUME_FLAG_ACTIVE_FAT 0x0001
+
+#define EXFAT_FIRST_CLUSTER 2
+#define EXFAT_BAD_CLUSTER   0xFFFFFFF7
+
+#define EXFAT_ENTRY_SIZE         32
+#define EXFAT_ENTRY_END          0x00
+#define EXFAT_ENTRY_BITMAP       0x81
+#define EXFAT_BITMAP_FLAG_SECOND 0x01
+
+struct exfat_bitmap_entry_t
+{
+	uint8_t  EntryType;
+	uint8_t  BitmapFlags;
+	uint8_t  Reserved[18];
+	uint32_t FirstCluster;
+	uint64_t DataLength;
+} __attribute__((packed));
+
+static_assert(sizeof(exfat_bitmap_entry_t) == EXFAT_ENTRY_SIZE, "exFAT bitmap entry wrong size");
@@ -0,0 +1,80 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+
+// All fields are big-endian on disk.
+
+#define kHFSPlusSigWord 0x482B // 'H+'
+#define kHFSXSigWord    0x4858 // 'HX'
+
+#define kHFSVolumeHeaderOffset 1024
+#define kHFSAltVolumeHeaderTail 1024
+
+struct HFSPlusExtentDescriptor {
+	uint32_t startBlock;
+	uint32_t blockCount;
+} __attribute__((packed));
+
+struct HFSPlusForkData {
+	uint64_t logicalSize;
+	uint32_t clumpSize;
+	uint32_t totalBlocks;
+	HFSPlusExtentDescriptor extents[8];
+} __attribute__((packed));
+
+struct HFSPlusVolumeHeader {
+	uint16_t signature;
+	uint16_t version;
+	uint32_t attributes;
+	uint32_t lastMountedVersion;
+	uint32_t journalInfoBlock;
+
+	uint32_t createDate;
+	uint32_t modifyDate;
+	uint32_t backupDate;
+	uint32_t checkedDate;
+
+	uint32_t fileCount;
+	uint32_t folderCount;
+
+	uint32_t blockSize;
+	uint32_t totalBlocks;
+	uint32_t freeBlocks;
+
+	uint32_t nextAllocation;
+	uint32_t rsrcClumpSize;
+	uint32_t dataClumpSize;
+	uint32_t nextCatalogID;
+
+	uint32_t writeCount;
+	uint64_t encodingsBitmap;
+
+	uint32_t finderInfo[8];
+
+	HFSPlusForkData allocationFile;
+	HFSPlusForkData extentsFile;
+	HFSPlusForkData catalogFile;
+	HFSPlusForkData attributesFile;
+	HFSPlusForkData startupFile;
+} __attribute__((packed));
+
+static_assert(sizeof(HFSPlusVolumeHeader) == 512, "HFS+ volume header wrong size");
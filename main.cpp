@@ -20,99 +20,952 @@
 #include <cstdio>
 #include <cinttypes>
 #include <cerrno>
+#include <cstdlib>
+
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <csignal>
+
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "AppleSparseimage.h"
+#include "BatchScheduler.h"
+#include "BufferPool.h"
+#include "Numa.h"
+#include "CompactEngine.h"
+#include "CopyEngine.h"
 #include "DeviceLinux.h"
+#include "ExtentList.h"
+#include "FileSystem.h"
+#include "FileSystemRegistry.h"
 #include "GptPartitionMap.h"
-#include "Apfs.h"
+#include "ImageFile.h"
+#include "InstrumentedDevice.h"
+#include "IoTuning.h"
+#include "Journal.h"
+#include "Json.h"
+#include "Manifest.h"
+#include "MbrPartitionMap.h"
+#include "Progress.h"
+#include "RawFileSystem.h"
+#include "RescueMap.h"
+#include "RestoreEngine.h"
+#include "ThrottledDevice.h"
+#include "VerifyEngine.h"
+
+// Write a journal checkpoint after this many bytes
+static constexpr uint64_t CHECKPOINT_INTERVAL = 0x10000000;
+static constexpr unsigned int DEFAULT_RETRIES = 3;
+static constexpr unsigned int PROGRESS_INTERVAL_MS = 1000;
+
+// The original stdout if the statistics go there (--stats=-), all other output then goes to stderr.
+static FILE *s_stats_stdout = nullptr;
+
+static int RedirectStdout()
+{
+	int fd;
+
+	fflush(stdout);
+
+	fd = dup(STDOUT_FILENO);
+	if (fd < 0)
+		return errno;
+	if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0 || !(s_stats_stdout = fdopen(fd, "w"))) {
+		close(fd);
+		return errno;
+	}
+
+	return 0;
+}
+
+static FILE *OpenStats(const char *name)
+{
+	return strcmp(name, "-") ? fopen(name, "w") : s_stats_stdout;
+}
+
+static int WriteStats(const char *name, const InstrumentedDevice &src, const InstrumentedDevice &dst, const ExtentList &plan, double elapsed, int result)
+{
+	FILE *f = OpenStats(name);
+
+	if (!f)
+		return errno;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"result\": %d,\n", result);
+	fprintf(f, "  \"elapsed_s\": %.3f,\n", elapsed);
+	fprintf(f, "  \"planned_extents\": %zu,\n", plan.Count());
+	fprintf(f, "  \"planned_bytes\": %" PRIu64 ",\n", plan.TotalSize());
+	fprintf(f, "  \"buffer_memory\": %" PRIu64 ",\n", BufferPool::Instance().GetAllocated());
+	fprintf(f, "  \"buffers_peak\": %zu,\n", BufferPool::Instance().GetPeakInUse());
+	fprintf(f, "  \"devices\": [\n    ");
+	src.PrintJSON(f);
+	fprintf(f, ",\n    ");
+	dst.PrintJSON(f);
+	fprintf(f, "\n  ]\n}\n");
+
+	if (f != s_stats_stdout)
+		fclose(f);
+	else
+		fflush(f);
 
-int CopyRaw(Device &src, Device &dst, uint64_t start_off, uint64_t end_off)
+	return 0;
+}
+
+static int Verify(Device &src, const InstrumentedDevice &src_stats, ImageFile &image, const char *dst_name, const ExtentList &plan, const char *stats_name)
 {
-	uint8_t buf[0x1000];
-	uint64_t off;
-	size_t size;
+	InstrumentedDevice img(image, "image");
+	VerifyEngine engine(src, img);
+	Progress progress;
 	int err;
 
-	off = start_off;
+	err = image.Open(dst_name, false);
+	if (err) {
+		fprintf(stderr, "Unable to open image file %s: %s\n", dst_name, strerror(err));
+		return err;
+	}
+	if (image.GetSize() != src.GetSize()) {
+		fprintf(stderr, "Image file %s doesn't match the source device.\n", dst_name);
+		return EINVAL;
+	}
+
+	printf("Verifying %zu extents, %" PRIu64 " bytes\n", plan.Count(), plan.TotalSize());
 
-	while (off < end_off) {
-		size = ((end_off - off) > 0x1000) ? 0x1000 : end_off - off;
+	progress.Start(plan.TotalSize(), PROGRESS_INTERVAL_MS);
+	engine.SetProgress(&progress);
 
-		err = src.Read(buf, size, off);
-		if (err) return err;
-		err = dst.Write(buf, size, off);
-		if (err) return err;
+	err = engine.Verify(plan);
+	progress.Finish();
+	printf("Source busy %.1f s, image busy %.1f s\n", src_stats.GetReadStats().busy_ns / 1e9, img.GetReadStats().busy_ns / 1e9);
 
-		off += size;
+	for (const Extent &ext : engine.GetMismatches())
+		printf("Mismatch at %" PRIX64 ", %" PRIu64 " bytes\n", ext.offset, ext.size);
+	for (const Extent &ext : engine.GetUnreadable())
+		printf("Unreadable at %" PRIX64 ", %" PRIu64 " bytes\n", ext.offset, ext.size);
+
+	if (!err) {
+		printf("%zu mismatched ranges, %" PRIu64 " bytes; %zu unreadable ranges, %" PRIu64 " bytes\n",
+			engine.GetMismatches().Count(), engine.GetMismatches().TotalSize(),
+			engine.GetUnreadable().Count(), engine.GetUnreadable().TotalSize());
+		if (engine.GetMismatches().Count() > 0 || engine.GetUnreadable().Count() > 0)
+			err = EIO;
+	} else {
+		fprintf(stderr, "Error verifying data: %d\n", err);
 	}
 
-	return 0;
+	if (stats_name) {
+		int rc = WriteStats(stats_name, src_stats, img, plan, progress.GetElapsed(), err);
+		if (rc)
+			fprintf(stderr, "Unable to write statistics to %s: %s\n", stats_name, strerror(rc));
+	}
+
+	image.Close();
+	return err;
 }
 
-int main(int argc, char *argv[])
+// --numa: bind to the node of the device if there is more than one, not at all, or to a given node
+static constexpr int NUMA_AUTO = -1;
+static constexpr int NUMA_OFF = -2;
+static constexpr uint64_t BRIDGE_AUTO = UINT64_MAX;
+
+// Moves the calling thread, and so the threads it starts later, and the I/O buffers to the NUMA node
+// of dev_name. Buffers then sit next to the controller doing the DMA and the cores copying them.
+static void PlaceOnNode(const char *dev_name, int numa)
+{
+	int node = numa;
+	int rc;
+
+	if (numa == NUMA_OFF)
+		return;
+	if (numa == NUMA_AUTO) {
+		if (NumaNodeCount() < 2)
+			return;
+		node = NumaDeviceNode(dev_name);
+		if (node < 0)
+			return;
+	}
+
+	rc = NumaBindThread(node);
+	if (rc) {
+		fprintf(stderr, "Unable to bind to NUMA node %d: %s\n", node, strerror(rc));
+		return;
+	}
+	BufferPool::Instance().SetNumaAware(true);
+	printf("Running on NUMA node %d\n", node);
+}
+
+static void PrintTuning(const char *dev_name, const IoTuning &tuning)
+{
+	printf("%s: %u/%u byte sectors, %s, max request %u KiB, optimal I/O %u KiB; requests of %zu KiB, %u in flight\n",
+		dev_name, tuning.GetLogicalSectorSize(), tuning.GetPhysicalSectorSize(), tuning.IsRotational() ? "rotational" : "non-rotational",
+		tuning.GetMaxRequest() >> 10, tuning.GetOptimalIoSize() >> 10, tuning.GetRequestSize() >> 10, tuning.GetQueueDepth());
+}
+
+static int Restore(const char *img_name, const char *dev_name, const char *format, bool discard, bool skip_holes, unsigned int threads, int numa, const char *stats_name)
+{
+	std::unique_ptr<ImageFile> image = ImageFile::CreateFormat(format ? format : ImageFile::FormatFromName(img_name));
+	DeviceLinux target;
+	ExtentList extents;
+	IoTuning tuning;
+	Progress progress;
+	int err;
+	int rc;
+
+	if (!image) {
+		fprintf(stderr, "Unknown image format %s\n", format);
+		return EINVAL;
+	}
+
+	err = image->Open(img_name, false);
+	if (err) {
+		fprintf(stderr, "Unable to open image file %s: %s\n", img_name, strerror(err));
+		return err;
+	}
+
+	if (!target.Open(dev_name, true)) {
+		fprintf(stderr, "Unable to open device %s\n", dev_name);
+		return ENOENT;
+	}
+	if (target.GetSize() < image->GetSize()) {
+		fprintf(stderr, "Device %s is smaller than the image.\n", dev_name);
+		return EINVAL;
+	}
+	PlaceOnNode(dev_name, numa);
+
+	if (tuning.Query(dev_name) == 0)
+		PrintTuning(dev_name, tuning);
+	if (threads == 0)
+		threads = tuning.GetQueueDepth();
+
+	err = image->GetAllocatedExtents(extents);
+	if (err) {
+		fprintf(stderr, "Unable to read the allocation of %s: %s\n", img_name, strerror(err));
+		return err;
+	}
+	extents.Sort();
+
+	InstrumentedDevice src_stats(*image, "image");
+	InstrumentedDevice dst(target, "target");
+	RestoreEngine engine(src_stats, dst);
+
+	printf("Restoring %zu extents, %" PRIu64 " bytes\n", extents.Count(), extents.TotalSize());
+
+	engine.SetThreads(threads);
+	engine.SetRequestSize(tuning.GetRequestSize());
+	engine.SetProgress(&progress);
+	if (discard)
+		engine.SetDiscard([&target](uint64_t offset, uint64_t size) { return target.Discard(offset, size); });
+	if (!skip_holes)
+		engine.SetZero([&target](uint64_t offset, uint64_t size) { return target.Zero(offset, size); });
+
+	progress.Start(extents.TotalSize(), PROGRESS_INTERVAL_MS);
+	err = engine.Restore(extents);
+	progress.Finish();
+
+	rc = target.Sync();
+	if (!err) err = rc;
+
+	printf("Image busy %.1f s, target busy %.1f s\n", src_stats.GetReadStats().busy_ns / 1e9, dst.GetWriteStats().busy_ns / 1e9);
+	if (err)
+		fprintf(stderr, "Error restoring data: %d\n", err);
+
+	if (stats_name) {
+		rc = WriteStats(stats_name, src_stats, dst, extents, progress.GetElapsed(), err);
+		if (rc)
+			fprintf(stderr, "Unable to write statistics to %s: %s\n", stats_name, strerror(rc));
+	}
+
+	return err;
+}
+
+static int Compact(const char *src_name, const char *dst_name, const char *format, uint32_t band_size, int numa, const char *stats_name)
 {
-	AppleSparseimage sprs;
+	std::unique_ptr<ImageFile> src = ImageFile::CreateFormat(ImageFile::FormatFromName(src_name));
+	std::unique_ptr<ImageFile> dst;
+	ExtentList extents;
+	Progress progress;
+	struct stat src_st;
+	struct stat dst_st;
+	int err;
+	int rc;
+
+	if (!format)
+		format = ImageFile::FormatFromName(dst_name);
+	dst = ImageFile::CreateFormat(format);
+	if (!dst) {
+		fprintf(stderr, "Unknown image format %s\n", format);
+		return EINVAL;
+	}
+	if (band_size) {
+		if (strcmp(format, "sparseimage")) {
+			fprintf(stderr, "--band-size only applies to sparseimages.\n");
+			return EINVAL;
+		}
+		if (!static_cast<AppleSparseimage *>(dst.get())->SetBandSize(band_size)) {
+			fprintf(stderr, "Invalid band size, must be a power of two between %u and %u.\n",
+				AppleSparseimage::MIN_BAND_SIZE, AppleSparseimage::MAX_BAND_SIZE);
+			return EINVAL;
+		}
+	}
+
+	// Creating the new image would truncate the one being read.
+	if (stat(src_name, &src_st) == 0 && stat(dst_name, &dst_st) == 0 && src_st.st_dev == dst_st.st_dev && src_st.st_ino == dst_st.st_ino) {
+		fprintf(stderr, "%s and %s are the same file.\n", src_name, dst_name);
+		return EINVAL;
+	}
+
+	err = src->Open(src_name, false);
+	if (err) {
+		fprintf(stderr, "Unable to open image file %s: %s\n", src_name, strerror(err));
+		return err;
+	}
+	PlaceOnNode(src_name, numa);
+
+	err = src->GetAllocatedExtents(extents);
+	if (err) {
+		fprintf(stderr, "Unable to read the allocation of %s: %s\n", src_name, strerror(err));
+		return err;
+	}
+	extents.Sort();
+
+	err = dst->Create(dst_name, src->GetSize());
+	if (err) {
+		fprintf(stderr, "Unable to create image file %s: %s\n", dst_name, strerror(err));
+		return err;
+	}
+
+	InstrumentedDevice src_stats(*src, "image");
+	InstrumentedDevice dst_stats(*dst, "compacted");
+	CompactEngine engine(src_stats, dst_stats);
+
+	printf("Compacting %zu extents, %" PRIu64 " bytes\n", extents.Count(), extents.TotalSize());
+
+	engine.SetZeroGranularity(dst->GetAllocationUnit());
+	engine.SetProgress(&progress);
+
+	progress.Start(extents.TotalSize(), PROGRESS_INTERVAL_MS);
+	err = engine.Compact(extents);
+	progress.Finish();
+
+	rc = dst->Flush();
+	if (!err) err = rc;
+
+	if (err) {
+		fprintf(stderr, "Error compacting image: %d\n", err);
+	} else {
+		printf("%" PRIu64 " bytes written, %" PRIu64 " bytes of zeros dropped\n", engine.GetWritten(), engine.GetDropped());
+	}
+
+	if (stats_name) {
+		rc = WriteStats(stats_name, src_stats, dst_stats, extents, progress.GetElapsed(), err);
+		if (rc)
+			fprintf(stderr, "Unable to write statistics to %s: %s\n", stats_name, strerror(rc));
+	}
+
+	dst->Close();
+	return err;
+}
+
+static void PrintSyntax()
+{
+	printf("Syntax: fsdump [options] <srcdevice> <dstfile>\n");
+	printf("        fsdump --restore [--discard] [--skip-holes] [--threads=n] <imagefile> <dstdevice>\n");
+	printf("        fsdump --compact [--format=f] [--band-size=n] <imagefile> <dstfile>\n");
+	printf("        fsdump --batch=jobfile [--jobs=n] [--per-target=n] [--target-rate=n] [options]\n");
+	printf("srcdevice: Block device (whole disk, for example /dev/sda\n");
+	printf("dstfile: Image file to be written, for example image.sparseimage\n");
+	printf("Options:\n");
+	printf("--resume: Continue an interrupted dump into an existing dstfile\n");
+	printf("--recover: Skip unreadable sectors and list them in dstfile.map (ddrescue format)\n");
+	printf("--retries=n: Read attempts for a bad sector in recovery mode (default %u)\n", DEFAULT_RETRIES);
+	printf("--stats=file: Write I/O statistics as JSON to file (- for stdout, other output then goes to stderr)\n");
+	printf("--max-rate=n: Limit reading to n bytes/s, K/M/G suffixes allowed\n");
+	printf("--max-iops=n: Limit reading to n requests/s\n");
+	printf("--latency-target=ms: Reduce the read rate while the average read latency is above ms\n");
+	printf("--control-file=file: Reread the limits from file when it changes or on SIGHUP\n");
+	printf("                     (lines rate=n, iops=n, latency=ms)\n");
+	printf("--hash=list: Hash the data while copying and write dstfile.manifest (sha256, xxh64)\n");
+	printf("--format=f: Image format sparseimage, raw or qcow2 (default from the dstfile extension:\n");
+	printf("            .img, .raw and .dd are raw, .qcow2 is qcow2, anything else sparseimage)\n");
+	printf("--verify: Compare an existing dstfile with the source instead of dumping\n");
+	printf("--restore: Write the data of imagefile back to dstdevice\n");
+	printf("--discard: Discard the unused parts of the image on dstdevice when restoring\n");
+	printf("--skip-holes: Leave the unused parts of the image on dstdevice alone instead of zeroing them\n");
+	printf("--threads=n: Parallel writes when restoring (default from the device, 2 to 8)\n");
+	printf("--compact: Rewrite imagefile into dstfile in disk order, leaving out blocks of zeros\n");
+	printf("--band-size=n: Band size of a new sparseimage when compacting, K/M suffixes allowed (default 1M)\n");
+	printf("--memory=n: Upper limit for the I/O buffers, K/M/G suffixes allowed (default unlimited)\n");
+	printf("--bridge-gaps=n: Read over gaps below n bytes between extents to save requests, 0 = off\n");
+	printf("                 (default 256K on rotational disks, otherwise 0)\n");
+	printf("--calibrate: Measure the source with several request sizes and use the fastest\n");
+	printf("--numa=mode: Run next to the source device (auto, default on multi-node systems), off or a node number\n");
+	printf("--batch=jobfile: Dump several disks at once, one \"<srcdevice> <dstfile>\" per line\n");
+	printf("--jobs=n: Dumps running at once in batch mode (default one per source disk)\n");
+	printf("--per-target=n: Dumps writing to the same filesystem at once (default unlimited)\n");
+	printf("--target-rate=n: Write bandwidth shared by the dumps writing to one filesystem\n");
+}
+
+struct DumpOptions
+{
+	const char *format;
+	const char *stats_name;
+	const char *control_name;
+	ThrottledDevice::Limits limits;
+	unsigned int hash_algorithms;
+	unsigned int hash_threads;
+	unsigned int retries;
+	int numa;
+	bool resume;
+	bool recover;
+	bool verify;
+	bool calibrate;
+	// Largest gap read over to save a request, BRIDGE_AUTO = from the source device
+	uint64_t bridge_gap;
+};
+
+// Dumps (or verifies) one disk. In batch mode, job is the job being run by batch.
+static int Dump(const char *src_name, const char *dst_name, const DumpOptions &opt, BatchScheduler *batch, BatchScheduler::Job *job)
+{
+	std::unique_ptr<ImageFile> image;
 	DeviceLinux bdev;
-	GptPartitionMap pmap;
+	Journal journal;
+	RescueMap rescue_map;
+	std::string journal_name;
+	std::string map_name;
+	std::string manifest_name;
+	Manifest manifest;
+	uint64_t resume_offset = 0;
+	GptPartitionMap gpt;
+	MbrPartitionMap mbr;
+	PartitionMap *pmap;
+	FileSystemRegistry registry;
+	ExtentList plan;
+	ExtentList part;
+	IoTuning tuning;
 	uint64_t start;
 	uint64_t end;
 	int pt;
 	int err;
-	GptPartitionMap::PMAP_Entry pe;
+	PartitionMap::Partition part_info;
 
-	if (argc < 3) {
-		printf("Syntax: fsdump <srcdevice> <dstfile>\n");
-		printf("srcdevice: Block device (whole disk, for example /dev/sda\n");
-		printf("dstfile: Image file to be written, for example image.sparseimage\n");
+	journal_name = std::string(dst_name) + ".journal";
+	map_name = std::string(dst_name) + ".map";
+	manifest_name = std::string(dst_name) + ".manifest";
+
+	image = ImageFile::CreateFormat(opt.format ? opt.format : ImageFile::FormatFromName(dst_name));
+	if (!image) {
+		fprintf(stderr, "Unknown image format %s\n", opt.format);
+		return EINVAL;
+	}
+
+	// The digests of the part copied before the interruption are gone.
+	if (opt.hash_algorithms && opt.resume) {
+		fprintf(stderr, "--hash can't be combined with --resume.\n");
 		return EINVAL;
 	}
 
-	if (!bdev.Open(argv[1]))
+	if (!bdev.Open(src_name))
 	{
-		fprintf(stderr, "Unable to open device %s\n", argv[1]);
+		fprintf(stderr, "Unable to open device %s\n", src_name);
 		return ENOENT;
 	}
+	// Before any worker thread or buffer exists
+	PlaceOnNode(src_name, opt.numa);
+
+	// There's no ioctl for the sector size of an image of a 4Kn disk, but its GPT header is at 4K.
+	if (!bdev.IsBlockDevice()) {
+		bdev.SetSectorSize(0x1000);
+		if (!gpt.LoadAndVerify(bdev))
+			bdev.SetSectorSize(0x200);
+	}
+
+	if (tuning.Query(src_name) == 0)
+		PrintTuning(src_name, tuning);
+	if (opt.calibrate) {
+		err = tuning.Calibrate(src_name);
+		if (err) {
+			fprintf(stderr, "Calibration failed: %s\n", strerror(err));
+		} else {
+			for (const IoTuning::Probe &probe : tuning.GetProbes())
+				printf("  %6zu KiB requests: %8.1f MB/s\n", probe.request_size >> 10, probe.bytes_per_sec / 1e6);
+			printf("Using requests of %zu KiB\n", tuning.GetRequestSize() >> 10);
+		}
+	}
+
+	// Statistics show the device itself, without the time spent waiting for the throttle.
+	InstrumentedDevice src_stats(bdev, "source");
+	ThrottledDevice src(src_stats);
+	InstrumentedDevice dst(*image, "destination");
+	// Only limited in batch mode, where the jobs writing to one filesystem share its bandwidth.
+	ThrottledDevice dst_throttle(dst);
+	Progress progress;
+
+	if (job)
+		progress.SetLabel(job->dst.c_str());
+
+	src.SetLimits(opt.limits);
+	if (opt.control_name) {
+		src.SetControlFile(opt.control_name);
+		signal(SIGHUP, [](int) { ThrottledDevice::RequestReload(); });
+	}
 
-	if (!pmap.LoadAndVerify(bdev)) {
+	// A hybrid MBR also has a valid GPT, which takes precedence.
+	if (gpt.LoadAndVerify(src)) {
+		pmap = &gpt;
+	} else if (mbr.LoadAndVerify(src)) {
+		printf("No GPT found, using MBR\n");
+		pmap = &mbr;
+	} else {
 		fprintf(stderr, "Partition table invalid.\n");
 		return EINVAL;
 	}
-	pmap.ListEntries();
+	pmap->ListEntries();
 
-	err = sprs.Create(argv[2], bdev.GetSize());
+	err = pmap->GetExtents(src, plan);
 	if (err) {
-		perror("Error creating image file: ");
+		fprintf(stderr, "Error reading partition map: %d\n", err);
 		return err;
 	}
 
-	printf("Copying GPT\n");
-	pmap.CopyGPT(bdev, sprs);
-
-	pt = 0;
-	for (;;) {
-		pmap.GetPartitionEntry(pt, pe);
-		if (pe.StartingLBA == 0 || pe.EndingLBA == 0) break;
-		start = pe.StartingLBA * bdev.GetSectorSize();
-		end = (pe.EndingLBA + 1) * bdev.GetSectorSize();
-
-		printf("Copying partition %d: %" PRIX64 " - %" PRIX64 " ", pt, pe.StartingLBA, pe.EndingLBA);
-		if (!memcmp(pe.PartitionTypeGUID, GptPartitionMap::PTYPE_EFI_SYS, sizeof(GptPartitionMap::PM_GUID))) {
-			printf("[EFI SYSTEM]\n");
-			CopyRaw(bdev, sprs, start, end);
-		} else if (!memcmp(pe.PartitionTypeGUID, GptPartitionMap::PTYPE_APFS, sizeof(GptPartitionMap::PM_GUID))) {
-			printf("[APFS]\n");
-			Apfs apfs(bdev, start);
-			err = apfs.CopyData(sprs);
-			if (err) perror("APFS err: ");
+	for (pt = 0; pt < pmap->GetPartitionCount(); pt++) {
+		pmap->GetPartition(pt, part_info);
+		start = part_info.offset;
+		end = part_info.offset + part_info.size;
+
+		const FileSystemRegistry::PartitionType *ptype = registry.FindPartitionType(part_info);
+		const char *fs_name = nullptr;
+
+		printf("Partition %d: %" PRIX64 " - %" PRIX64 " [%s] ", pt, start / src.GetSectorSize(), end / src.GetSectorSize() - 1, ptype ? ptype->label : "Unknown");
+
+		part.Clear();
+		std::unique_ptr<FileSystem> fs = registry.Probe(src, start, end - start, ptype, &fs_name);
+		if (fs) {
+			printf("%s\n", fs_name);
+			err = fs->GetExtents(part);
+			if (err) {
+				fprintf(stderr, "%s err: %d\n", fs_name, err);
+				part.Clear();
+			}
 		} else {
-			printf("[Unknown, skipping]\n");
+			printf("\n");
+			err = ENOTSUP;
 		}
 
-		pt++;
+		// A recognized file system whose allocation can't be read is copied whole rather than lost.
+		if (err && (fs || (ptype && ptype->raw_fallback))) {
+			printf(fs ? "Unable to read the allocation, copying raw\n" : "Not a supported file system, copying raw\n");
+			RawFileSystem raw(src, start, end - start);
+			err = raw.GetExtents(part);
+		}
+
+		if (err == ENOTSUP && !fs) {
+			printf("Unknown file system, skipping\n");
+		} else if (err) {
+			fprintf(stderr, "Unable to plan partition %d: %s\n", pt, strerror(err));
+			return err;
+		} else {
+			plan.Append(part);
+		}
 	}
 
-	sprs.Close();
+	plan.Sort();
+
+	if (opt.verify)
+		return Verify(src, src_stats, *image, dst_name, plan, opt.stats_name);
+
+	if (opt.resume) {
+		// The plan is rebuilt from the source, so the journal tells whether the image belongs to it.
+		err = journal.Open(journal_name.c_str(), plan, bdev.GetSize(), resume_offset);
+		if (err == ESTALE) {
+			fprintf(stderr, "Journal %s doesn't match the source device.\n", journal_name.c_str());
+			return err;
+		} else if (err) {
+			fprintf(stderr, "Unable to open journal %s: %s\n", journal_name.c_str(), strerror(err));
+			return err;
+		}
+
+		err = image->Open(dst_name, true);
+		if (err) {
+			fprintf(stderr, "Unable to open image file %s: %s\n", dst_name, strerror(err));
+			return err;
+		}
+		if (image->GetSize() != bdev.GetSize()) {
+			fprintf(stderr, "Image file %s doesn't match the source device.\n", dst_name);
+			return EINVAL;
+		}
+
+		if (opt.recover) {
+			err = rescue_map.Load(map_name.c_str());
+			if (err && err != ENOENT) {
+				fprintf(stderr, "Unable to read map file %s: %s\n", map_name.c_str(), strerror(err));
+				return err;
+			}
+		}
+
+		printf("Resuming at %" PRIX64 "\n", resume_offset);
+	} else {
+		err = image->Create(dst_name, bdev.GetSize());
+		if (err) {
+			perror("Error creating image file: ");
+			return err;
+		}
+
+		err = journal.Create(journal_name.c_str(), plan, bdev.GetSize());
+		if (err) {
+			fprintf(stderr, "Unable to create journal %s: %s\n", journal_name.c_str(), strerror(err));
+			return err;
+		}
+	}
+
+	// Lays the image out in disk order, however the copy proceeds.
+	err = image->Reserve(plan);
+	if (err) {
+		fprintf(stderr, "Unable to reserve space in %s: %s\n", dst_name, strerror(err));
+		return err;
+	}
+
+	printf("Copying %zu extents, %" PRIu64 " bytes\n", plan.Count(), plan.TotalSize());
+
+	CopyEngine engine(src, dst_throttle);
+	BatchScheduler::ThrottleScope throttle_scope(batch, job, dst_throttle);
+
+	if (opt.recover)
+		engine.SetRecovery(&rescue_map, opt.retries);
+
+	// The band index must be on disk before the journal claims the data below done_offset.
+	engine.SetCheckpoint(CHECKPOINT_INTERVAL, [&](uint64_t done_offset) {
+		int rc = image->Flush();
+		if (!rc && opt.recover) rc = rescue_map.Save(map_name.c_str(), plan, bdev.GetSize(), done_offset);
+		if (rc) return rc;
+		return journal.Checkpoint(done_offset);
+	});
+
+	if (opt.hash_algorithms) {
+		err = manifest.Start(opt.hash_algorithms, opt.hash_threads);
+		if (err) {
+			fprintf(stderr, "Not enough buffer memory for hashing, raise --memory.\n");
+			return err;
+		}
+		engine.SetManifest(&manifest);
+	} else {
+		// Manifest records follow the chunks, they must not depend on the machine doing the dump.
+		engine.SetRequestSize(tuning.GetRequestSize());
+	}
+	engine.SetGapBridging(opt.bridge_gap == BRIDGE_AUTO ? tuning.GetBridgeGap() : opt.bridge_gap);
+
+	progress.Start(plan.TotalSize() - plan.SizeBelow(resume_offset), PROGRESS_INTERVAL_MS);
+	engine.SetProgress(&progress);
+
+	err = engine.Copy(plan, resume_offset);
+	if (opt.hash_algorithms)
+		manifest.Finish();
+	progress.Finish();
+	// Whichever side was busy longer is the bottleneck.
+	printf("Source busy %.1f s, destination busy %.1f s\n", src_stats.GetReadStats().busy_ns / 1e9, dst.GetWriteStats().busy_ns / 1e9);
+	if (engine.GetReadsSaved())
+		printf("Gap bridging saved %" PRIu64 " reads, reading %" PRIu64 " bytes of gaps\n", engine.GetReadsSaved(), engine.GetGapBytes());
+	if (err)
+		fprintf(stderr, "Error copying data: %d, rerun with --resume to continue\n", err);
+
+	if (opt.recover) {
+		rescue_map.Save(map_name.c_str(), plan, bdev.GetSize(), engine.GetDoneOffset());
+		printf("%zu unreadable ranges, %" PRIu64 " bytes, see %s\n", rescue_map.GetBad().Count(), rescue_map.GetBad().TotalSize(), map_name.c_str());
+	}
+
+	if (opt.hash_algorithms && !err) {
+		err = manifest.Save(manifest_name.c_str(), src_name, bdev.GetSize());
+		if (err)
+			fprintf(stderr, "Unable to write manifest %s: %s\n", manifest_name.c_str(), strerror(err));
+	}
+
+	if (opt.stats_name) {
+		int rc = WriteStats(opt.stats_name, src_stats, dst, plan, progress.GetElapsed(), err);
+		if (rc)
+			fprintf(stderr, "Unable to write statistics to %s: %s\n", opt.stats_name, strerror(rc));
+	}
+
+	image->Close();
 	bdev.Close();
 
+	if (!err)
+		journal.Remove();
+
+	return err;
+}
+
+static int WriteBatchStats(const char *name, const BatchScheduler &batch, double elapsed, int result)
+{
+	FILE *f = OpenStats(name);
+	size_t k;
+
+	if (!f)
+		return errno;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"result\": %d,\n", result);
+	fprintf(f, "  \"elapsed_s\": %.3f,\n", elapsed);
+	fprintf(f, "  \"jobs\": [");
+	for (k = 0; k < batch.GetJobs().size(); k++) {
+		const BatchScheduler::Job &job = batch.GetJobs()[k];
+		fprintf(f, "%s\n    { \"source\": \"%s\", \"destination\": \"%s\", \"source_disk\": \"%s\", \"size\": %" PRIu64 ", \"result\": %d, \"elapsed_s\": %.3f }",
+			k ? "," : "", JsonEscape(job.src.c_str()).c_str(), JsonEscape(job.dst.c_str()).c_str(), JsonEscape(job.src_disk.c_str()).c_str(), job.size, job.result, job.elapsed);
+	}
+	fprintf(f, "\n  ]\n}\n");
+
+	if (f != s_stats_stdout)
+		fclose(f);
+	else
+		fflush(f);
+
 	return 0;
 }
+
+static int Batch(const char *job_name, DumpOptions opt, unsigned int jobs, unsigned int per_target, uint64_t target_rate, const char *stats_name)
+{
+	BatchScheduler batch;
+	unsigned int concurrency;
+	unsigned int cpus = std::thread::hardware_concurrency();
+	Progress timer;
+	int err;
+	int rc;
+
+	err = batch.Load(job_name);
+	if (err) {
+		fprintf(stderr, "Unable to read job list %s: %s\n", job_name, strerror(err));
+		return err;
+	}
+	if (batch.GetJobs().empty()) {
+		fprintf(stderr, "No jobs in %s\n", job_name);
+		return EINVAL;
+	}
+
+	batch.SetMaxJobs(jobs);
+	batch.SetMaxPerTarget(per_target);
+	batch.SetTargetRate(target_rate);
+
+	// Every running copy keeps one core busy, the rest is split between their hash workers.
+	concurrency = batch.GetConcurrency();
+	opt.hash_threads = cpus > concurrency ? (cpus - concurrency) / concurrency : 1;
+	if (opt.hash_threads == 0) opt.hash_threads = 1;
+	// The statistics of the batch replace those of the single dumps.
+	opt.stats_name = nullptr;
+
+	printf("%zu jobs, up to %u at once\n", batch.GetJobs().size(), concurrency);
+
+	timer.Start(0, PROGRESS_INTERVAL_MS);
+	err = batch.Run([&](BatchScheduler::Job &job) {
+		int result;
+
+		fprintf(stderr, "%s: dumping %s\n", job.dst.c_str(), job.src.c_str());
+		result = Dump(job.src.c_str(), job.dst.c_str(), opt, &batch, &job);
+		fprintf(stderr, "%s: %s\n", job.dst.c_str(), result ? strerror(result) : "done");
+		return result;
+	});
+
+	for (const BatchScheduler::Job &job : batch.GetJobs())
+		printf("%-6s %8.1f s  %s -> %s\n", job.result ? "FAILED" : "OK", job.elapsed, job.src.c_str(), job.dst.c_str());
+
+	if (stats_name) {
+		rc = WriteBatchStats(stats_name, batch, timer.GetElapsed(), err);
+		if (rc)
+			fprintf(stderr, "Unable to write statistics to %s: %s\n", stats_name, strerror(rc));
+	}
+
+	return err;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_opts[] = {
+		{ "resume", no_argument, nullptr, 'r' },
+		{ "recover", no_argument, nullptr, 'R' },
+		{ "retries", required_argument, nullptr, 't' },
+		{ "stats", required_argument, nullptr, 's' },
+		{ "max-rate", required_argument, nullptr, 'B' },
+		{ "max-iops", required_argument, nullptr, 'I' },
+		{ "latency-target", required_argument, nullptr, 'L' },
+		{ "control-file", required_argument, nullptr, 'C' },
+		{ "verify", no_argument, nullptr, 'V' },
+		{ "hash", required_argument, nullptr, 'H' },
+		{ "format", required_argument, nullptr, 'f' },
+		{ "restore", no_argument, nullptr, 'w' },
+		{ "discard", no_argument, nullptr, 'd' },
+		{ "skip-holes", no_argument, nullptr, 'k' },
+		{ "threads", required_argument, nullptr, 'j' },
+		{ "compact", no_argument, nullptr, 'c' },
+		{ "band-size", required_argument, nullptr, 'b' },
+		{ "memory", required_argument, nullptr, 'm' },
+		{ "numa", required_argument, nullptr, 'N' },
+		{ "calibrate", no_argument, nullptr, 'A' },
+		{ "bridge-gaps", required_argument, nullptr, 'G' },
+		{ "batch", required_argument, nullptr, 'X' },
+		{ "jobs", required_argument, nullptr, 'J' },
+		{ "per-target", required_argument, nullptr, 'P' },
+		{ "target-rate", required_argument, nullptr, 'T' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+
+	DumpOptions dump = { nullptr, nullptr, nullptr, { 0, 0, 0 }, 0, 1, DEFAULT_RETRIES, NUMA_AUTO, false, false, false, false, BRIDGE_AUTO };
+	unsigned int cpus = std::thread::hardware_concurrency();
+	const char *src_name;
+	const char *dst_name;
+	const char *batch_name = nullptr;
+	uint64_t value;
+	bool restore = false;
+	bool discard = false;
+	bool skip_holes = false;
+	bool compact = false;
+	uint32_t band_size = 0;
+	unsigned int threads = 0;
+	unsigned int jobs = 0;
+	unsigned int per_target = 0;
+	uint64_t target_rate = 0;
+	char *end;
+	int opt;
+	int err;
+
+	while ((opt = getopt_long(argc, argv, "", long_opts, nullptr)) != -1) {
+		switch (opt) {
+		case 'r':
+			dump.resume = true;
+			break;
+		case 'R':
+			dump.recover = true;
+			break;
+		case 't':
+			dump.retries = strtoul(optarg, nullptr, 0);
+			break;
+		case 's':
+			dump.stats_name = optarg;
+			break;
+		case 'B':
+		case 'I':
+		case 'L':
+		case 'T':
+			if (!ThrottledDevice::ParseSize(optarg, value)) {
+				PrintSyntax();
+				return EINVAL;
+			}
+			if (opt == 'B')
+				dump.limits.bytes_per_sec = value;
+			else if (opt == 'I')
+				dump.limits.ops_per_sec = value;
+			else if (opt == 'L')
+				dump.limits.latency_us = value * 1000;
+			else
+				target_rate = value;
+			break;
+		case 'C':
+			dump.control_name = optarg;
+			break;
+		case 'V':
+			dump.verify = true;
+			break;
+		case 'f':
+			dump.format = optarg;
+			break;
+		case 'w':
+			restore = true;
+			break;
+		case 'd':
+			discard = true;
+			break;
+		case 'k':
+			skip_holes = true;
+			break;
+		case 'j':
+			threads = strtoul(optarg, nullptr, 0);
+			break;
+		case 'c':
+			compact = true;
+			break;
+		case 'b':
+			if (!ThrottledDevice::ParseSize(optarg, value) || value > UINT32_MAX) {
+				PrintSyntax();
+				return EINVAL;
+			}
+			band_size = value;
+			break;
+		case 'm':
+			if (!ThrottledDevice::ParseSize(optarg, value)) {
+				PrintSyntax();
+				return EINVAL;
+			}
+			BufferPool::Instance().SetBudget(value);
+			break;
+		case 'A':
+			dump.calibrate = true;
+			break;
+		case 'G':
+			if (!ThrottledDevice::ParseSize(optarg, dump.bridge_gap)) {
+				PrintSyntax();
+				return EINVAL;
+			}
+			break;
+		case 'N':
+			if (!strcmp(optarg, "auto")) {
+				dump.numa = NUMA_AUTO;
+			} else if (!strcmp(optarg, "off")) {
+				dump.numa = NUMA_OFF;
+			} else {
+				dump.numa = strtol(optarg, &end, 10);
+				if (*end || end == optarg || dump.numa < 0 || dump.numa >= NumaNodeCount()) {
+					PrintSyntax();
+					return EINVAL;
+				}
+			}
+			break;
+		case 'X':
+			batch_name = optarg;
+			break;
+		case 'J':
+			jobs = strtoul(optarg, nullptr, 0);
+			break;
+		case 'P':
+			per_target = strtoul(optarg, nullptr, 0);
+			break;
+		case 'H':
+			if (!Manifest::ParseAlgorithms(optarg, dump.hash_algorithms)) {
+				PrintSyntax();
+				return EINVAL;
+			}
+			break;
+		default:
+			PrintSyntax();
+			return EINVAL;
+		}
+	}
+
+	// Keep stdout for the JSON, so that it can be piped.
+	if (dump.stats_name && !strcmp(dump.stats_name, "-")) {
+		err = RedirectStdout();
+		if (err) {
+			fprintf(stderr, "Unable to redirect the output: %s\n", strerror(err));
+			return err;
+		}
+	}
+
+	if (batch_name)
+		return Batch(batch_name, dump, jobs, per_target, target_rate, dump.stats_name);
+
+	if (argc - optind < 2) {
+		PrintSyntax();
+		return EINVAL;
+	}
+
+	src_name = argv[optind];
+	dst_name = argv[optind + 1];
+
+	if (restore)
+		return Restore(src_name, dst_name, dump.format, discard, skip_holes, threads, dump.numa, dump.stats_name);
+	if (compact)
+		return Compact(src_name, dst_name, dump.format, band_size, dump.numa, dump.stats_name);
+
+	// Leave one core for the copy itself.
+	dump.hash_threads = cpus > 1 ? cpus - 1 : 1;
+
+	return Dump(src_name, dst_name, dump, nullptr, nullptr);
+}
@@ -0,0 +1,115 @@
+/*
+	This file is part of fsdump, a tool for dumping drives into image files.
+	Copyright (C) 2020 Simon Gander.
+
+	FSDump is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	FSDump is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fsdump.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+
+// All fields are little-endian on disk.
+
+#define NTFS_OEM_ID "NTFS    "
+#define NTFS_BOOT_SIGNATURE 0xAA55
+
+#define NTFS_FILE_MAGIC 0x454C4946 // 'FILE'
+#define NTFS_FIXUP_STRIDE 512
+
+#define NTFS_MFT_RECORD_BITMAP 6
+
+#define NTFS_MFT_RECORD_IN_USE 0x0001
+
+#define NTFS_AT_ATTRIBUTE_LIST 0x20
+#define NTFS_AT_DATA           0x80
+#define NTFS_AT_END            0xFFFFFFFF
+
+struct ntfs_boot_sector
+{
+	uint8_t  jump[3];
+	char     oem_id[8];
+	uint16_t bytes_per_sector;
+	uint8_t  sectors_per_cluster;
+	uint16_t reserved_sectors;
+	uint8_t  fats;
+	uint16_t root_entries;
+	uint16_t sectors;
+	uint8_t  media_type;
+	uint16_t sectors_per_fat;
+	uint16_t sectors_per_track;
+	uint16_t heads;
+	uint32_t hidden_sectors;
+	uint32_t large_sectors;
+	uint8_t  unused[4];
+	uint64_t number_of_sectors;
+	uint64_t mft_lcn;
+	uint64_t mftmirr_lcn;
+	int8_t   clusters_per_mft_record;
+	uint8_t  reserved0[3];
+	int8_t   clusters_per_index_record;
+	uint8_t  reserved1[3];
+	uint64_t volume_serial_number;
+	uint32_t checksum;
+	uint8_t  bootstrap[426];
+	uint16_t end_of_sector_marker;
+} __attribute__((packed));
+
+static_assert(sizeof(ntfs_boot_sector) == 512, "NTFS boot sector wrong size");
+
+struct ntfs_mft_record
+{
+	uint32_t magic;
+	uint16_t usa_ofs;
+	uint16_t usa_count;
+	uint64_t lsn;
+	uint16_t sequence_number;
+	uint16_t link_count;
+	uint16_t attrs_offset;
+	uint16_t flags;
+	uint32_t bytes_in_use;
+	uint32_t bytes_allocated;
+	uint64_t base_mft_record;
+	uint16_t next_attr_instance;
+} __attribute__((packed));
+
+struct ntfs_attr_record
+{
+	uint32_t type;
+	uint32_t length;
+	uint8_t  non_resident;
+	uint8_t  name_length;
+	uint16_t name_offset;
+	uint16_t flags;
+	uint16_t instance;
+	union {
+		struct {
+			uint32_t value_length;
+			uint16_t value_offset;
+			uint8_t  resident_flags;
+			uint8_t  reserved;
+		} __attribute__((packed)) r;
+		struct {
+			int64_t  lowest_vcn;
+			int64_t  highest_vcn;
+			uint16_t mapping_pairs_offset;
+			uint8_t  compression_unit;
+			uint8_t  reserved[5];
+			int64_t  allocated_size;
+			int64_t  data_size;
+			int64_t  initialized_size;
+		} __attribute__((packed)) nr;
+	};
+} __attribute__((packed));